@@ -0,0 +1,376 @@
+#include "jirafeau.h"
+#include "mock_server.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DEFAULT_ITERATIONS 200
+#define BENCH_DEFAULT_SMALL_SIZE 4096
+#define BENCH_DEFAULT_LARGE_MIB  64
+#define BENCH_MULTI_TRANSFERS    8
+
+struct Options {
+  const char *host;
+  int         iterations;
+  size_t      small_size;
+  size_t      large_size;
+};
+
+struct Files {
+  char dir[64];
+  char small[96];
+  char large[96];
+  char output[96];
+};
+
+static int results_printed = 0;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int count, double p) {
+  int index = (int)(p / 100 * (count - 1) + 0.5);
+
+  return count ? sorted[index] : 0;
+}
+
+static void print_separator(void) {
+  printf(results_printed++ ? ",\n    " : "\n    ");
+}
+
+/**
+ * Prints a benchmark of many small operations, `latencies` (seconds) get
+ * sorted.
+ */
+static void print_ops(const char *name, double *latencies, int count,
+                      int failed, double seconds) {
+  qsort(latencies, count, sizeof(double), compare_doubles);
+
+  print_separator();
+  printf("{\"name\":\"%s\",\"ops\":%d,\"failed\":%d,\"seconds\":%.6f,"
+         "\"ops_per_sec\":%.1f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,"
+         "\"p99_ms\":%.3f}",
+         name, count, failed, seconds, seconds > 0 ? count / seconds : 0,
+         percentile(latencies, count, 50) * 1000,
+         percentile(latencies, count, 90) * 1000,
+         percentile(latencies, count, 99) * 1000);
+}
+
+static void print_throughput(const char *name, size_t bytes, bool ok,
+                             double seconds) {
+  print_separator();
+  printf("{\"name\":\"%s\",\"bytes\":%zu,\"ok\":%s,\"seconds\":%.6f,"
+         "\"mib_per_sec\":%.1f}",
+         name, bytes, ok ? "true" : "false", seconds,
+         seconds > 0 ? bytes / seconds / (1024 * 1024) : 0);
+}
+
+static bool write_test_file(const char *path, size_t size) {
+  FILE *file = fopen(path, "wb");
+  char  block[65536];
+
+  if (!file) {
+    return false;
+  }
+  for (size_t i = 0; i < sizeof(block); i++) {
+    block[i] = (char)(i * 2654435761u >> 24);
+  }
+  for (size_t done = 0; done < size;) {
+    size_t n = size - done < sizeof(block) ? size - done : sizeof(block);
+    if (fwrite(block, 1, n, file) != n) {
+      fclose(file);
+      return false;
+    }
+    done += n;
+  }
+  return fclose(file) == 0;
+}
+
+static void free_upload(UploadResultT *result) {
+  free(result->file_id);
+  free(result->delete_key);
+  free(result->crypt_key);
+}
+
+/**
+ * Uploads the small file `iterations` times, through one client or with a
+ * fresh connection each time. The results are kept for the download and
+ * delete benchmarks.
+ */
+static void bench_small_uploads(const struct Options *options,
+                                const struct Files *files, bool reuse,
+                                UploadResultT *uploads, double *latencies) {
+  JirafeauClientT *client = reuse ? jirafeau_client_new(options->host) : NULL;
+  int              failed = 0;
+  double           start  = now();
+
+  for (int i = 0; i < options->iterations; i++) {
+    double begin = now();
+
+    uploads[i] = reuse ? jirafeau_client_upload(client, files->small, "none",
+                                                NULL, 0, NULL, NULL)
+                       : jirafeau_upload(files->small, "none", NULL, 0, NULL,
+                                         NULL);
+    latencies[i] = now() - begin;
+    failed      += uploads[i].state != SUCCESS;
+  }
+
+  print_ops(reuse ? "upload_small_client" : "upload_small_oneshot",
+            latencies, options->iterations, failed, now() - start);
+  jirafeau_client_free(client);
+}
+
+static void bench_small_downloads(const struct Options *options,
+                                  const struct Files *files,
+                                  const UploadResultT *uploads,
+                                  double *latencies) {
+  JirafeauClientT *client = jirafeau_client_new(options->host);
+  int              failed = 0;
+  double           start  = now();
+
+  for (int i = 0; i < options->iterations; i++) {
+    double          begin  = now();
+    DownloadResultT result = jirafeau_client_download(client,
+                                                      uploads[i].file_id,
+                                                      files->output, NULL,
+                                                      NULL);
+
+    latencies[i] = now() - begin;
+    failed      += result.state != SUCCESS;
+    free(result.download_path);
+  }
+
+  print_ops("download_small_client", latencies, options->iterations, failed,
+            now() - start);
+  jirafeau_client_free(client);
+}
+
+static void bench_deletes(const struct Options *options,
+                          UploadResultT *uploads, double *latencies) {
+  JirafeauClientT *client = jirafeau_client_new(options->host);
+  int              failed = 0;
+  double           start  = now();
+
+  for (int i = 0; i < options->iterations; i++) {
+    double        begin  = now();
+    DeleteResultT result = jirafeau_client_delete(client, uploads[i].file_id,
+                                                  uploads[i].delete_key);
+
+    latencies[i] = now() - begin;
+    failed      += result.state != SUCCESS;
+  }
+
+  print_ops("delete_client", latencies, options->iterations, failed,
+            now() - start);
+  jirafeau_client_free(client);
+}
+
+struct MultiUpload {
+  double  begin;
+  double *latency;
+  int *   failed;
+};
+
+static void multi_uploaded(JirafeauTransferT *transfer,
+                           const OperationResultT *result, void *userdata) {
+  struct MultiUpload *upload = (struct MultiUpload *)userdata;
+  UploadResultT       copy   = result->upload;
+
+  *upload->latency = now() - upload->begin;
+  *upload->failed += copy.state != SUCCESS;
+  free_upload(&copy);
+}
+
+static void bench_multi_uploads(const struct Options *options,
+                                const struct Files *files, double *latencies) {
+  JirafeauMultiT *    multi   = jirafeau_multi_new(options->host,
+                                                   BENCH_MULTI_TRANSFERS);
+  struct MultiUpload *uploads = calloc(options->iterations,
+                                       sizeof(struct MultiUpload));
+  int                 failed  = 0;
+  double              start   = now();
+
+  /* latencies include the time spent queued, like a user would see them */
+  for (int i = 0; i < options->iterations; i++) {
+    uploads[i].begin   = now();
+    uploads[i].latency = &latencies[i];
+    uploads[i].failed  = &failed;
+    jirafeau_multi_upload(multi, files->small, "none", NULL, 0, NULL, NULL,
+                          multi_uploaded, &uploads[i]);
+  }
+  while (jirafeau_multi_perform(multi, 1000) > 0) {
+  }
+
+  print_ops("upload_small_multi", latencies, options->iterations, failed,
+            now() - start);
+  jirafeau_multi_free(multi);
+  free(uploads);
+}
+
+static void bench_large(const struct Options *options,
+                        const struct Files *files) {
+  JirafeauClientT *client = jirafeau_client_new(options->host);
+  UploadResultT    upload, chunked;
+  DownloadResultT  download;
+  double           begin;
+
+  begin  = now();
+  upload = jirafeau_client_upload(client, files->large, "none", NULL, 0, NULL,
+                                  NULL);
+  print_throughput("upload_large", options->large_size,
+                   upload.state == SUCCESS, now() - begin);
+
+  begin   = now();
+  chunked = jirafeau_client_upload_chunked(client, files->large, "none", NULL,
+                                           0, NULL, NULL, 0);
+  print_throughput("upload_large_chunked", options->large_size,
+                   chunked.state == SUCCESS, now() - begin);
+
+  begin    = now();
+  download = jirafeau_client_download(client, upload.file_id, files->output,
+                                      NULL, NULL);
+  print_throughput("download_large", options->large_size,
+                   download.state == SUCCESS, now() - begin);
+  free(download.download_path);
+
+  begin    = now();
+  download = jirafeau_client_download_segmented(client, upload.file_id,
+                                                files->output, NULL, NULL, 0);
+  print_throughput("download_large_segmented", options->large_size,
+                   download.state == SUCCESS, now() - begin);
+  free(download.download_path);
+
+  if (upload.state == SUCCESS) {
+    jirafeau_client_delete(client, upload.file_id, upload.delete_key);
+  }
+  if (chunked.state == SUCCESS) {
+    jirafeau_client_delete(client, chunked.file_id, chunked.delete_key);
+  }
+  free_upload(&upload);
+  free_upload(&chunked);
+  jirafeau_client_free(client);
+}
+
+static void show_help(void) {
+  printf("jirafeau_bench [options]\n");
+  printf("  -H, --host [url] (benchmark a real server instead of the "
+         "built-in one)\n");
+  printf("  -n, --iterations [n] (small operations per benchmark, default "
+         "%d)\n", BENCH_DEFAULT_ITERATIONS);
+  printf("  -s, --small-size [bytes] (default %d)\n",
+         BENCH_DEFAULT_SMALL_SIZE);
+  printf("  -l, --large-size [MiB] (default %d)\n", BENCH_DEFAULT_LARGE_MIB);
+}
+
+int main(int argc, char *argv[]) {
+  struct Options options = { NULL, BENCH_DEFAULT_ITERATIONS,
+                             BENCH_DEFAULT_SMALL_SIZE,
+                             (size_t)BENCH_DEFAULT_LARGE_MIB * 1024 * 1024 };
+  struct Files   files;
+  char           mock_host[64];
+  pid_t          server = -1;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+
+    if ((strcmp(argv[i], "-H") == 0 || strcmp(argv[i], "--host") == 0) &&
+        has_value) {
+      options.host = argv[++i];
+    } else if ((strcmp(argv[i], "-n") == 0 ||
+                strcmp(argv[i], "--iterations") == 0) &&
+               has_value && atoi(argv[i + 1]) > 0) {
+      options.iterations = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "-s") == 0 ||
+                strcmp(argv[i], "--small-size") == 0) &&
+               has_value) {
+      options.small_size = strtoul(argv[++i], NULL, 10);
+    } else if ((strcmp(argv[i], "-l") == 0 ||
+                strcmp(argv[i], "--large-size") == 0) &&
+               has_value && atoi(argv[i + 1]) > 0) {
+      options.large_size = (size_t)atoi(argv[++i]) * 1024 * 1024;
+    } else {
+      show_help();
+      return 1;
+    }
+  }
+
+  /* fork the server before libcurl starts any threads */
+  if (!options.host) {
+    int port;
+
+    server = mock_server_start(&port);
+    if (server == -1) {
+      return 1;
+    }
+    snprintf(mock_host, sizeof(mock_host), "http://127.0.0.1:%d", port);
+    options.host = mock_host;
+  }
+  jirafeau_set_host(options.host);
+
+  snprintf(files.dir, sizeof(files.dir), "/tmp/jirafeau_bench.XXXXXX");
+  if (!mkdtemp(files.dir)) {
+    perror("Error: Could not create a temporary directory\n");
+    mock_server_stop(server);
+    return 1;
+  }
+  snprintf(files.small, sizeof(files.small), "%s/small.bin", files.dir);
+  snprintf(files.large, sizeof(files.large), "%s/large.bin", files.dir);
+  snprintf(files.output, sizeof(files.output), "%s/output.bin", files.dir);
+
+  if (!write_test_file(files.small, options.small_size) ||
+      !write_test_file(files.large, options.large_size)) {
+    perror("Error: Could not write the test files\n");
+    mock_server_stop(server);
+    return 1;
+  }
+
+  UploadResultT *uploads   = calloc(options.iterations, sizeof(UploadResultT));
+  double *       latencies = calloc(options.iterations, sizeof(double));
+
+  printf("{\n  \"host\": \"%s\",\n  \"iterations\": %d,\n"
+         "  \"small_size\": %zu,\n  \"large_size\": %zu,\n  \"results\": [",
+         server > 0 ? "mock" : options.host, options.iterations,
+         options.small_size, options.large_size);
+
+  bench_small_uploads(&options, &files, false, uploads, latencies);
+  for (int i = 0; i < options.iterations; i++) {
+    free_upload(&uploads[i]);
+  }
+  bench_small_uploads(&options, &files, true, uploads, latencies);
+  bench_small_downloads(&options, &files, uploads, latencies);
+  bench_deletes(&options, uploads, latencies);
+  bench_multi_uploads(&options, &files, latencies);
+  bench_large(&options, &files);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("\n  ],\n  \"peak_rss_kib\": %ld\n}\n", usage.ru_maxrss);
+
+  for (int i = 0; i < options.iterations; i++) {
+    free_upload(&uploads[i]);
+  }
+  free(uploads);
+  free(latencies);
+
+  unlink(files.small);
+  unlink(files.large);
+  unlink(files.output);
+  rmdir(files.dir);
+  mock_server_stop(server);
+  return 0;
+}
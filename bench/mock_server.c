@@ -0,0 +1,678 @@
+#define _GNU_SOURCE /* memmem, strcasestr */
+#include "mock_server.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* room for the request line and headers of one request */
+#define HEADERS_BUFFER_SIZE (64 * 1024)
+
+/**
+ * A file on the server. Async uploads are stored from init_async on and
+ * become visible under `id` with end_async.
+ */
+struct StoredFile {
+  char               id[16];
+  char               delete_key[16];
+  char               ref[16];
+  char               code[16];
+  char *             name;
+  char *             data;
+  size_t             size;
+  size_t             capacity;
+  bool               complete;
+  bool               deleted;
+  int                users; /* downloads sending `data` right now */
+  struct StoredFile *next;
+};
+
+static struct StoredFile *files;
+static unsigned long      next_number;
+static pthread_mutex_t    files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct Connection {
+  int    fd;
+  char   buffer[HEADERS_BUFFER_SIZE];
+  size_t start;
+  size_t end;
+};
+
+struct Request {
+  char   method[16];
+  char   target[2048];
+  char   content_type[256];
+  char   range[256];
+  size_t content_length;
+  bool   chunked;
+  bool   expect_continue;
+  bool   close;
+  char * body;
+  size_t body_size;
+};
+
+static bool send_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+/**
+ * Sends a response, `headers` are extra header lines each ending in CRLF.
+ */
+static bool respond(int fd, int status, const char *headers, const char *body,
+                    size_t size) {
+  char head[1024];
+  int  len = snprintf(head, sizeof(head),
+                      "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n%s\r\n",
+                      status,
+                      status == 200   ? "OK"
+                      : status == 206 ? "Partial Content"
+                      : status == 404 ? "Not Found"
+                                      : "Range Not Satisfiable",
+                      size, headers ? headers : "");
+
+  return send_all(fd, head, len) && send_all(fd, body, size);
+}
+
+static bool respond_text(int fd, const char *text) {
+  return respond(fd, 200, "Content-Type: text/plain\r\n", text,
+                 strlen(text));
+}
+
+static bool respond_page(int fd, const char *message) {
+  char page[512];
+  int  len = snprintf(page, sizeof(page),
+                      "<html><body><div class=\"message\"><p>%s</p></div>"
+                      "</body></html>",
+                      message);
+
+  return respond(fd, 200, "Content-Type: text/html\r\n", page, len);
+}
+
+/**
+ * Reads more of the connection into its buffer.
+ *
+ * @return false on EOF, error or a full buffer
+ */
+static bool fill(struct Connection *conn) {
+  if (conn->start == conn->end) {
+    conn->start = conn->end = 0;
+  } else if (conn->end == sizeof(conn->buffer)) {
+    memmove(conn->buffer, conn->buffer + conn->start,
+            conn->end - conn->start);
+    conn->end  -= conn->start;
+    conn->start = 0;
+  }
+  if (conn->end == sizeof(conn->buffer)) {
+    return false;
+  }
+
+  ssize_t n = recv(conn->fd, conn->buffer + conn->end,
+                   sizeof(conn->buffer) - conn->end, 0);
+  if (n <= 0) {
+    return false;
+  }
+  conn->end += n;
+  return true;
+}
+
+static bool read_exact(struct Connection *conn, char *dst, size_t size) {
+  size_t buffered = conn->end - conn->start;
+  size_t take     = buffered < size ? buffered : size;
+
+  memcpy(dst, conn->buffer + conn->start, take);
+  conn->start += take;
+
+  for (size_t done = take; done < size;) {
+    ssize_t n = recv(conn->fd, dst + done, size - done, 0);
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+/**
+ * Waits for a line ending in CRLF.
+ *
+ * @return Length of the line without CRLF or -1 if the connection ended
+ */
+static ssize_t find_line(struct Connection *conn) {
+  for (;;) {
+    char *crlf = memmem(conn->buffer + conn->start, conn->end - conn->start,
+                        "\r\n", 2);
+    if (crlf) {
+      return crlf - (conn->buffer + conn->start);
+    }
+    if (!fill(conn)) {
+      return -1;
+    }
+  }
+}
+
+static void header_value(const char *line, size_t len, char *out,
+                         size_t size) {
+  const char *value = memchr(line, ':', len);
+  size_t      n;
+
+  if (!value) {
+    out[0] = '\0';
+    return;
+  }
+  for (value++; *value == ' '; value++) {
+  }
+  n = len - (value - line);
+  if (n >= size) {
+    n = size - 1;
+  }
+  memcpy(out, value, n);
+  out[n] = '\0';
+}
+
+static bool read_headers(struct Connection *conn, struct Request *req) {
+  ssize_t len = find_line(conn);
+
+  if (len < 0) {
+    return false;
+  }
+
+  char line[HEADERS_BUFFER_SIZE];
+  memcpy(line, conn->buffer + conn->start, len);
+  line[len]    = '\0';
+  conn->start += len + 2;
+  if (sscanf(line, "%15s %2047s", req->method, req->target) != 2) {
+    return false;
+  }
+
+  while ((len = find_line(conn)) > 0) {
+    char  value[256];
+    char *header = conn->buffer + conn->start;
+
+    header_value(header, len, value, sizeof(value));
+    if (strncasecmp(header, "content-length:", 15) == 0) {
+      req->content_length = strtoull(value, NULL, 10);
+    } else if (strncasecmp(header, "content-type:", 13) == 0) {
+      strcpy(req->content_type, value);
+    } else if (strncasecmp(header, "range:", 6) == 0) {
+      snprintf(req->range, sizeof(req->range), "%s", value);
+    } else if (strncasecmp(header, "transfer-encoding:", 18) == 0) {
+      req->chunked = strcasestr(value, "chunked") != NULL;
+    } else if (strncasecmp(header, "expect:", 7) == 0) {
+      req->expect_continue = strcasestr(value, "100-continue") != NULL;
+    } else if (strncasecmp(header, "connection:", 11) == 0) {
+      req->close = strcasestr(value, "close") != NULL;
+    }
+    conn->start += len + 2;
+  }
+  if (len < 0) {
+    return false;
+  }
+  conn->start += 2;
+  return true;
+}
+
+static bool read_body(struct Connection *conn, struct Request *req) {
+  if (req->expect_continue &&
+      !send_all(conn->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25)) {
+    return false;
+  }
+
+  if (!req->chunked) {
+    req->body      = malloc(req->content_length + 1);
+    req->body_size = req->content_length;
+    return req->body && read_exact(conn, req->body, req->body_size);
+  }
+
+  size_t capacity = 0;
+  for (;;) {
+    ssize_t len = find_line(conn);
+    if (len < 0) {
+      return false;
+    }
+    size_t size  = strtoul(conn->buffer + conn->start, NULL, 16);
+    conn->start += len + 2;
+
+    if (size == 0) {
+      /* curl sends no trailers, only the final CRLF */
+      if (find_line(conn) != 0) {
+        return false;
+      }
+      conn->start += 2;
+      return true;
+    }
+
+    if (req->body_size + size + 1 > capacity) {
+      capacity = (req->body_size + size + 1) * 2;
+      char *body = realloc(req->body, capacity);
+      if (!body) {
+        return false;
+      }
+      req->body = body;
+    }
+    if (!read_exact(conn, req->body + req->body_size, size)) {
+      return false;
+    }
+    req->body_size += size;
+
+    if (find_line(conn) != 0) {
+      return false;
+    }
+    conn->start += 2;
+  }
+}
+
+/**
+ * Finds a parameter of the query string, parameters without a value have
+ * an empty one.
+ */
+static bool query_get(const char *query, const char *key, char *out,
+                      size_t size) {
+  size_t key_len = strlen(key);
+
+  while (query && *query) {
+    size_t len = strcspn(query, "&");
+    if (strncmp(query, key, key_len) == 0 &&
+        (len == key_len || query[key_len] == '=')) {
+      size_t n = len > key_len ? len - key_len - 1 : 0;
+      if (n >= size) {
+        n = size - 1;
+      }
+      memcpy(out, query + len - n, n);
+      out[n] = '\0';
+      return true;
+    }
+    query += len + (query[len] == '&');
+  }
+  return false;
+}
+
+/**
+ * Finds a field of a multipart/form-data body.
+ *
+ * @param filename Receives the filename of the field if it has one
+ * (optional)
+ */
+static bool form_field(const struct Request *req, const char *name,
+                       const char **data, size_t *size, char *filename,
+                       size_t filename_size) {
+  const char *boundary = strstr(req->content_type, "boundary=");
+  char        delimiter[256];
+  char        wanted[128];
+
+  if (!boundary || !req->body) {
+    return false;
+  }
+  boundary += 9;
+  snprintf(delimiter, sizeof(delimiter), "\r\n--%.*s",
+           (int)strcspn(boundary, "\";"), boundary + (*boundary == '"'));
+  snprintf(wanted, sizeof(wanted), "name=\"%s\"", name);
+
+  const char *end  = req->body + req->body_size;
+  size_t      dlen = strlen(delimiter);
+
+  /* the first delimiter has no CRLF in front */
+  const char *part = memmem(req->body, req->body_size, delimiter + 2,
+                            dlen - 2);
+  if (!part) {
+    return false;
+  }
+  part += dlen - 2;
+
+  while (part + 2 <= end && strncmp(part, "--", 2) != 0) {
+    const char *headers = part + 2;
+    const char *body    = memmem(headers, end - headers, "\r\n\r\n", 4);
+    if (!body) {
+      return false;
+    }
+    body += 4;
+
+    const char *next = memmem(body, end - body, delimiter, dlen);
+    if (!next) {
+      return false;
+    }
+
+    const char *found = memmem(headers, body - headers, wanted,
+                               strlen(wanted));
+    if (found) {
+      const char *fname = memmem(headers, body - headers, "filename=\"", 10);
+      if (filename && fname) {
+        size_t n = strcspn(fname + 10, "\"");
+        if (n >= filename_size) {
+          n = filename_size - 1;
+        }
+        memcpy(filename, fname + 10, n);
+        filename[n] = '\0';
+      } else if (filename) {
+        filename[0] = '\0';
+      }
+      *data = body;
+      *size = next - body;
+      return true;
+    }
+    part = next + dlen;
+  }
+  return false;
+}
+
+/**
+ * Looks up a file, needs `files_lock`.
+ */
+static struct StoredFile *find_file(const char *id, const char *ref) {
+  for (struct StoredFile *file = files; file; file = file->next) {
+    if (file->deleted) {
+      continue;
+    }
+    if (id && file->complete && strcmp(file->id, id) == 0) {
+      return file;
+    }
+    if (ref && !file->complete && strcmp(file->ref, ref) == 0) {
+      return file;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Adds a file, needs `files_lock`.
+ */
+static struct StoredFile *add_file(const char *name) {
+  struct StoredFile *file = calloc(1, sizeof(struct StoredFile));
+
+  file->name = strdup(name);
+  file->next = files;
+  files      = file;
+  return file;
+}
+
+/**
+ * Makes the file visible under a new id, needs `files_lock`.
+ */
+static void publish_file(struct StoredFile *file) {
+  unsigned long number = next_number++;
+
+  snprintf(file->id, sizeof(file->id), "f%07lu", number);
+  snprintf(file->delete_key, sizeof(file->delete_key), "d%04lu",
+           number % 10000);
+  file->complete = true;
+}
+
+static void release_file(struct StoredFile *file) {
+  pthread_mutex_lock(&files_lock);
+  if (--file->users == 0 && file->deleted) {
+    free(file->data);
+    file->data = NULL;
+  }
+  pthread_mutex_unlock(&files_lock);
+}
+
+static bool handle_script(int fd, const struct Request *req,
+                          const char *query) {
+  char        answer[128];
+  char        value[64];
+  char        filename[256];
+  const char *data;
+  size_t      size;
+
+  pthread_mutex_lock(&files_lock);
+
+  if (query_get(query, "init_async", value, sizeof(value))) {
+    if (!form_field(req, "filename", &data, &size, NULL, 0)) {
+      pthread_mutex_unlock(&files_lock);
+      return respond_text(fd, "Error");
+    }
+    snprintf(filename, sizeof(filename), "%.*s", (int)size, data);
+
+    struct StoredFile *file = add_file(filename);
+    snprintf(file->ref, sizeof(file->ref), "r%07lu", next_number++);
+    snprintf(file->code, sizeof(file->code), "c%lu", next_number++);
+    snprintf(answer, sizeof(answer), "%s\n%s", file->ref, file->code);
+  } else if (query_get(query, "push_async", value, sizeof(value)) ||
+             query_get(query, "end_async", value, sizeof(value))) {
+    struct StoredFile *file = NULL;
+    bool push = query_get(query, "push_async", value, sizeof(value));
+    const char *       ref, *code;
+    size_t             ref_size, code_size;
+
+    if (form_field(req, "ref", &ref, &ref_size, NULL, 0) &&
+        form_field(req, "code", &code, &code_size, NULL, 0)) {
+      char ref_value[16], code_value[16];
+
+      snprintf(ref_value, sizeof(ref_value), "%.*s", (int)ref_size, ref);
+      snprintf(code_value, sizeof(code_value), "%.*s", (int)code_size, code);
+      file = find_file(NULL, ref_value);
+      if (file && strcmp(file->code, code_value) != 0) {
+        file = NULL;
+      }
+    }
+
+    if (!file || (push && !form_field(req, "data", &data, &size, NULL, 0))) {
+      pthread_mutex_unlock(&files_lock);
+      return respond_text(fd, "Error");
+    }
+
+    if (push) {
+      if (file->size + size > file->capacity) {
+        file->capacity = (file->size + size) * 2;
+        file->data     = realloc(file->data, file->capacity);
+      }
+      memcpy(file->data + file->size, data, size);
+      file->size += size;
+      snprintf(file->code, sizeof(file->code), "c%lu", next_number++);
+      snprintf(answer, sizeof(answer), "%s", file->code);
+    } else {
+      publish_file(file);
+      snprintf(answer, sizeof(answer), "%s\n%s\n", file->id,
+               file->delete_key);
+    }
+  } else if (form_field(req, "file", &data, &size, filename,
+                        sizeof(filename))) {
+    struct StoredFile *file = add_file(filename);
+    file->data = malloc(size ? size : 1);
+    memcpy(file->data, data, size);
+    file->size = file->capacity = size;
+    publish_file(file);
+    snprintf(answer, sizeof(answer), "%s\n%s\n", file->id, file->delete_key);
+  } else {
+    snprintf(answer, sizeof(answer), "Error: no file");
+  }
+
+  pthread_mutex_unlock(&files_lock);
+  return respond_text(fd, answer);
+}
+
+static bool send_file(int fd, const struct Request *req,
+                      struct StoredFile *file) {
+  char   headers[512];
+  size_t start = 0;
+  size_t end   = file->size ? file->size - 1 : 0;
+  int    status = 200;
+  int    len;
+
+  len = snprintf(headers, sizeof(headers),
+                 "Content-Type: application/octet-stream\r\n"
+                 "Content-Disposition: attachment; filename=\"%s\"\r\n"
+                 "Accept-Ranges: bytes\r\n",
+                 file->name);
+
+  if (req->range[0]) {
+    unsigned long long first, last = end;
+    int fields = sscanf(req->range, "bytes=%llu-%llu", &first, &last);
+
+    if (fields < 1 || first >= file->size) {
+      snprintf(headers + len, sizeof(headers) - len,
+               "Content-Range: bytes */%zu\r\n", file->size);
+      return respond(fd, 416, headers, "", 0);
+    }
+    start  = first;
+    end    = last < file->size ? last : file->size - 1;
+    status = 206;
+    snprintf(headers + len, sizeof(headers) - len,
+             "Content-Range: bytes %zu-%zu/%zu\r\n", start, end, file->size);
+  }
+
+  return respond(fd, status, headers, file->data + start,
+                 file->size ? end - start + 1 : 0);
+}
+
+static bool handle_file(int fd, const struct Request *req, const char *query) {
+  char id[64], d[64];
+
+  if (!query_get(query, "h", id, sizeof(id))) {
+    return respond_page(fd, "Sorry, the requested file is not found");
+  }
+
+  pthread_mutex_lock(&files_lock);
+  struct StoredFile *file = find_file(id, NULL);
+
+  if (!file) {
+    pthread_mutex_unlock(&files_lock);
+    return respond_page(fd, "Sorry, the requested file is not found");
+  }
+
+  if (query_get(query, "d", d, sizeof(d)) && strcmp(d, "1") != 0) {
+    bool deleted = strcmp(d, file->delete_key) == 0;
+    if (deleted) {
+      file->deleted = true;
+      if (file->users == 0) {
+        free(file->data);
+        file->data = NULL;
+      }
+    }
+    pthread_mutex_unlock(&files_lock);
+    return respond_page(fd, deleted ? "File has been deleted."
+                                    : "Wrong delete code.");
+  }
+
+  /* the data is sent without the lock, a delete keeps it around */
+  file->users++;
+  pthread_mutex_unlock(&files_lock);
+
+  bool ok = send_file(fd, req, file);
+  release_file(file);
+  return ok;
+}
+
+static void *serve_connection(void *arg) {
+  struct Connection *conn = (struct Connection *)arg;
+  int                one  = 1;
+
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  for (;;) {
+    struct Request req = { 0 };
+
+    if (!read_headers(conn, &req)) {
+      break;
+    }
+    if ((req.content_length || req.chunked) && !read_body(conn, &req)) {
+      free(req.body);
+      break;
+    }
+
+    char *query = strchr(req.target, '?');
+    if (query) {
+      *query++ = '\0';
+    }
+
+    bool ok;
+    if (strstr(req.target, "script.php")) {
+      ok = handle_script(conn->fd, &req, query);
+    } else if (strstr(req.target, "f.php")) {
+      ok = handle_file(conn->fd, &req, query);
+    } else {
+      ok = respond(conn->fd, 404, NULL, "not found", 9);
+    }
+    free(req.body);
+
+    if (!ok || req.close) {
+      break;
+    }
+  }
+
+  close(conn->fd);
+  free(conn);
+  return NULL;
+}
+
+static void serve(int listen_fd) {
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+      continue;
+    }
+
+    struct Connection *conn = calloc(1, sizeof(struct Connection));
+    pthread_t          thread;
+
+    conn->fd = fd;
+    if (pthread_create(&thread, NULL, serve_connection, conn) != 0) {
+      close(fd);
+      free(conn);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+pid_t mock_server_start(int *port) {
+  struct sockaddr_in addr = { 0 };
+  socklen_t          len  = sizeof(addr);
+  int                one  = 1;
+  int                fd   = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (fd == -1) {
+    perror("Error: Could not create the server socket\n");
+    return -1;
+  }
+
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, 128) == -1 ||
+      getsockname(fd, (struct sockaddr *)&addr, &len) == -1) {
+    perror("Error: Could not start the server\n");
+    close(fd);
+    return -1;
+  }
+  *port = ntohs(addr.sin_port);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    /* don't outlive the benchmark if it crashes */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGPIPE, SIG_IGN);
+    serve(fd);
+    _exit(0);
+  }
+
+  close(fd);
+  if (pid == -1) {
+    perror("Error: Could not fork the server\n");
+  }
+  return pid;
+}
+
+void mock_server_stop(pid_t pid) {
+  if (pid > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef MOCK_SERVER_H
+#define MOCK_SERVER_H
+
+#include <sys/types.h>
+
+/**
+ * Starts a minimal in-memory Jirafeau on 127.0.0.1 in a child process. It
+ * answers script.php (plain and async uploads) and f.php (downloads with
+ * Range support and deletes) like the real one does, without any limits.
+ *
+ * @param port Receives the port the server listens on
+ * @return Process id of the server or -1 on failure
+ */
+pid_t mock_server_start(int *port);
+
+/**
+ * Stops a server started with mock_server_start.
+ */
+void mock_server_stop(pid_t pid);
+
+#endif // MOCK_SERVER_H
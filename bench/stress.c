@@ -0,0 +1,221 @@
+#include "jirafeau.h"
+#include "mock_server.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STRESS_DEFAULT_THREADS 8
+#define STRESS_DEFAULT_ROUNDS  50
+#define STRESS_FILE_SIZE       (64 * 1024 + 7)
+
+struct Worker {
+  pthread_t   thread;
+  int         index;
+  int         rounds;
+  const char *host;
+  char        input[96];
+  char        output[96];
+  int         operations;
+  int         failures;
+};
+
+static char stress_dir[64];
+
+/* every worker uploads other content, so mixed up transfers show */
+static bool write_worker_file(const struct Worker *worker) {
+  FILE *file = fopen(worker->input, "wb");
+
+  if (!file) {
+    return false;
+  }
+  for (int i = 0; i < STRESS_FILE_SIZE; i++) {
+    fputc((i * 31 + worker->index * 97) & 0xff, file);
+  }
+  return fclose(file) == 0;
+}
+
+static bool same_content(const char *a, const char *b) {
+  FILE *x     = fopen(a, "rb");
+  FILE *y     = fopen(b, "rb");
+  bool  equal = x && y;
+
+  while (equal) {
+    int c = fgetc(x);
+
+    equal = c == fgetc(y);
+    if (c == EOF) {
+      break;
+    }
+  }
+  if (x) {
+    fclose(x);
+  }
+  if (y) {
+    fclose(y);
+  }
+  return equal;
+}
+
+static void fail(struct Worker *worker, int round, const char *what) {
+  fprintf(stderr, "thread %d round %d: %s failed\n", worker->index, round,
+          what);
+  worker->failures++;
+}
+
+/**
+ * Uploads, downloads, compares and deletes the worker's file over and over,
+ * alternating between the one-shot functions and a client of its own, while
+ * the host is read and set again from every thread.
+ */
+static void *run_worker(void *userdata) {
+  struct Worker *  worker = (struct Worker *)userdata;
+  JirafeauClientT *client = jirafeau_client_new(worker->host);
+
+  for (int round = 0; round < worker->rounds; round++) {
+    bool            oneshot = round % 2 == 0;
+    char *          host    = jirafeau_get_host();
+    UploadResultT   upload;
+    DownloadResultT download;
+    DeleteResultT   delete;
+
+    if (!host || strcmp(host, worker->host) != 0) {
+      fail(worker, round, "get_host");
+    }
+    free(host);
+    jirafeau_set_host(worker->host);
+
+    upload = oneshot ? jirafeau_upload(worker->input, "none", NULL, 0, NULL,
+                                       NULL)
+                     : jirafeau_client_upload(client, worker->input, "none",
+                                              NULL, 0, NULL, NULL);
+    worker->operations++;
+    if (upload.state != SUCCESS) {
+      fail(worker, round, "upload");
+      continue;
+    }
+
+    download = oneshot ? jirafeau_download(upload.file_id, worker->output,
+                                           NULL, NULL)
+                       : jirafeau_client_download(client, upload.file_id,
+                                                  worker->output, NULL, NULL);
+    worker->operations++;
+    if (download.state != SUCCESS) {
+      fail(worker, round, "download");
+    } else if (!same_content(worker->input, download.download_path)) {
+      fail(worker, round, "compare");
+    }
+    free(download.download_path);
+
+    delete = oneshot ? jirafeau_delete(upload.file_id, upload.delete_key)
+                     : jirafeau_client_delete(client, upload.file_id,
+                                              upload.delete_key);
+    worker->operations++;
+    if (delete.state != SUCCESS) {
+      fail(worker, round, "delete");
+    }
+
+    free(upload.file_id);
+    free(upload.delete_key);
+    free(upload.crypt_key);
+  }
+
+  jirafeau_client_free(client);
+  return NULL;
+}
+
+static void show_help(void) {
+  printf("jirafeau_stress [options]\n");
+  printf("  -H, --host [url] (stress a real server instead of the built-in "
+         "one)\n");
+  printf("  -t, --threads [n] (default %d)\n", STRESS_DEFAULT_THREADS);
+  printf("  -n, --rounds [n] (upload, download and delete per thread, "
+         "default %d)\n", STRESS_DEFAULT_ROUNDS);
+}
+
+int main(int argc, char *argv[]) {
+  const char *   host       = NULL;
+  int            threads    = STRESS_DEFAULT_THREADS;
+  int            rounds     = STRESS_DEFAULT_ROUNDS;
+  int            operations = 0;
+  int            failures   = 0;
+  pid_t          server     = -1;
+  char           mock_host[64];
+  struct Worker *workers;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+
+    if ((strcmp(argv[i], "-H") == 0 || strcmp(argv[i], "--host") == 0) &&
+        has_value) {
+      host = argv[++i];
+    } else if ((strcmp(argv[i], "-t") == 0 ||
+                strcmp(argv[i], "--threads") == 0) &&
+               has_value && atoi(argv[i + 1]) > 0) {
+      threads = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "-n") == 0 ||
+                strcmp(argv[i], "--rounds") == 0) &&
+               has_value && atoi(argv[i + 1]) > 0) {
+      rounds = atoi(argv[++i]);
+    } else {
+      show_help();
+      return 1;
+    }
+  }
+
+  /* fork the server before libcurl starts any threads */
+  if (!host) {
+    int port;
+
+    server = mock_server_start(&port);
+    if (server == -1) {
+      return 1;
+    }
+    snprintf(mock_host, sizeof(mock_host), "http://127.0.0.1:%d", port);
+    host = mock_host;
+  }
+  jirafeau_set_host(host);
+
+  snprintf(stress_dir, sizeof(stress_dir), "/tmp/jirafeau_stress.XXXXXX");
+  workers = calloc(threads, sizeof(struct Worker));
+  if (!workers || !mkdtemp(stress_dir)) {
+    perror("Error: Could not create a temporary directory\n");
+    mock_server_stop(server);
+    return 1;
+  }
+
+  for (int i = 0; i < threads; i++) {
+    workers[i].index  = i;
+    workers[i].rounds = rounds;
+    workers[i].host   = host;
+    snprintf(workers[i].input, sizeof(workers[i].input), "%s/input%d.bin",
+             stress_dir, i);
+    snprintf(workers[i].output, sizeof(workers[i].output), "%s/output%d.bin",
+             stress_dir, i);
+    if (!write_worker_file(&workers[i])) {
+      perror("Error: Could not write the test files\n");
+      mock_server_stop(server);
+      return 1;
+    }
+  }
+
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    operations += workers[i].operations;
+    failures   += workers[i].failures;
+    unlink(workers[i].input);
+    unlink(workers[i].output);
+  }
+  rmdir(stress_dir);
+  free(workers);
+  mock_server_stop(server);
+
+  printf("{\"threads\":%d,\"rounds\":%d,\"operations\":%d,\"failures\":%d}\n",
+         threads, rounds, operations, failures);
+  return failures ? 1 : 0;
+}
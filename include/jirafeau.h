@@ -14,32 +14,836 @@ typedef enum {
 } Status;
 
 /**
- * Struct to hold the result of an upload operation.
+ * Where the time of an operation went and how much it moved. Times are in
+ * microseconds since the start of the request and add up over all requests
+ * of an operation (e.g. the chunks of a chunked upload). All zero if no
+ * request was sent.
+ */
+typedef struct TransferMetrics {
+  curl_off_t namelookup;     /* name resolved */
+  curl_off_t connect;        /* TCP connection established */
+  curl_off_t appconnect;     /* TLS handshake done, 0 without TLS */
+  curl_off_t pretransfer;    /* about to send the request */
+  curl_off_t starttransfer;  /* first byte of the answer received */
+  curl_off_t total;          /* done, wall clock time for parallel requests */
+  curl_off_t bytes_uploaded;
+  curl_off_t bytes_downloaded;
+  curl_off_t upload_speed;   /* bytes per second */
+  curl_off_t download_speed; /* bytes per second */
+  long       requests;
+  long       new_connections; /* the other requests reused a connection */
+} TransferMetricsT;
+
+/**
+ * Length of a hex SHA-256 digest including the terminating NUL.
+ */
+#define JIRAFEAU_SHA256_HEX_SIZE 65
+
+/**
+ * Struct to hold the result of an upload operation. `sha256` is the digest
+ * of the content as it was read, before compression and encryption, taken
+ * while it was sent. Empty if it is not known.
  */
 typedef struct UploadResult {
-  char * file_id;
-  char * delete_key;
-  char * crypt_key;
-  Status state;
+  char *           file_id;
+  char *           delete_key;
+  char *           crypt_key;
+  Status           state;
+  TransferMetricsT metrics;
+  char             sha256[JIRAFEAU_SHA256_HEX_SIZE];
 } UploadResultT;
 
 /**
- * Struct to hold the result of an download operation.
+ * Struct to hold the result of an download operation. `sha256` is the
+ * digest of what was written to the output, after decryption and
+ * decompression, so it matches the one of the upload. Empty if it is not
+ * known.
  */
 typedef struct DownloadResult {
-  char * download_path;
-  Status state;
+  char *           download_path;
+  Status           state;
+  TransferMetricsT metrics;
+  char             sha256[JIRAFEAU_SHA256_HEX_SIZE];
 } DownloadResultT;
 
 /**
  * Struct to hold the result of an delete operation.
  */
 typedef struct DeleteResult {
-  Status state;
+  Status           state;
+  TransferMetricsT metrics;
 } DeleteResultT;
 
 /**
- * Sets the host URL for the Jirafeau server.
+ * The kind of operation a transfer does.
+ */
+typedef enum {
+  UPLOAD,
+  DOWNLOAD,
+  DELETE,
+} Operation;
+
+/**
+ * Result of a transfer run by JirafeauMultiT, only the member matching
+ * `operation` is set.
+ */
+typedef struct OperationResult {
+  Operation       operation;
+  UploadResultT   upload;
+  DownloadResultT download;
+  DeleteResultT   delete;
+} OperationResultT;
+
+/**
+ * Opaque handle for talking to a single Jirafeau server.
+ *
+ * A client owns the host URL, the libcurl global initialisation and one
+ * long-lived curl easy handle. Operations done through the same client reuse
+ * the open connection (HTTP keep-alive) and the DNS and TLS session caches,
+ * so only the first request pays for the handshake.
+ *
+ * Thread safety: the library keeps no per-request global state, every
+ * function may be called from any thread. A client (and a JirafeauMultiT)
+ * must only be used by one thread at a time, give every worker thread its
+ * own client. The jirafeau_upload, jirafeau_download and jirafeau_delete
+ * functions can be called concurrently: each call takes a client of its own
+ * from a small pool of idle clients the library keeps under a lock (or
+ * creates one if none is idle) and gives it back afterwards, so calls from
+ * any thread reuse the connections earlier calls left open. Pooled clients
+ * whose host no longer matches jirafeau_set_host are dropped.
+ */
+typedef struct JirafeauClient JirafeauClientT;
+
+/**
+ * Creates a new client for the given Jirafeau server.
+ *
+ * @param host_url URL of the Jirafeau server
+ * @return A new client or NULL on failure, free it with jirafeau_client_free
+ */
+JirafeauClientT *jirafeau_client_new(const char *host_url);
+
+/**
+ * Closes all connections of the client and frees it.
+ *
+ * @param client Client created with jirafeau_client_new (may be NULL)
+ */
+void jirafeau_client_free(JirafeauClientT *client);
+
+/**
+ * Get the host URL the client talks to.
+ *
+ * @param client The client
+ * @return the host url
+ */
+const char *jirafeau_client_get_host(const JirafeauClientT *client);
+
+/**
+ * Connects to the host ahead of the first request, so that the name lookup
+ * and the TLS handshake are done already when it is sent. The connection
+ * is opened with a HEAD request of the host URL.
+ *
+ * @param client The client
+ * @return 0, or -1 if the host could not be reached
+ */
+int jirafeau_client_connect(JirafeauClientT *client);
+
+/**
+ * Makes the client remember its uploads in a local index keyed by the
+ * SHA-256 of the content, together with the host, the filename and the
+ * download password. Uploading content that is already on the server
+ * returns the stored result without sending anything. One-time downloads
+ * are never deduplicated and entries go away when they expire or the file is
+ * deleted through a client using the same index. Streamed uploads are not
+ * deduplicated.
+ *
+ * The index is a text file that holds delete keys, it is created with mode
+ * 0600 and can be shared between processes.
+ *
+ * @param client The client
+ * @param index_path Path of the index, NULL to turn deduplication off
+ */
+void jirafeau_client_set_dedup_index(JirafeauClientT *client,
+                                     const char *     index_path);
+
+/**
+ * Size the download cache is limited to if none is given.
+ */
+#define JIRAFEAU_DEFAULT_CACHE_SIZE ((curl_off_t)1024 * 1024 * 1024)
+
+/**
+ * Keeps the files the client downloads to disk in a local cache, so that
+ * downloading them again is served from there without any request. Entries
+ * are keyed by host, file ID, file key and crypt key. Cached files are
+ * delivered as reflink where the file system supports it, else as hardlink
+ * (the file is then read-only and shared with the cache) or copy.
+ *
+ * The least recently used entries are evicted once the cache grows beyond
+ * `max_size`. Any number of processes can share a cache directory. Streamed
+ * downloads (jirafeau_client_download_callback) don't use the cache.
+ *
+ * @param client The client
+ * @param cache_dir Directory of the cache, created if missing, NULL to turn
+ * the cache off
+ * @param max_size Limit in bytes, 0 for JIRAFEAU_DEFAULT_CACHE_SIZE
+ */
+void jirafeau_client_set_download_cache(JirafeauClientT *client,
+                                        const char *     cache_dir,
+                                        curl_off_t       max_size);
+
+/**
+ * Limits the bandwidth of the client's transfers in each direction. A
+ * segmented download splits the limit among its segments.
+ *
+ * @param client The client
+ * @param bytes_per_second The limit, 0 for none
+ */
+void jirafeau_client_set_max_speed(JirafeauClientT *client,
+                                   curl_off_t       bytes_per_second);
+
+/**
+ * Size of the blocks downloads are written to files in, in bytes.
+ */
+#define JIRAFEAU_WRITE_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * Blocks a download may queue for its writer thread by default.
+ */
+#define JIRAFEAU_DEFAULT_WRITE_QUEUE 4
+
+/**
+ * Tunes how downloads get from the socket to their files. By default every
+ * download to a file has a thread that writes it in blocks of
+ * JIRAFEAU_WRITE_BUFFER_SIZE, so a slow disk doesn't hold up the connection
+ * and a fast one gets few large writes. Once `write_queue` blocks wait, the
+ * transfer waits too. The space of the file is reserved up front where its
+ * size is known. Streamed downloads (jirafeau_client_download_callback)
+ * are not affected by `write_queue` and `direct`.
+ *
+ * @param client The client
+ * @param receive_buffer Bytes curl reads from the socket at once
+ * (CURLOPT_BUFFERSIZE), 0 for curl's default
+ * @param write_queue Blocks that may wait for the writer thread, 0 to write
+ * in the thread of the transfer
+ * @param direct 1 to write the blocks with O_DIRECT, past the page cache,
+ * where the file system supports it
+ */
+void jirafeau_client_set_download_io(JirafeauClientT *client,
+                                     long receive_buffer, int write_queue,
+                                     int direct);
+
+/**
+ * Delay before the first retry if none is given, in milliseconds.
+ */
+#define JIRAFEAU_DEFAULT_RETRY_DELAY 500
+
+/**
+ * Longest delay between two retries, in milliseconds.
+ */
+#define JIRAFEAU_MAX_RETRY_DELAY 30000
+
+/**
+ * Repeats requests that failed for reasons that may go away, like a
+ * dropped connection, a timeout or a 5xx answer. The delay doubles with
+ * every retry and is randomized, so many clients don't come back at the
+ * same time.
+ *
+ * Downloads continue where they stopped with an HTTP range instead of
+ * starting over. Chunked uploads repeat the failed chunk only, other
+ * uploads are sent again as a whole. Streamed uploads
+ * (jirafeau_client_upload_callback) are not retried.
+ *
+ * @param client The client
+ * @param retries How often a request may be repeated, 0 to turn retries off
+ * @param delay_ms Delay before the first retry, 0 for
+ * JIRAFEAU_DEFAULT_RETRY_DELAY
+ */
+void jirafeau_client_set_retry(JirafeauClientT *client, int retries,
+                               long delay_ms);
+
+/**
+ * Keeps a journal of every chunked upload (jirafeau_client_upload_chunked)
+ * in `journal_dir`, updated after each chunk the server confirmed. When
+ * the same file is uploaded again with the same options after the process
+ * was interrupted, the upload continues after the last confirmed chunk.
+ * The journal is removed once the upload is complete.
+ *
+ * Journals hold the reference of the unfinished upload on the server, they
+ * are created with mode 0600.
+ *
+ * @param client The client
+ * @param journal_dir Directory of the journals, created if missing, NULL to
+ * turn journals off
+ */
+void jirafeau_client_set_upload_journal(JirafeauClientT *client,
+                                        const char *     journal_dir);
+
+/**
+ * Suffix that marks a file as compressed with zstd on the server.
+ */
+#define JIRAFEAU_COMPRESSED_SUFFIX ".zst"
+
+/**
+ * Compression level the command line uses if none is given.
+ */
+#define JIRAFEAU_DEFAULT_COMPRESSION_LEVEL 3
+
+/**
+ * Compresses what the client uploads with zstd while it is sent, nothing is
+ * staged on disk. The filename gets JIRAFEAU_COMPRESSED_SUFFIX appended so
+ * that downloads can detect it. Chunked uploads
+ * (jirafeau_client_upload_chunked) are sent as they are.
+ *
+ * @param client The client
+ * @param level zstd compression level, 0 to turn compression off
+ * @param workers Threads that compress in the background, 0 to compress
+ * in the thread of the transfer
+ * @return 0, or -1 if the library was built without zstd
+ */
+int jirafeau_client_set_compression(JirafeauClientT *client, int level,
+                                    int workers);
+
+/**
+ * Decompresses downloads whose filename ends in JIRAFEAU_COMPRESSED_SUFFIX
+ * while they arrive and strips the suffix from the name. Segmented
+ * downloads of such files fall back to a single request.
+ *
+ * @param client The client
+ * @param enabled Whether to decompress
+ * @return 0, or -1 if the library was built without zstd
+ */
+int jirafeau_client_set_decompression(JirafeauClientT *client, int enabled);
+
+/**
+ * Suffix that marks a file as encrypted by the client (after
+ * JIRAFEAU_COMPRESSED_SUFFIX if it is compressed too).
+ */
+#define JIRAFEAU_ENCRYPTED_SUFFIX ".jfenc"
+
+/**
+ * Threads the command line encrypts with if none are given.
+ */
+#define JIRAFEAU_DEFAULT_ENCRYPTION_WORKERS 2
+
+/**
+ * Encrypts what the client uploads with AES-256-GCM before it leaves the
+ * machine, independent of the server's own encryption. The data is sealed
+ * in chunks on `workers` threads while curl sends the chunks before them,
+ * and the filename gets JIRAFEAU_ENCRYPTED_SUFFIX appended.
+ *
+ * Downloads with that suffix are decrypted with the same passphrase, every
+ * chunk is authenticated before it is written. Encrypted downloads are
+ * neither cached nor segmented and encrypted uploads are not deduplicated.
+ * Chunked uploads (jirafeau_client_upload_chunked) fail rather than send
+ * the file unencrypted.
+ *
+ * @param client The client
+ * @param passphrase The key is derived from it with PBKDF2, NULL to turn
+ * encryption off
+ * @param workers Threads that encrypt, 0 to encrypt in the thread of the
+ * transfer
+ */
+void jirafeau_client_set_encryption(JirafeauClientT *client,
+                                    const char *     passphrase,
+                                    int              workers);
+
+/**
+ * Same as jirafeau_upload but uses the connection of the given client.
+ */
+UploadResultT jirafeau_client_upload(JirafeauClientT *client,
+                                     const char *file_path, const char *time,
+                                     const char *upload_password,
+                                     int one_time_download, const char *key,
+                                     const char *filename);
+
+/**
+ * Return value of a JirafeauReadCallback to abort the upload.
+ */
+#define JIRAFEAU_READ_ABORT CURL_READFUNC_ABORT
+
+/**
+ * Filename streamed uploads get on the server if none is given.
+ */
+#define JIRAFEAU_STREAM_FILENAME "stdin"
+
+/**
+ * Supplies the data of a streamed upload.
+ *
+ * @param buffer Where to put the data
+ * @param size Room in `buffer`
+ * @param userdata Pointer given to jirafeau_client_upload_callback
+ * @return Number of bytes put into `buffer`, 0 at the end of the data or
+ * JIRAFEAU_READ_ABORT to abort the upload
+ */
+typedef size_t (*JirafeauReadCallback)(char *buffer, size_t size,
+                                       void *userdata);
+
+/**
+ * Uploads data produced while uploading (e.g. from a pipe) without knowing
+ * its size up front, the data is sent as it comes from `read_callback`.
+ *
+ * @param client The client
+ * @param read_callback Supplies the data
+ * @param userdata Passed on to `read_callback`
+ * @param time Time until the upload expires (optional)
+ * @param upload_password Password for the upload (optional)
+ * @param one_time_download Flag to enable one-time download (optional)
+ * @param key Key for authorized access (optional)
+ * @param filename Filename for the uploaded file (optional, defaults to
+ * JIRAFEAU_STREAM_FILENAME)
+ * @return Same as jirafeau_upload
+ */
+UploadResultT jirafeau_client_upload_callback(JirafeauClientT *client,
+                                              JirafeauReadCallback read_callback,
+                                              void *userdata, const char *time,
+                                              const char *upload_password,
+                                              int one_time_download,
+                                              const char *key,
+                                              const char *filename);
+
+/**
+ * Filename uploads from memory get on the server if none is given.
+ */
+#define JIRAFEAU_BUFFER_FILENAME "upload"
+
+/**
+ * Uploads data that is already in memory. curl reads it piece by piece
+ * straight from `data` instead of from a duplicate, so it has to stay
+ * untouched until the function returns.
+ *
+ * @param client The client
+ * @param data The content of the file
+ * @param size Number of bytes in `data`
+ * @param time Time until the upload expires (optional)
+ * @param upload_password Password for the upload (optional)
+ * @param one_time_download Flag to enable one-time download (optional)
+ * @param key Key for authorized access (optional)
+ * @param filename Filename for the uploaded file (optional, defaults to
+ * JIRAFEAU_BUFFER_FILENAME)
+ * @return Same as jirafeau_upload
+ */
+UploadResultT jirafeau_client_upload_buffer(JirafeauClientT *client,
+                                            const void *data, size_t size,
+                                            const char *time,
+                                            const char *upload_password,
+                                            int one_time_download,
+                                            const char *key,
+                                            const char *filename);
+
+/**
+ * Same as jirafeau_client_upload but maps the file into memory and sends it
+ * from there instead of reading it through stdio buffers.
+ */
+UploadResultT jirafeau_client_upload_mmap(JirafeauClientT *client,
+                                          const char *file_path,
+                                          const char *time,
+                                          const char *upload_password,
+                                          int one_time_download,
+                                          const char *key,
+                                          const char *filename);
+
+/**
+ * Default size of the chunks sent by jirafeau_client_upload_chunked. Stays
+ * below PHP's default `upload_max_filesize` of 2M.
+ */
+#define JIRAFEAU_DEFAULT_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * Uploads a file in chunks using Jirafeau's async upload protocol
+ * (init_async, push_async and end_async), the same one the web interface
+ * uses. Files larger than the server's `upload_max_filesize` can be uploaded
+ * this way, every chunk just has to fit into one request.
+ *
+ * Jirafeau hands out a new code with every pushed chunk that the next push
+ * has to present and appends the chunks in the order they arrive, so the
+ * chunks are sent one after the other over the connection of the client.
+ * See jirafeau_client_set_upload_journal to resume interrupted uploads.
+ *
+ * @param client The client
+ * @param file_path Path to the file to be uploaded
+ * @param time Time until the upload expires (optional)
+ * @param upload_password Password for the upload (optional)
+ * @param one_time_download Flag to enable one-time download (optional)
+ * @param key Key for authorized access (optional)
+ * @param filename Custom filename for the uploaded file (optional)
+ * @param chunk_size Size of a chunk in bytes, 0 for
+ * JIRAFEAU_DEFAULT_CHUNK_SIZE
+ * @return Same as jirafeau_upload
+ */
+UploadResultT jirafeau_client_upload_chunked(JirafeauClientT *client,
+                                             const char *file_path,
+                                             const char *time,
+                                             const char *upload_password,
+                                             int one_time_download,
+                                             const char *key,
+                                             const char *filename,
+                                             size_t chunk_size);
+
+/**
+ * Same as jirafeau_download but uses the connection of the given client.
+ */
+DownloadResultT jirafeau_client_download(JirafeauClientT *client,
+                                         const char *file_id,
+                                         const char *output_path,
+                                         const char *file_key,
+                                         const char *crypt_key);
+
+/**
+ * Receives the data of a streamed download as it arrives.
+ *
+ * @param data The next bytes of the file
+ * @param size Number of bytes in `data`
+ * @param userdata Pointer given to jirafeau_client_download_callback
+ * @return 0 to continue, anything else aborts the download
+ */
+typedef int (*JirafeauWriteCallback)(const char *data, size_t size,
+                                     void *userdata);
+
+/**
+ * Downloads a file and hands the data to `write_callback` as it arrives
+ * instead of writing it to a file. The `download_path` of the result is
+ * NULL.
+ *
+ * @param client The client
+ * @param file_id ID of the file to be downloaded
+ * @param file_key Key for authorized access (optional)
+ * @param crypt_key Crypt key for encrypted files (optional)
+ * @param write_callback Receives the data
+ * @param userdata Passed on to `write_callback`
+ * @return Same as jirafeau_download
+ */
+DownloadResultT jirafeau_client_download_callback(
+  JirafeauClientT *client, const char *file_id, const char *file_key,
+  const char *crypt_key, JirafeauWriteCallback write_callback,
+  void *userdata);
+
+/**
+ * Downloads a part of a file with a range request, e.g. one member of an
+ * archive, and hands it to `write_callback` like
+ * jirafeau_client_download_callback. The part is passed on as it is stored,
+ * files uploaded with compression or encryption are not decoded. A server
+ * that ignores the range still works, the bytes before the part are skipped
+ * and the download stops at its end. A retry asks for the rest of the part.
+ *
+ * @param client The client
+ * @param file_id ID of the file
+ * @param file_key Key for authorized access (optional)
+ * @param crypt_key Crypt key for encrypted files (optional)
+ * @param offset Position of the part in the file
+ * @param length Size of the part, 0 for everything from `offset` on
+ * @param write_callback Receives the data
+ * @param userdata Passed on to `write_callback`
+ * @return Same as jirafeau_download, the SHA-256 is that of the part
+ */
+DownloadResultT jirafeau_client_download_range(
+  JirafeauClientT *client, const char *file_id, const char *file_key,
+  const char *crypt_key, curl_off_t offset, curl_off_t length,
+  JirafeauWriteCallback write_callback, void *userdata);
+
+/**
+ * Default number of parallel ranges of jirafeau_client_download_segmented.
+ */
+#define JIRAFEAU_DEFAULT_SEGMENTS 4
+
+/**
+ * Smallest range jirafeau_client_download_segmented splits a file into,
+ * smaller files are fetched with fewer segments.
+ */
+#define JIRAFEAU_MIN_SEGMENT_SIZE (1024 * 1024)
+
+/**
+ * Downloads a file over multiple parallel connections.
+ *
+ * The size and name of the file are learned from a one byte range request
+ * first, then the output file is preallocated and every segment is fetched
+ * with its own HTTP range and written at its offset with pwrite. Falls back
+ * to jirafeau_client_download if the server does not answer range requests.
+ *
+ * Don't use it for one-time downloads, the first request already uses up
+ * the download.
+ *
+ * @param client The client
+ * @param file_id ID of the file to be downloaded
+ * @param output_path Path where the downloaded file will be saved
+ * @param file_key Key for authorized access (optional)
+ * @param crypt_key Crypt key for encrypted files (optional)
+ * @param segments Number of parallel ranges, 0 for JIRAFEAU_DEFAULT_SEGMENTS
+ * @return Same as jirafeau_download
+ */
+DownloadResultT jirafeau_client_download_segmented(JirafeauClientT *client,
+                                                   const char *file_id,
+                                                   const char *output_path,
+                                                   const char *file_key,
+                                                   const char *crypt_key,
+                                                   int segments);
+
+/**
+ * Same as jirafeau_delete but uses the connection of the given client.
+ */
+DeleteResultT jirafeau_client_delete(JirafeauClientT *client,
+                                     const char *file_id,
+                                     const char *delete_key);
+
+/**
+ * Runs many uploads, downloads and deletes concurrently on one curl multi
+ * handle, so a single thread can keep many transfers going and the
+ * connections to the server are reused between them.
+ */
+typedef struct JirafeauMulti JirafeauMultiT;
+
+/**
+ * Handle of a transfer queued on a JirafeauMultiT. It belongs to the multi
+ * and is valid until its callback returned.
+ */
+typedef struct JirafeauTransfer JirafeauTransferT;
+
+/**
+ * Called once a transfer of a JirafeauMultiT is done. The strings in the
+ * result belong to the callback, the same as for the blocking functions.
+ *
+ * @param transfer The finished transfer
+ * @param result The result of the transfer
+ * @param userdata Pointer given when queueing the transfer
+ */
+typedef void (*JirafeauCallback)(JirafeauTransferT *     transfer,
+                                 const OperationResultT *result,
+                                 void *                  userdata);
+
+/**
+ * Creates a new multi for the given Jirafeau server.
+ *
+ * @param host_url URL of the Jirafeau server
+ * @param max_transfers How many transfers run at the same time, further ones
+ * wait in a queue until a slot frees up
+ * @return A new multi or NULL on failure, free it with jirafeau_multi_free
+ */
+JirafeauMultiT *jirafeau_multi_new(const char *host_url, int max_transfers);
+
+/**
+ * Aborts all unfinished transfers (without calling their callbacks) and
+ * frees the multi.
+ *
+ * @param multi Multi created with jirafeau_multi_new (may be NULL)
+ */
+void jirafeau_multi_free(JirafeauMultiT *multi);
+
+/**
+ * Queues an upload, see jirafeau_upload for the parameters.
+ *
+ * @return Handle of the transfer or NULL if it could not be queued
+ */
+JirafeauTransferT *jirafeau_multi_upload(JirafeauMultiT *multi,
+                                         const char *file_path,
+                                         const char *time,
+                                         const char *upload_password,
+                                         int one_time_download,
+                                         const char *key,
+                                         const char *filename,
+                                         JirafeauCallback callback,
+                                         void *userdata);
+
+/**
+ * Queues a download, see jirafeau_download for the parameters.
+ *
+ * @return Handle of the transfer or NULL if it could not be queued
+ */
+JirafeauTransferT *jirafeau_multi_download(JirafeauMultiT *multi,
+                                           const char *file_id,
+                                           const char *output_path,
+                                           const char *file_key,
+                                           const char *crypt_key,
+                                           JirafeauCallback callback,
+                                           void *userdata);
+
+/**
+ * Queues a delete, see jirafeau_delete for the parameters.
+ *
+ * @return Handle of the transfer or NULL if it could not be queued
+ */
+JirafeauTransferT *jirafeau_multi_delete(JirafeauMultiT *multi,
+                                         const char *file_id,
+                                         const char *delete_key,
+                                         JirafeauCallback callback,
+                                         void *userdata);
+
+/**
+ * How a transfer of a JirafeauMultiT is scheduled. Queued transfers start in
+ * the order of their priority, and a capped bandwidth is shared by weight:
+ * an interactive transfer gets 16 times, a normal one 4 times the share of a
+ * bulk one. Interactive transfers don't wait for a free slot, they may use
+ * up to `max_transfers` extra ones, so small requests don't queue behind
+ * big ones.
+ */
+typedef enum {
+  PRIORITY_BULK,
+  PRIORITY_NORMAL,
+  PRIORITY_INTERACTIVE,
+} Priority;
+
+/**
+ * Limits the bandwidth all transfers of the multi use together, in each
+ * direction. The limit is shared among the running transfers by priority
+ * and redistributed whenever one starts or finishes.
+ *
+ * @param multi The multi
+ * @param bytes_per_second The limit, 0 for none
+ */
+void jirafeau_multi_set_max_speed(JirafeauMultiT *multi,
+                                  curl_off_t      bytes_per_second);
+
+/**
+ * Limits the bandwidth of a single transfer, on top of the share it gets
+ * of the limit of its multi. What it leaves unused goes to the others.
+ * Takes effect when the transfer starts, or on the next start or finish of
+ * a transfer if it is running already.
+ *
+ * @param transfer A transfer that has not finished yet
+ * @param bytes_per_second The limit, 0 for none
+ */
+void jirafeau_transfer_set_max_speed(JirafeauTransferT *transfer,
+                                     curl_off_t         bytes_per_second);
+
+/**
+ * Sets the priority of a transfer, PRIORITY_NORMAL if not set. Takes effect
+ * on the next start or finish of a transfer.
+ *
+ * @param transfer A transfer that has not finished yet
+ * @param priority The priority
+ */
+void jirafeau_transfer_set_priority(JirafeauTransferT *transfer,
+                                    Priority           priority);
+
+/**
+ * Retries transfers that failed for reasons that may go away, see
+ * jirafeau_client_set_retry. A transfer waits in the queue until its
+ * retry is due, its callback is only called once it is done for good.
+ *
+ * @param multi The multi
+ * @param retries How often a transfer may be repeated, 0 to turn retries
+ * off
+ * @param delay_ms Delay before the first retry, 0 for
+ * JIRAFEAU_DEFAULT_RETRY_DELAY
+ */
+void jirafeau_multi_set_retry(JirafeauMultiT *multi, int retries,
+                              long delay_ms);
+
+/**
+ * Runs concurrent transfers as streams of one HTTP/2 connection to the host,
+ * so a burst of small requests pays for the TLS handshake once. A transfer
+ * waits for the connection of a running one instead of opening its own, and
+ * only opens another if the host doesn't speak HTTP/2. By default transfers
+ * only share a connection that is known to speak HTTP/2 already.
+ *
+ * @param multi The multi, before any transfer has started
+ * @param enabled 1 to multiplex, 0 to give every transfer a connection of
+ * its own
+ */
+void jirafeau_multi_set_multiplex(JirafeauMultiT *multi, int enabled);
+
+/**
+ * Tunes how the downloads of the multi get to their files, see
+ * jirafeau_client_set_download_io. Every running download has a writer
+ * thread of its own.
+ *
+ * @param multi The multi
+ * @param receive_buffer Bytes curl reads from the socket at once, 0 for
+ * curl's default
+ * @param write_queue Blocks that may wait for a writer thread, 0 to write in
+ * the thread of the multi
+ * @param direct 1 to write with O_DIRECT where the file system supports it
+ */
+void jirafeau_multi_set_download_io(JirafeauMultiT *multi,
+                                    long receive_buffer, int write_queue,
+                                    int direct);
+
+/**
+ * Drives the transfers: starts queued ones, waits up to `timeout_ms` for
+ * network activity and calls the callbacks of the finished ones.
+ *
+ * @param multi The multi
+ * @param timeout_ms Longest time to wait for activity
+ * @return Number of transfers that are still running or queued
+ */
+int jirafeau_multi_perform(JirafeauMultiT *multi, int timeout_ms);
+
+/**
+ * What a JirafeauSocketCallback asks the event loop to wait for.
+ */
+#define JIRAFEAU_POLL_IN     CURL_POLL_IN
+#define JIRAFEAU_POLL_OUT    CURL_POLL_OUT
+#define JIRAFEAU_POLL_INOUT  CURL_POLL_INOUT
+#define JIRAFEAU_POLL_REMOVE CURL_POLL_REMOVE
+
+/**
+ * Events reported to jirafeau_multi_socket_action, can be or'ed.
+ */
+#define JIRAFEAU_EVENT_IN  CURL_CSELECT_IN
+#define JIRAFEAU_EVENT_OUT CURL_CSELECT_OUT
+#define JIRAFEAU_EVENT_ERR CURL_CSELECT_ERR
+
+/**
+ * Pass as `fd` to jirafeau_multi_socket_action when the timer expired.
+ */
+#define JIRAFEAU_SOCKET_TIMEOUT CURL_SOCKET_TIMEOUT
+
+/**
+ * Tells the event loop which events to watch on a socket of the multi.
+ *
+ * @param fd The socket
+ * @param what One of JIRAFEAU_POLL_IN, JIRAFEAU_POLL_OUT, JIRAFEAU_POLL_INOUT
+ * or JIRAFEAU_POLL_REMOVE to stop watching it
+ * @param userdata Pointer given to jirafeau_multi_set_socket_callback
+ */
+typedef void (*JirafeauSocketCallback)(int fd, int what, void *userdata);
+
+/**
+ * Tells the event loop when to call jirafeau_multi_socket_action with
+ * JIRAFEAU_SOCKET_TIMEOUT, replacing the previous timer.
+ *
+ * @param timeout_ms Milliseconds from now, 0 for as soon as possible and -1
+ * to delete the timer
+ * @param userdata Pointer given to jirafeau_multi_set_timer_callback
+ */
+typedef void (*JirafeauTimerCallback)(long timeout_ms, void *userdata);
+
+/**
+ * Lets an external event loop (epoll, libuv, ...) drive the multi instead
+ * of jirafeau_multi_perform. Set both callbacks before queueing transfers
+ * and don't call jirafeau_multi_perform afterwards.
+ *
+ * @param multi The multi
+ * @param callback Called whenever the events to watch on a socket change
+ * @param userdata Passed on to `callback`
+ */
+void jirafeau_multi_set_socket_callback(JirafeauMultiT *       multi,
+                                        JirafeauSocketCallback callback,
+                                        void *                 userdata);
+
+/**
+ * See jirafeau_multi_set_socket_callback.
+ *
+ * @param multi The multi
+ * @param callback Called whenever the timeout of the multi changes
+ * @param userdata Passed on to `callback`
+ */
+void jirafeau_multi_set_timer_callback(JirafeauMultiT *      multi,
+                                       JirafeauTimerCallback callback,
+                                       void *                userdata);
+
+/**
+ * Does the work that is due on a socket or the timer without blocking and
+ * calls the callbacks of the transfers that finished.
+ *
+ * @param multi The multi
+ * @param fd The socket that is ready, JIRAFEAU_SOCKET_TIMEOUT if the timer
+ * expired
+ * @param events JIRAFEAU_EVENT_* bits of what happened on `fd`, 0 if unknown
+ * @return Number of transfers that are still running or queued
+ */
+int jirafeau_multi_socket_action(JirafeauMultiT *multi, int fd, int events);
+
+/**
+ * Sets the host URL for the Jirafeau server used by jirafeau_upload,
+ * jirafeau_download and jirafeau_delete.
  *
  * @param host_url URL of the Jirafeau server
  */
@@ -48,13 +852,57 @@ void jirafeau_set_host(const char *host_url);
 /**
  * Get the previously set host URL for the Jirafeau server.
  *
- * @request the host url
+ * @return A copy of the host url (to be freed), NULL if none is set
  */
 char *jirafeau_get_host();
 
+/**
+ * Sets the download cache jirafeau_download uses, see
+ * jirafeau_client_set_download_cache.
+ *
+ * @param cache_dir Directory of the cache, NULL to turn the cache off
+ * @param max_size Limit in bytes, 0 for JIRAFEAU_DEFAULT_CACHE_SIZE
+ */
+void jirafeau_set_download_cache(const char *cache_dir, curl_off_t max_size);
+
+/**
+ * Sets the compression jirafeau_upload and jirafeau_download use, see
+ * jirafeau_client_set_compression and jirafeau_client_set_decompression.
+ *
+ * @param level zstd compression level, 0 to turn compression off
+ * @param workers Threads that compress in the background
+ * @param decompress Whether to decompress compressed downloads
+ * @return 0, or -1 if the library was built without zstd
+ */
+int jirafeau_set_compression(int level, int workers, int decompress);
+
+/**
+ * Sets the encryption jirafeau_upload and jirafeau_download use, see
+ * jirafeau_client_set_encryption.
+ *
+ * @param passphrase Passphrase, NULL to turn encryption off
+ * @param workers Threads that encrypt
+ */
+void jirafeau_set_encryption(const char *passphrase, int workers);
+
+/**
+ * Sets the retries jirafeau_upload, jirafeau_download and jirafeau_delete
+ * do, see jirafeau_client_set_retry.
+ *
+ * @param retries How often a request may be repeated, 0 to turn retries off
+ * @param delay_ms Delay before the first retry, 0 for
+ * JIRAFEAU_DEFAULT_RETRY_DELAY
+ */
+void jirafeau_set_retry(int retries, long delay_ms);
+
 /**
  * Uploads a file to the Jirafeau server.
  *
+ * Borrows an idle client from the library's pool for the call, so a series
+ * of calls keeps its connection open (see JirafeauClientT). Only a few
+ * clients are pooled, use a JirafeauClientT of your own to control the
+ * connections.
+ *
  * @param file_path Path to the file to be uploaded
  * @param time Time until the upload expires (optional)
  * @param upload_password Password for the upload (optional)
@@ -69,9 +917,33 @@ UploadResultT jirafeau_upload(const char *file_path, const char *time,
                               int one_time_download, const char *key,
                               const char *filename);
 
+/**
+ * Uploads data from memory to the Jirafeau server, see
+ * jirafeau_client_upload_buffer.
+ *
+ * @param data The content of the file
+ * @param size Number of bytes in `data`
+ * @param time Time until the upload expires (optional)
+ * @param upload_password Password for the upload (optional)
+ * @param one_time_download Flag to enable one-time download (optional)
+ * @param key Key for authorized access (optional)
+ * @param filename Filename for the uploaded file (optional)
+ * @return Same as jirafeau_upload
+ */
+UploadResultT jirafeau_upload_buffer(const void *data, size_t size,
+                                     const char *time,
+                                     const char *upload_password,
+                                     int one_time_download, const char *key,
+                                     const char *filename);
+
 /**
  * Downloads a file from the Jirafeau server.
  *
+ * The file is written next to its destination with a ".part" suffix and
+ * renamed when it is complete. A failed download keeps the part it got, a
+ * later download to the same file path continues after it (unless the file
+ * may need decompressing or decrypting).
+ *
  * @param file_id ID of the file to be downloaded
  * @param output_path Path where the downloaded file will be saved
  * @param file_key Key for authorized access (optional)
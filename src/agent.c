@@ -0,0 +1,721 @@
+#define _GNU_SOURCE /* SO_PEERCRED, accept4 */
+#include "agent.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* first string of every request, an agent of another version says so */
+#define AGENT_PROTOCOL    "jirafeau-agent 1"
+#define AGENT_UNSUPPORTED "unsupported"
+
+#define AGENT_MAX_MESSAGE  (64 * 1024)
+#define AGENT_IDLE_CLIENTS 16
+
+/**
+ * A request or a reply, one datagram of the SOCK_SEQPACKET socket. It is a
+ * list of strings, each NUL terminated and marked with a '+' in front, or
+ * a single '-' for NULL.
+ */
+struct Message {
+  char   data[AGENT_MAX_MESSAGE];
+  size_t size;
+  size_t position; /* of the next string to read */
+  bool   broken;   /* too long, or fewer strings than read */
+};
+
+static void put_string(struct Message *m, const char *s) {
+  size_t len = s ? strlen(s) + 2 : 2;
+
+  if (m->broken || m->size + len > sizeof(m->data)) {
+    m->broken = true;
+    return;
+  }
+  m->data[m->size] = s ? '+' : '-';
+  if (s) {
+    memcpy(m->data + m->size + 1, s, len - 1);
+  } else {
+    m->data[m->size + 1] = '\0';
+  }
+  m->size += len;
+}
+
+/**
+ * @return The next string of the message, valid as long as the message,
+ * NULL for NULL or if there is none
+ */
+static const char *get_string(struct Message *m) {
+  char *s   = m->data + m->position;
+  char *end = m->position < m->size
+                  ? memchr(s, '\0', m->size - m->position)
+                  : NULL;
+
+  if (!end || (s[0] != '+' && s[0] != '-')) {
+    m->broken = true;
+    return NULL;
+  }
+  m->position = end - m->data + 1;
+  return s[0] == '+' ? s + 1 : NULL;
+}
+
+/**
+ * @param fd Descriptor passed along with SCM_RIGHTS, -1 for none
+ */
+static bool send_message(int sock, const struct Message *m, int fd) {
+  struct iovec  iov = { (void *)m->data, m->size };
+  struct msghdr msg = { 0 };
+  union {
+    struct cmsghdr header;
+    char           space[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  msg.msg_iov    = &iov;
+  msg.msg_iovlen = 1;
+  if (fd != -1) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control    = control.space;
+    msg.msg_controllen = sizeof(control.space);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level     = SOL_SOCKET;
+    cmsg->cmsg_type      = SCM_RIGHTS;
+    cmsg->cmsg_len       = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  return !m->broken && sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)m->size;
+}
+
+/**
+ * @param fd Receives the passed descriptor or -1, NULL to close any
+ */
+static bool receive_message(int sock, struct Message *m, int *fd) {
+  struct iovec  iov = { m->data, sizeof(m->data) };
+  struct msghdr msg = { 0 };
+  union {
+    struct cmsghdr header;
+    char           space[CMSG_SPACE(sizeof(int))];
+  } control;
+  ssize_t n;
+
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control.space;
+  msg.msg_controllen = sizeof(control.space);
+
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+
+  if (fd) {
+    *fd = -1;
+  }
+  for (struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < count; i++) {
+      int received;
+      memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (fd && *fd == -1) {
+        *fd = received;
+      } else {
+        close(received);
+      }
+    }
+  }
+
+  m->size     = n > 0 ? (size_t)n : 0;
+  m->position = 0;
+  m->broken   = n <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+  return !m->broken;
+}
+
+static const char *status_name(Status state) {
+  switch (state) {
+  case SUCCESS:
+    return "success";
+  case FILE_NOT_FOUND:
+    return "not_found";
+  default:
+    return "error";
+  }
+}
+
+static Status get_status(struct Message *m) {
+  const char *name = get_string(m);
+
+  if (name && strcmp(name, "success") == 0) {
+    return SUCCESS;
+  }
+  if (name && strcmp(name, "not_found") == 0) {
+    return FILE_NOT_FOUND;
+  }
+  return ERROR;
+}
+
+char *agent_socket_path(void) {
+  const char *path    = getenv("JIRAFEAU_AGENT_SOCKET");
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+
+  if (path) {
+    return path[0] ? strdup(path) : NULL;
+  }
+
+  size_t size   = (runtime ? strlen(runtime) : 0) + 64;
+  char * result = malloc(size);
+  if (result && runtime && runtime[0]) {
+    snprintf(result, size, "%s/jirafeau-agent.sock", runtime);
+  } else if (result) {
+    snprintf(result, size, "/tmp/jirafeau-agent-%u.sock",
+             (unsigned)geteuid());
+  }
+  return result;
+}
+
+static bool peer_is_us(int sock) {
+  struct ucred peer;
+  socklen_t    len = sizeof(peer);
+
+  return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &peer, &len) == 0 &&
+         peer.uid == geteuid();
+}
+
+/**
+ * @return Socket connected to `path`, -1 if nothing listens there
+ */
+static int connect_socket(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int                sock;
+
+  if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock != -1 &&
+      connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(sock);
+    sock = -1;
+  }
+  return sock;
+}
+
+/**
+ * Sends a request to the agent and waits for its reply. A reply that does
+ * not come is left broken, which reads as an error.
+ *
+ * @param fd Descriptor the agent gets along with the request, -1 for none
+ * @return false if no agent of this version is running
+ */
+static bool ask_agent(struct Message *request, int fd, struct Message *reply) {
+  char *path = agent_socket_path();
+  int   sock = connect_socket(path);
+
+  free(path);
+  /* someone else could listen in a shared directory like /tmp */
+  if (sock == -1 || !peer_is_us(sock) || !send_message(sock, request, fd)) {
+    if (sock != -1) {
+      close(sock);
+    }
+    return false;
+  }
+
+  if (!receive_message(sock, reply, NULL)) {
+    fprintf(stderr, "Error: The agent did not answer\n");
+  }
+  close(sock);
+
+  const char *status = reply->broken ? NULL : get_string(reply);
+  if (status && strcmp(status, AGENT_UNSUPPORTED) == 0) {
+    return false;
+  }
+  reply->position = 0;
+  return true;
+}
+
+static void start_request(struct Message *request, const char *operation) {
+  char *host = jirafeau_get_host();
+
+  put_string(request, AGENT_PROTOCOL);
+  put_string(request, operation);
+  put_string(request, host);
+  free(host);
+}
+
+static char *dup_string(const char *s) {
+  return s ? strdup(s) : NULL;
+}
+
+bool agent_upload(const char *file_path, const char *time,
+                  const char *upload_password, int one_time_download,
+                  const char *key, const char *filename,
+                  UploadResultT *result) {
+  static struct Message request, reply;
+  bool                  stream   = strcmp(file_path, "-") == 0;
+  char *                name_buf = NULL;
+  int                   fd;
+
+  /* a file that can't be opened is reported by the direct upload */
+  fd = stream ? STDIN_FILENO : open(file_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  if (!filename && !stream) {
+    name_buf = strdup(file_path);
+    filename = name_buf ? basename(name_buf) : NULL;
+  }
+
+  start_request(&request, "upload");
+  put_string(&request, time);
+  put_string(&request, upload_password);
+  put_string(&request, one_time_download ? "1" : "0");
+  put_string(&request, key);
+  put_string(&request, filename);
+
+  bool asked = ask_agent(&request, fd, &reply);
+  if (!stream) {
+    close(fd);
+  }
+  free(name_buf);
+  if (!asked) {
+    return false;
+  }
+
+  memset(result, 0, sizeof(UploadResultT));
+  result->state      = get_status(&reply);
+  result->file_id    = dup_string(get_string(&reply));
+  result->delete_key = dup_string(get_string(&reply));
+  result->crypt_key  = dup_string(get_string(&reply));
+
+  const char *sha256 = get_string(&reply);
+  if (sha256 && strlen(sha256) < sizeof(result->sha256)) {
+    strcpy(result->sha256, sha256);
+  }
+  if (reply.broken || (result->state == SUCCESS &&
+                       (!result->file_id || !result->delete_key))) {
+    result->state = ERROR;
+  }
+  return true;
+}
+
+bool agent_download(const char *file_id, const char *output_path,
+                    const char *key, const char *crypt_key,
+                    DownloadResultT *result) {
+  static struct Message request, reply;
+  bool                  stream   = output_path && strcmp(output_path, "-") == 0;
+  char *                cwd      = NULL;
+  char *                absolute = NULL;
+
+  /* the agent runs in another directory */
+  if (!stream && (!output_path || output_path[0] != '/')) {
+    cwd = getcwd(NULL, 0);
+    if (!cwd) {
+      return false;
+    }
+    size_t size = strlen(cwd) + (output_path ? strlen(output_path) : 1) + 2;
+    absolute    = malloc(size);
+    if (absolute) {
+      snprintf(absolute, size, "%s/%s", cwd,
+               output_path ? output_path : ".");
+    }
+  }
+
+  start_request(&request, "download");
+  put_string(&request, file_id);
+  put_string(&request, stream ? NULL : absolute ? absolute : output_path);
+  put_string(&request, key);
+  put_string(&request, crypt_key);
+
+  bool asked = (stream || !cwd || absolute) &&
+               ask_agent(&request, stream ? STDOUT_FILENO : -1, &reply);
+  free(absolute);
+  if (!asked) {
+    free(cwd);
+    return false;
+  }
+
+  memset(result, 0, sizeof(DownloadResultT));
+  result->state = get_status(&reply);
+
+  /* give the path back the way the caller named it */
+  const char *path = get_string(&reply);
+  size_t      skip = cwd ? strlen(cwd) + 1 : 0;
+  if (path && cwd && strncmp(path, cwd, skip - 1) == 0 &&
+      path[skip - 1] == '/') {
+    path += skip;
+  }
+  result->download_path = dup_string(path);
+
+  const char *sha256 = get_string(&reply);
+  if (sha256 && strlen(sha256) < sizeof(result->sha256)) {
+    strcpy(result->sha256, sha256);
+  }
+  if (reply.broken) {
+    result->state = ERROR;
+  }
+  free(cwd);
+  return true;
+}
+
+bool agent_delete(const char *file_id, const char *delete_key,
+                  DeleteResultT *result) {
+  static struct Message request, reply;
+
+  start_request(&request, "delete");
+  put_string(&request, file_id);
+  put_string(&request, delete_key);
+
+  if (!ask_agent(&request, -1, &reply)) {
+    return false;
+  }
+
+  memset(result, 0, sizeof(DeleteResultT));
+  result->state = get_status(&reply);
+  if (reply.broken) {
+    result->state = ERROR;
+  }
+  return true;
+}
+
+/* guarded by agent_lock, the clients keep their connections open */
+static pthread_mutex_t  agent_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   agent_idle = PTHREAD_COND_INITIALIZER;
+static JirafeauClientT *idle_clients[AGENT_IDLE_CLIENTS];
+static int              idle_count;
+static int              busy_count; /* requests being served */
+
+/**
+ * Hands out a client for `host`, one with an open connection if there is.
+ */
+static JirafeauClientT *take_client(const char *host) {
+  JirafeauClientT *client = NULL;
+
+  pthread_mutex_lock(&agent_lock);
+  for (int i = idle_count - 1; i >= 0 && !client; i--) {
+    if (strcmp(jirafeau_client_get_host(idle_clients[i]), host) == 0) {
+      client          = idle_clients[i];
+      idle_clients[i] = idle_clients[--idle_count];
+    }
+  }
+  pthread_mutex_unlock(&agent_lock);
+
+  return client ? client : jirafeau_client_new(host);
+}
+
+static void give_back(JirafeauClientT *client) {
+  pthread_mutex_lock(&agent_lock);
+  if (idle_count < AGENT_IDLE_CLIENTS) {
+    idle_clients[idle_count++] = client;
+    client                     = NULL;
+  }
+  pthread_mutex_unlock(&agent_lock);
+
+  jirafeau_client_free(client);
+}
+
+static size_t read_fd(char *buffer, size_t size, void *userdata) {
+  int     fd = *(int *)userdata;
+  ssize_t n;
+
+  do {
+    n = read(fd, buffer, size);
+  } while (n < 0 && errno == EINTR);
+  return n < 0 ? JIRAFEAU_READ_ABORT : (size_t)n;
+}
+
+static int write_fd(const char *data, size_t size, void *userdata) {
+  int fd = *(int *)userdata;
+
+  while (size) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno != EINTR) {
+      return 1;
+    }
+    if (n > 0) {
+      data += n;
+      size -= n;
+    }
+  }
+  return 0;
+}
+
+static void serve_upload(JirafeauClientT *client, struct Message *request,
+                         int fd, struct Message *reply) {
+  const char *  time              = get_string(request);
+  const char *  upload_password   = get_string(request);
+  const char *  one_time_download = get_string(request);
+  const char *  key               = get_string(request);
+  const char *  filename          = get_string(request);
+  UploadResultT result            = { 0 };
+  struct stat   st;
+
+  result.state = ERROR;
+  if (request->broken || fd == -1 || fstat(fd, &st) != 0) {
+    /* answered as an error */
+  } else if (S_ISREG(st.st_mode)) {
+    char path[64];
+
+    /* opened again by path, so a retry can read it from the start */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    result = jirafeau_client_upload(client, path, time, upload_password,
+                                    one_time_download &&
+                                        strcmp(one_time_download, "1") == 0,
+                                    key, filename);
+  } else {
+    result = jirafeau_client_upload_callback(
+        client, read_fd, &fd, time, upload_password,
+        one_time_download && strcmp(one_time_download, "1") == 0, key,
+        filename);
+  }
+
+  put_string(reply, status_name(result.state));
+  put_string(reply, result.file_id);
+  put_string(reply, result.delete_key);
+  put_string(reply, result.crypt_key);
+  put_string(reply, result.sha256[0] ? result.sha256 : NULL);
+  free(result.file_id);
+  free(result.delete_key);
+  free(result.crypt_key);
+}
+
+static void serve_download(JirafeauClientT *client, struct Message *request,
+                           int fd, struct Message *reply) {
+  const char *    file_id     = get_string(request);
+  const char *    output_path = get_string(request);
+  const char *    key         = get_string(request);
+  const char *    crypt_key   = get_string(request);
+  DownloadResultT result      = { 0 };
+
+  result.state = ERROR;
+  if (request->broken || !file_id || (!output_path && fd == -1)) {
+    /* answered as an error */
+  } else if (output_path) {
+    result = jirafeau_client_download(client, file_id, output_path, key,
+                                      crypt_key);
+  } else {
+    result = jirafeau_client_download_callback(client, file_id, key,
+                                               crypt_key, write_fd, &fd);
+  }
+
+  put_string(reply, status_name(result.state));
+  put_string(reply, result.download_path);
+  put_string(reply, result.sha256[0] ? result.sha256 : NULL);
+  free(result.download_path);
+}
+
+static void serve_delete(JirafeauClientT *client, struct Message *request,
+                         struct Message *reply) {
+  const char *  file_id    = get_string(request);
+  const char *  delete_key = get_string(request);
+  DeleteResultT result     = { 0 };
+
+  result.state = ERROR;
+  if (!request->broken && file_id && delete_key) {
+    result = jirafeau_client_delete(client, file_id, delete_key);
+  }
+  put_string(reply, status_name(result.state));
+}
+
+/**
+ * Answers the one request of a connection.
+ */
+static void *serve(void *arg) {
+  int                    sock    = (int)(intptr_t)arg;
+  int                    fd      = -1;
+  struct Message *       request = calloc(1, sizeof(struct Message));
+  struct Message *       reply   = calloc(1, sizeof(struct Message));
+
+  if (request && reply && peer_is_us(sock) &&
+      receive_message(sock, request, &fd)) {
+    const char *protocol  = get_string(request);
+    const char *operation = get_string(request);
+    const char *host      = get_string(request);
+
+    if (!protocol || strcmp(protocol, AGENT_PROTOCOL) != 0 || !operation) {
+      put_string(reply, AGENT_UNSUPPORTED);
+    } else if (host) {
+      JirafeauClientT *client = take_client(host);
+
+      if (client && strcmp(operation, "upload") == 0) {
+        serve_upload(client, request, fd, reply);
+      } else if (client && strcmp(operation, "download") == 0) {
+        serve_download(client, request, fd, reply);
+      } else if (client && strcmp(operation, "delete") == 0) {
+        serve_delete(client, request, reply);
+      } else if (client) {
+        put_string(reply, AGENT_UNSUPPORTED);
+      }
+      if (client) {
+        give_back(client);
+      }
+    }
+    if (!reply->size) {
+      put_string(reply, status_name(ERROR));
+    }
+    send_message(sock, reply, -1);
+  }
+
+  if (fd != -1) {
+    close(fd);
+  }
+  close(sock);
+  free(request);
+  free(reply);
+
+  pthread_mutex_lock(&agent_lock);
+  busy_count--;
+  pthread_cond_broadcast(&agent_idle);
+  pthread_mutex_unlock(&agent_lock);
+  return NULL;
+}
+
+/**
+ * @return Socket listening on `path`, -1 on failure
+ */
+static int listen_socket(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int                sock = connect_socket(path);
+
+  if (sock != -1) {
+    fprintf(stderr, "Error: An agent is listening on %s already\n", path);
+    close(sock);
+    return -1;
+  }
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error: The socket path is too long\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  /* the socket of an agent that did not shut down cleanly */
+  unlink(path);
+
+  sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    perror("Error: Could not create the socket\n");
+    return -1;
+  }
+
+  /* only the user may connect, the agent checks the peer as well */
+  mode_t mask = umask(0077);
+  bool   ok   = bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  umask(mask);
+  if (!ok || listen(sock, SOMAXCONN) == -1) {
+    perror("Error: Could not listen on the socket\n");
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+void subcommand_agent(int argc, char *argv[]) {
+  char *path = NULL;
+
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--socket") == 0) {
+      if (i + 1 < argc) {
+        free(path);
+        path = strdup(argv[++i]);
+      } else {
+        perror("Missing value for --socket\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (!path) {
+    path = agent_socket_path();
+  }
+  if (!path) {
+    fprintf(stderr, "Error: The agent is turned off, "
+                    "JIRAFEAU_AGENT_SOCKET is empty\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int listener = listen_socket(path);
+  if (listener == -1) {
+    exit(EXIT_FAILURE);
+  }
+
+  /* the signals end the loop below, whichever thread they hit */
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  int stop = signalfd(-1, &signals, SFD_CLOEXEC);
+
+  char *           host   = jirafeau_get_host();
+  JirafeauClientT *client = jirafeau_client_new(host);
+  if (client && jirafeau_client_connect(client) != 0) {
+    fprintf(stderr, "Warning: Could not reach %s yet\n", host);
+  }
+  free(host);
+  if (client) {
+    give_back(client);
+  }
+  fprintf(stderr, "Listening on %s\n", path);
+
+  struct pollfd fds[2] = { { listener, POLLIN, 0 }, { stop, POLLIN, 0 } };
+  while (stop != -1 && !fds[1].revents) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (!(fds[0].revents & POLLIN)) {
+      continue;
+    }
+
+    int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (sock == -1) {
+      continue;
+    }
+
+    pthread_t thread;
+    pthread_mutex_lock(&agent_lock);
+    busy_count++;
+    pthread_mutex_unlock(&agent_lock);
+    if (pthread_create(&thread, NULL, serve, (void *)(intptr_t)sock) == 0) {
+      pthread_detach(thread);
+    } else {
+      close(sock);
+      pthread_mutex_lock(&agent_lock);
+      busy_count--;
+      pthread_mutex_unlock(&agent_lock);
+    }
+  }
+
+  close(listener);
+  unlink(path);
+  free(path);
+
+  /* requests that are running get to finish */
+  pthread_mutex_lock(&agent_lock);
+  while (busy_count) {
+    pthread_cond_wait(&agent_idle, &agent_lock);
+  }
+  while (idle_count) {
+    jirafeau_client_free(idle_clients[--idle_count]);
+  }
+  pthread_mutex_unlock(&agent_lock);
+  if (stop != -1) {
+    close(stop);
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef AGENT_H
+#define AGENT_H
+
+#include "jirafeau.h"
+#include <stdbool.h>
+
+/**
+ * Serves the uploads, downloads and deletes of other jirafeau processes of
+ * the same user on a Unix socket. Their clients stay open between requests,
+ * so a request reuses the connection, DNS entry and TLS session of an
+ * earlier one instead of setting them up again. The connection to the
+ * given host is opened right away. Runs until SIGINT or SIGTERM.
+ *
+ * Usage: jirafeau <host> agent [--socket path]
+ */
+void subcommand_agent(int argc, char *argv[]);
+
+/**
+ * @return Path of the agent's socket (to be freed): $JIRAFEAU_AGENT_SOCKET,
+ * else jirafeau-agent.sock in $XDG_RUNTIME_DIR, else
+ * /tmp/jirafeau-agent-<uid>.sock. NULL if $JIRAFEAU_AGENT_SOCKET is set
+ * but empty, which turns the agent off.
+ */
+char *agent_socket_path(void);
+
+/**
+ * Has the agent upload a file, or stdin for `file_path` "-". The file is
+ * handed over as a descriptor, the agent reads it directly.
+ *
+ * @return false if no agent is running, the caller then uploads itself
+ */
+bool agent_upload(const char *file_path, const char *time,
+                  const char *upload_password, int one_time_download,
+                  const char *key, const char *filename,
+                  UploadResultT *result);
+
+/**
+ * Has the agent download a file, to stdout for `output_path` "-".
+ *
+ * @return false if no agent is running, the caller then downloads itself
+ */
+bool agent_download(const char *file_id, const char *output_path,
+                    const char *key, const char *crypt_key,
+                    DownloadResultT *result);
+
+/**
+ * Has the agent delete a file.
+ *
+ * @return false if no agent is running, the caller then deletes itself
+ */
+bool agent_delete(const char *file_id, const char *delete_key,
+                  DeleteResultT *result);
+
+#endif // AGENT_H
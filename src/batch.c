@@ -0,0 +1,435 @@
+#include "batch.h"
+#include "jirafeau.h"
+#include "json.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define BATCH_DEFAULT_JOBS 8
+#define BATCH_MAX_FIELDS   16
+#define BATCH_MAX_COLUMNS  8
+
+static int failures = 0;
+
+/**
+ * What is echoed back with the result of an operation.
+ */
+struct BatchOperation {
+  long  line;
+  char *id;
+  char *subject;
+  char *sha256; /* expected digest of the content, NULL for any */
+};
+
+static const char *status_name(Status state) {
+  switch (state) {
+  case SUCCESS:
+    return "success";
+
+  case FILE_NOT_FOUND:
+    return "file_not_found";
+
+  case ERROR:
+    break;
+  }
+  return "error";
+}
+
+static const char *operation_name(Operation operation) {
+  switch (operation) {
+  case UPLOAD:
+    return "upload";
+
+  case DOWNLOAD:
+    return "download";
+
+  case DELETE:
+    return "delete";
+  }
+  return NULL;
+}
+
+static void print_result_head(long line, const char *id, const char *op,
+                              const char *subject, const char *status) {
+  printf("{\"line\":%ld,\"id\":", line);
+  json_print_string(stdout, id);
+  printf(",\"op\":");
+  json_print_string(stdout, op);
+  printf(",\"subject\":");
+  json_print_string(stdout, subject);
+  printf(",\"status\":\"%s\"", status);
+}
+
+static void print_invalid(long line, const char *message) {
+  failures++;
+  print_result_head(line, NULL, NULL, NULL, "error");
+  printf(",\"error\":");
+  json_print_string(stdout, message);
+  printf("}\n");
+  fflush(stdout);
+}
+
+static void handle_result(JirafeauTransferT *     transfer,
+                          const OperationResultT *result, void *userdata) {
+  struct BatchOperation *operation = (struct BatchOperation *)userdata;
+  Status                 state     = ERROR;
+  const char *           sha256    = NULL;
+  bool                   mismatch  = false;
+
+  switch (result->operation) {
+  case UPLOAD:
+    state  = result->upload.state;
+    sha256 = result->upload.sha256;
+    break;
+
+  case DOWNLOAD:
+    state  = result->download.state;
+    sha256 = result->download.sha256;
+    break;
+
+  case DELETE:
+    state = result->delete.state;
+    break;
+  }
+
+  if (state == SUCCESS && operation->sha256 && sha256 &&
+      strcasecmp(operation->sha256, sha256) != 0) {
+    state    = ERROR;
+    mismatch = true;
+  }
+  if (state != SUCCESS) {
+    failures++;
+  }
+
+  print_result_head(operation->line, operation->id,
+                    operation_name(result->operation), operation->subject,
+                    status_name(state));
+  if (mismatch) {
+    printf(",\"error\":\"sha256 mismatch\"");
+  }
+  if (sha256) {
+    printf(",\"sha256\":");
+    json_print_string(stdout, sha256[0] ? sha256 : NULL);
+  }
+
+  if (result->operation == UPLOAD) {
+    printf(",\"file_id\":");
+    json_print_string(stdout, result->upload.file_id);
+    printf(",\"delete_key\":");
+    json_print_string(stdout, result->upload.delete_key);
+    printf(",\"crypt_key\":");
+    json_print_string(stdout, result->upload.crypt_key);
+    free(result->upload.file_id);
+    free(result->upload.delete_key);
+    free(result->upload.crypt_key);
+  } else if (result->operation == DOWNLOAD) {
+    printf(",\"download_path\":");
+    json_print_string(stdout, result->download.download_path);
+    free(result->download.download_path);
+  }
+  printf("}\n");
+  fflush(stdout);
+
+  free(operation->id);
+  free(operation->subject);
+  free(operation->sha256);
+  free(operation);
+}
+
+static int is_true(const char *value) {
+  return value && (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+}
+
+static const char *empty_to_null(const char *value) {
+  return value && value[0] ? value : NULL;
+}
+
+/**
+ * Applies the optional "priority" (interactive, normal or bulk) and
+ * "max_speed" (bytes per second) members of a JSON manifest line.
+ */
+static void schedule_json(JirafeauTransferT *transfer,
+                          const JsonFieldT *fields, int count) {
+  const char *priority  = json_get(fields, count, "priority");
+  const char *max_speed = json_get(fields, count, "max_speed");
+
+  if (priority && strcmp(priority, "interactive") == 0) {
+    jirafeau_transfer_set_priority(transfer, PRIORITY_INTERACTIVE);
+  } else if (priority && strcmp(priority, "bulk") == 0) {
+    jirafeau_transfer_set_priority(transfer, PRIORITY_BULK);
+  }
+  if (max_speed) {
+    jirafeau_transfer_set_max_speed(transfer, strtoll(max_speed, NULL, 10));
+  }
+}
+
+/**
+ * Queues the operation of a JSON manifest line, e.g.
+ * {"op":"upload","file":"a.txt","time":"week"}.
+ */
+static int queue_json(JirafeauMultiT *multi, const char *text, long line) {
+  JsonFieldT fields[BATCH_MAX_FIELDS];
+  int        count = json_parse_object(text, fields, BATCH_MAX_FIELDS);
+
+  if (count < 0) {
+    print_invalid(line, "invalid JSON object");
+    return 0;
+  }
+
+  const char *op      = json_get(fields, count, "op");
+  const char *file    = json_get(fields, count, "file");
+  const char *file_id = json_get(fields, count, "file_id");
+  const char *subject = op && strcmp(op, "upload") == 0 ? file : file_id;
+
+  if (!op || !subject) {
+    print_invalid(line, "missing \"op\", \"file\" or \"file_id\"");
+    json_free_fields(fields, count);
+    return 0;
+  }
+  /* a delete has no content to check */
+  if (strcmp(op, "delete") == 0 && json_get(fields, count, "sha256")) {
+    print_invalid(line, "\"sha256\" does not apply to a delete");
+    json_free_fields(fields, count);
+    return 0;
+  }
+
+  struct BatchOperation *operation = calloc(1, sizeof(struct BatchOperation));
+  JirafeauTransferT *    transfer  = NULL;
+
+  if (!operation) {
+    print_invalid(line, "out of memory");
+    json_free_fields(fields, count);
+    return 0;
+  }
+  operation->line    = line;
+  operation->subject = strdup(subject);
+  if (json_get(fields, count, "id")) {
+    operation->id = strdup(json_get(fields, count, "id"));
+  }
+  if (json_get(fields, count, "sha256")) {
+    operation->sha256 = strdup(json_get(fields, count, "sha256"));
+  }
+
+  if (strcmp(op, "upload") == 0) {
+    const char *time = json_get(fields, count, "time");
+
+    transfer = jirafeau_multi_upload(
+      multi, file, time ? time : "month",
+      json_get(fields, count, "upload_password"),
+      is_true(json_get(fields, count, "one_time_download")),
+      json_get(fields, count, "key"), json_get(fields, count, "filename"),
+      handle_result, operation);
+  } else if (strcmp(op, "download") == 0) {
+    transfer = jirafeau_multi_download(
+      multi, file_id, json_get(fields, count, "output"),
+      json_get(fields, count, "key"), json_get(fields, count, "crypt_key"),
+      handle_result, operation);
+  } else if (strcmp(op, "delete") == 0) {
+    const char *delete_key = json_get(fields, count, "delete_key");
+    if (delete_key) {
+      transfer = jirafeau_multi_delete(multi, file_id, delete_key,
+                                       handle_result, operation);
+    }
+  }
+
+  if (transfer) {
+    schedule_json(transfer, fields, count);
+  }
+  json_free_fields(fields, count);
+
+  if (!transfer) {
+    print_invalid(line, "unknown operation or missing arguments");
+    free(operation->id);
+    free(operation->subject);
+    free(operation->sha256);
+    free(operation);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Queues the operation of a TSV manifest line:
+ *   upload   <file> [filename] [time]
+ *   download <file_id> [output] [crypt_key]
+ *   delete   <file_id> <delete_key>
+ */
+static int queue_tsv(JirafeauMultiT *multi, char *text, long line) {
+  char *columns[BATCH_MAX_COLUMNS] = { 0 };
+  int   count                      = 0;
+
+  for (char *column = text; column && count < BATCH_MAX_COLUMNS; count++) {
+    columns[count] = column;
+    column         = strchr(column, '\t');
+    if (column) {
+      *column++ = '\0';
+    }
+  }
+
+  if (count < 2 || !columns[1][0]) {
+    print_invalid(line, "expected <op>\\t<file|file_id>");
+    return 0;
+  }
+
+  struct BatchOperation *operation = calloc(1, sizeof(struct BatchOperation));
+  JirafeauTransferT *    transfer  = NULL;
+
+  if (!operation) {
+    print_invalid(line, "out of memory");
+    return 0;
+  }
+  operation->line    = line;
+  operation->subject = strdup(columns[1]);
+
+  if (strcmp(columns[0], "upload") == 0) {
+    const char *time = empty_to_null(columns[3]);
+
+    transfer = jirafeau_multi_upload(multi, columns[1], time ? time : "month",
+                                     NULL, 0, NULL, empty_to_null(columns[2]),
+                                     handle_result, operation);
+  } else if (strcmp(columns[0], "download") == 0) {
+    transfer = jirafeau_multi_download(multi, columns[1],
+                                       empty_to_null(columns[2]), NULL,
+                                       empty_to_null(columns[3]),
+                                       handle_result, operation);
+  } else if (strcmp(columns[0], "delete") == 0 && empty_to_null(columns[2])) {
+    transfer = jirafeau_multi_delete(multi, columns[1], columns[2],
+                                     handle_result, operation);
+  }
+
+  if (!transfer) {
+    print_invalid(line, "unknown operation or missing arguments");
+    free(operation->subject);
+    free(operation);
+    return 0;
+  }
+  return 1;
+}
+
+void subcommand_batch(int argc, char *argv[]) {
+  char *          manifest = NULL;
+  int             jobs     = BATCH_DEFAULT_JOBS;
+  curl_off_t      rate     = 0;
+  int             retries  = 0;
+  int             mux      = 0;
+  long            buffer   = 0;
+  int             queue    = JIRAFEAU_DEFAULT_WRITE_QUEUE;
+  int             direct   = 0;
+  FILE *          input    = stdin;
+  char *          host;
+  JirafeauMultiT *multi;
+
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        jobs = atoi(argv[++i]);
+      } else {
+        perror("Missing value for -j/--jobs\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--limit-rate") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        rate = (curl_off_t)atoi(argv[++i]) * 1024;
+      } else {
+        perror("Missing value for --limit-rate\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--retry") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+        retries = atoi(argv[++i]);
+      } else {
+        perror("Missing value for --retry\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--multiplex") == 0) {
+      mux = 1;
+    } else if (strcmp(argv[i], "--buffer-size") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        buffer = (long)atoi(argv[++i]) * 1024;
+      } else {
+        perror("Missing value for --buffer-size\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--write-queue") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+        queue = atoi(argv[++i]);
+      } else {
+        perror("Missing value for --write-queue\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--direct") == 0) {
+      direct = 1;
+    } else if (!manifest) {
+      manifest = argv[i];
+    }
+  }
+
+  if (manifest && strcmp(manifest, "-") != 0) {
+    input = fopen(manifest, "r");
+    if (!input) {
+      perror("Error: Could not open manifest\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  host  = jirafeau_get_host();
+  multi = jirafeau_multi_new(host, jobs);
+  free(host);
+  if (!multi) {
+    perror("Could not set up the connection\n");
+    exit(EXIT_FAILURE);
+  }
+  jirafeau_multi_set_max_speed(multi, rate);
+  jirafeau_multi_set_retry(multi, retries, 0);
+  jirafeau_multi_set_download_io(multi, buffer, queue, direct);
+  if (mux) {
+    jirafeau_multi_set_multiplex(multi, 1);
+  }
+
+  char *  text     = NULL;
+  size_t  capacity = 0;
+  long    line     = 0;
+  int     pending  = 0;
+  int     eof      = 0;
+  ssize_t len;
+
+  while (!eof || pending) {
+    /* read ahead only enough to keep all slots busy */
+    while (!eof && pending < jobs * 2) {
+      if ((len = getline(&text, &capacity, input)) == -1) {
+        eof = 1;
+        break;
+      }
+      line++;
+
+      while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
+        text[--len] = '\0';
+      }
+      if (len == 0 || text[0] == '#') {
+        continue;
+      }
+
+      if (text[0] == '{') {
+        pending += queue_json(multi, text, line);
+      } else {
+        pending += queue_tsv(multi, text, line);
+      }
+    }
+
+    if (pending) {
+      pending = jirafeau_multi_perform(multi, 1000);
+    }
+  }
+
+  free(text);
+  jirafeau_multi_free(multi);
+  if (input != stdin) {
+    fclose(input);
+  }
+
+  if (failures) {
+    exit(EXIT_FAILURE);
+  }
+}
@@ -0,0 +1,12 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/**
+ * Runs the operations listed in a manifest (or stdin) concurrently and
+ * prints one NDJSON result per operation as it finishes.
+ *
+ * Usage: jirafeau <host> batch [manifest|-] [-j N]
+ */
+void subcommand_batch(int argc, char *argv[]);
+
+#endif // BATCH_H
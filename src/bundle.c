@@ -0,0 +1,507 @@
+#include "bundle.h"
+#include "jirafeau.h"
+#include "json.h"
+#include "recursive.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TAR_BLOCK 512
+
+/* largest size the 11 octal digits of a ustar header hold */
+#define TAR_MAX_SIZE 077777777777LL
+
+/* SHA-256 of no data, members without data are not requested */
+#define EMPTY_SHA256                                                           \
+  "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+
+/**
+ * State of the archive while it is sent, one member at a time.
+ */
+struct Bundle {
+  const char *root;
+  struct Walk walk;
+  FILE *      index;
+  dev_t       index_dev; /* the index is not put into the archive */
+  ino_t       index_ino;
+  curl_off_t  size; /* of what has been queued so far */
+  int         failures;
+
+  char *      path;   /* current member */
+  int         fd;     /* of the current member, -1 if none */
+  char *      header; /* headers of the current member, or the end */
+  size_t      header_size;
+  size_t      header_sent;
+  curl_off_t  left;    /* data of the member still to send */
+  curl_off_t  padding; /* zeros up to the next block */
+  bool        finished;
+};
+
+/**
+ * Writes `value` zero padded into all but the last byte of a header field,
+ * which stays NUL. The callers keep it within the digits the field holds.
+ */
+static void put_octal(char *field, size_t size, unsigned long long value) {
+  char digits[24]; /* any 64 bit value */
+
+  snprintf(digits, sizeof(digits), "%0*llo", (int)size - 1, value);
+  memcpy(field, digits, size - 1);
+}
+
+/**
+ * Fills in a ustar header block, `block` has to be zeroed.
+ *
+ * @param prefix Directory part of the name, NULL if it fits `name` alone
+ */
+static void fill_header(char *block, const char *prefix, size_t prefix_len,
+                        const char *name, char type, unsigned mode,
+                        curl_off_t size, time_t mtime) {
+  unsigned sum = 0;
+
+  memcpy(block, name, strlen(name) > 100 ? 100 : strlen(name));
+  put_octal(block + 100, 8, mode);
+  put_octal(block + 108, 8, 0);
+  put_octal(block + 116, 8, 0);
+  put_octal(block + 124, 12, size > TAR_MAX_SIZE ? 0 : size);
+  put_octal(block + 136, 12,
+            mtime < 0 ? 0 : mtime > TAR_MAX_SIZE ? TAR_MAX_SIZE : mtime);
+  block[156] = type;
+  memcpy(block + 257, "ustar", 6);
+  memcpy(block + 263, "00", 2);
+  put_octal(block + 329, 8, 0);
+  put_octal(block + 337, 8, 0);
+  if (prefix) {
+    memcpy(block + 345, prefix, prefix_len);
+  }
+
+  /* the checksum is taken with its own field as spaces */
+  memset(block + 148, ' ', 8);
+  for (int i = 0; i < TAR_BLOCK; i++) {
+    sum += (unsigned char)block[i];
+  }
+  snprintf(block + 148, 8, "%06o", sum);
+}
+
+/**
+ * Finds where to split a path into the ustar prefix (155 bytes) and name
+ * (100 bytes).
+ *
+ * @return Position of the slash to split at, 0 if the path fits the name
+ * alone, -1 if it fits neither
+ */
+static long split_path(const char *path) {
+  size_t len = strlen(path);
+
+  if (len <= 100) {
+    return 0;
+  }
+  for (size_t i = len - 101; i <= 155 && i + 1 < len; i++) {
+    if (path[i] == '/') {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Writes a pax record "<length> <key>=<value>\n", whose length counts its
+ * own digits.
+ *
+ * @param out Where to write it, NULL to only measure it
+ * @return Length of the record
+ */
+static size_t pax_record(char *out, const char *key, const char *value) {
+  size_t base = strlen(key) + strlen(value) + 3;
+  size_t len  = base + 1;
+
+  while (len != base + snprintf(NULL, 0, "%zu", len)) {
+    len = base + snprintf(NULL, 0, "%zu", len);
+  }
+  if (out) {
+    snprintf(out, len + 1, "%zu %s=%s\n", len, key, value);
+  }
+  return len;
+}
+
+/**
+ * Puts together the header blocks of a member. Paths the ustar fields
+ * can't hold and files of 8 GiB or more get a pax extended header first.
+ *
+ * @return false if out of memory
+ */
+static bool queue_header(struct Bundle *bundle, const char *path,
+                         const struct stat *st) {
+  long   split      = split_path(path);
+  bool   big        = st->st_size > TAR_MAX_SIZE;
+  size_t pax_size   = 0;
+  size_t pax_blocks = 0;
+  char   size_text[32];
+  char * block;
+
+  snprintf(size_text, sizeof(size_text), "%lld", (long long)st->st_size);
+  if (split < 0) {
+    pax_size += pax_record(NULL, "path", path);
+  }
+  if (big) {
+    pax_size += pax_record(NULL, "size", size_text);
+  }
+  if (pax_size) {
+    pax_blocks = 1 + (pax_size + TAR_BLOCK - 1) / TAR_BLOCK;
+  }
+
+  bundle->header_size = (pax_blocks + 1) * TAR_BLOCK;
+  /* one more byte for the NUL the last pax record is written with */
+  bundle->header = calloc(1, bundle->header_size + 1);
+  if (!bundle->header) {
+    return false;
+  }
+  bundle->header_sent = 0;
+
+  if (pax_size) {
+    char *records = bundle->header + TAR_BLOCK;
+
+    fill_header(bundle->header, NULL, 0, "././@PaxHeader", 'x', 0644,
+                pax_size, st->st_mtime);
+    if (split < 0) {
+      records += pax_record(records, "path", path);
+    }
+    if (big) {
+      pax_record(records, "size", size_text);
+    }
+  }
+
+  block = bundle->header + pax_blocks * TAR_BLOCK;
+  if (split > 0) {
+    fill_header(block, path, split, path + split + 1, '0',
+                st->st_mode & 07777, st->st_size, st->st_mtime);
+  } else {
+    /* without a pax path the name is cut, readers use the pax one */
+    fill_header(block, NULL, 0, path, '0', st->st_mode & 07777, st->st_size,
+                st->st_mtime);
+  }
+  return true;
+}
+
+/**
+ * Moves on to the next file of the tree, or to the end of the archive.
+ *
+ * @return false once the end has been queued as well
+ */
+static bool next_member(struct Bundle *bundle) {
+  char *path;
+
+  if (bundle->fd != -1) {
+    close(bundle->fd);
+    bundle->fd = -1;
+  }
+  free(bundle->path);
+  bundle->path = NULL;
+  free(bundle->header);
+  bundle->header      = NULL;
+  bundle->header_size = 0;
+  bundle->header_sent = 0;
+  if (bundle->finished) {
+    return false;
+  }
+
+  while ((path = walk_next(&bundle->walk))) {
+    char *      full = walk_join(bundle->root, path);
+    int         fd   = full ? open(full, O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_dev == bundle->index_dev &&
+        st.st_ino == bundle->index_ino) {
+      close(fd);
+      free(full);
+      free(path);
+      continue;
+    }
+    if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        !queue_header(bundle, path, &st)) {
+      fprintf(stderr, "Error: Could not add '%s'\n", full ? full : path);
+      bundle->failures++;
+      if (fd != -1) {
+        close(fd);
+      }
+      free(full);
+      free(path);
+      continue;
+    }
+    free(full);
+
+    bundle->path    = path;
+    bundle->fd      = fd;
+    bundle->left    = st.st_size;
+    bundle->padding = (TAR_BLOCK - st.st_size % TAR_BLOCK) % TAR_BLOCK;
+
+    fprintf(bundle->index, "{\"path\":");
+    json_print_string(bundle->index, path);
+    fprintf(bundle->index, ",\"offset\":%lld,\"size\":%lld}\n",
+            (long long)(bundle->size + bundle->header_size),
+            (long long)st.st_size);
+    bundle->size += bundle->header_size + st.st_size + bundle->padding;
+    return true;
+  }
+
+  /* two zero blocks end the archive */
+  bundle->finished = true;
+  bundle->header   = calloc(2, TAR_BLOCK);
+  if (!bundle->header) {
+    return false;
+  }
+  bundle->header_size = 2 * TAR_BLOCK;
+  bundle->size += bundle->header_size;
+  return true;
+}
+
+static size_t read_bundle(char *buffer, size_t size, void *userdata) {
+  struct Bundle *bundle = (struct Bundle *)userdata;
+  size_t         done   = 0;
+
+  while (done < size) {
+    size_t room = size - done;
+
+    if (bundle->header_sent < bundle->header_size) {
+      size_t n = bundle->header_size - bundle->header_sent;
+
+      if (n > room) {
+        n = room;
+      }
+      memcpy(buffer + done, bundle->header + bundle->header_sent, n);
+      bundle->header_sent += n;
+      done += n;
+    } else if (bundle->left > 0) {
+      size_t  want = bundle->left < (curl_off_t)room ? (size_t)bundle->left
+                                                     : room;
+      ssize_t n    = read(bundle->fd, buffer + done, want);
+
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        fprintf(stderr, "Error: Could not read '%s'\n", bundle->path);
+        return JIRAFEAU_READ_ABORT;
+      }
+      if (n == 0) {
+        /* the header promised more, keep the offsets of the index right */
+        fprintf(stderr,
+                "WARNING: '%s' shrank while it was sent, filled up with "
+                "zeros\n",
+                bundle->path);
+        bundle->padding += bundle->left;
+        bundle->left = 0;
+        continue;
+      }
+      bundle->left -= n;
+      done += n;
+    } else if (bundle->padding > 0) {
+      size_t n = bundle->padding < (curl_off_t)room ? (size_t)bundle->padding
+                                                    : room;
+
+      memset(buffer + done, 0, n);
+      bundle->padding -= n;
+      done += n;
+    } else if (!next_member(bundle)) {
+      break;
+    }
+  }
+  return done;
+}
+
+UploadResultT upload_bundle(JirafeauClientT *client, const char *dir,
+                            const char *index_path, const char *time,
+                            const char *upload_password,
+                            int one_time_download, const char *key,
+                            int *failures) {
+  struct Bundle bundle = { 0 };
+  UploadResultT result = { 0 };
+  struct stat   st;
+  char *        copy;
+  char *        name;
+  char *        filename;
+
+  result.state = ERROR;
+  *failures    = 0;
+
+  bundle.index = fopen(index_path, "w");
+  if (!bundle.index) {
+    perror("Error: Could not create the index\n");
+    return result;
+  }
+  if (fstat(fileno(bundle.index), &st) == 0) {
+    bundle.index_dev = st.st_dev;
+    bundle.index_ino = st.st_ino;
+  }
+  bundle.root      = dir;
+  bundle.walk.root = dir;
+  bundle.fd        = -1;
+  if (!walk_enter(&bundle.walk, strdup(""))) {
+    fclose(bundle.index);
+    unlink(index_path);
+    *failures = 1;
+    return result;
+  }
+
+  /* named after the directory, "bundle" for / and the like */
+  copy = strdup(dir);
+  name = copy ? basename(copy) : NULL;
+  if (!name || strcmp(name, "/") == 0 || strcmp(name, ".") == 0 ||
+      strcmp(name, "..") == 0) {
+    name = "bundle";
+  }
+  filename = malloc(strlen(name) + 5);
+  if (filename) {
+    sprintf(filename, "%s.tar", name);
+  }
+  free(copy);
+
+  result = jirafeau_client_upload_callback(client, read_bundle, &bundle, time,
+                                           upload_password, one_time_download,
+                                           key, filename);
+  free(filename);
+
+  if (bundle.fd != -1) {
+    close(bundle.fd);
+  }
+  free(bundle.path);
+  free(bundle.header);
+  walk_free(&bundle.walk);
+
+  if (fclose(bundle.index) != 0 && result.state == SUCCESS) {
+    perror("Error: Could not write the index\n");
+    bundle.failures++;
+  }
+  if (result.state != SUCCESS) {
+    unlink(index_path);
+  }
+  *failures = bundle.failures + bundle.walk.errors;
+  return result;
+}
+
+/**
+ * Looks up a member in the index of a bundle.
+ *
+ * @return false if it is not in there or the index can't be read
+ */
+static bool find_member(const char *index_path, const char *member,
+                        curl_off_t *offset, curl_off_t *size) {
+  FILE * index = fopen(index_path, "r");
+  char * line  = NULL;
+  size_t room  = 0;
+  bool   found = false;
+
+  if (!index) {
+    perror("Error: Could not open the index\n");
+    return false;
+  }
+  while (!found && getline(&line, &room, index) > 0) {
+    JsonFieldT  fields[8];
+    int         count = json_parse_object(line, fields, 8);
+    const char *path  = json_get(fields, count, "path");
+
+    if (count < 0) {
+      continue;
+    }
+    if (path && strcmp(path, member) == 0 &&
+        json_get(fields, count, "offset") && json_get(fields, count, "size")) {
+      *offset = strtoll(json_get(fields, count, "offset"), NULL, 10);
+      *size   = strtoll(json_get(fields, count, "size"), NULL, 10);
+      found   = *offset >= 0 && *size >= 0;
+    }
+    json_free_fields(fields, count);
+  }
+  free(line);
+  fclose(index);
+
+  if (!found) {
+    fprintf(stderr, "Error: '%s' is not in the index\n", member);
+  }
+  return found;
+}
+
+static int write_member(const char *data, size_t size, void *userdata) {
+  return fwrite(data, 1, size, (FILE *)userdata) == size ? 0 : 1;
+}
+
+DownloadResultT download_member(JirafeauClientT *client, const char *file_id,
+                                const char *index_path, const char *member,
+                                const char *output_path, const char *key,
+                                const char *crypt_key) {
+  DownloadResultT result = { 0 };
+  curl_off_t      offset;
+  curl_off_t      size;
+  struct stat     st;
+  char *          copy;
+  char *          path;
+  FILE *          out;
+
+  result.state = ERROR;
+  if (!find_member(index_path, member, &offset, &size)) {
+    return result;
+  }
+
+  if (output_path && strcmp(output_path, "-") == 0) {
+    if (size == 0) {
+      result.state = SUCCESS;
+      strcpy(result.sha256, EMPTY_SHA256);
+      return result;
+    }
+    return jirafeau_client_download_range(client, file_id, key, crypt_key,
+                                          offset, size, write_member, stdout);
+  }
+
+  /* a directory or nothing keeps the member's own name */
+  copy = strdup(member);
+  if (!copy) {
+    return result;
+  }
+  if (!output_path) {
+    path = strdup(basename(copy));
+  } else if (stat(output_path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    char *name = basename(copy);
+
+    path = malloc(strlen(output_path) + strlen(name) + 2);
+    if (path) {
+      sprintf(path, "%s%s%s", output_path,
+              output_path[strlen(output_path) - 1] == '/' ? "" : "/", name);
+    }
+  } else {
+    path = strdup(output_path);
+  }
+  free(copy);
+  if (!path) {
+    return result;
+  }
+
+  out = fopen(path, "wb");
+  if (!out) {
+    perror("Error: Could not create the output file\n");
+    free(path);
+    return result;
+  }
+  if (size == 0) {
+    result.state = SUCCESS;
+    strcpy(result.sha256, EMPTY_SHA256);
+  } else {
+    result = jirafeau_client_download_range(client, file_id, key, crypt_key,
+                                            offset, size, write_member, out);
+  }
+  if (fclose(out) != 0 && result.state == SUCCESS) {
+    perror("Error: Could not write the output file\n");
+    result.state = ERROR;
+  }
+
+  if (result.state == SUCCESS) {
+    result.download_path = path;
+  } else {
+    unlink(path);
+    free(path);
+  }
+  return result;
+}
@@ -0,0 +1,47 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include "jirafeau.h"
+
+/**
+ * Uploads every regular file below a directory as a single ustar archive,
+ * named after the directory, in one request instead of one per file. The
+ * archive is put together while it is sent, without a staging file. An
+ * NDJSON index with the offset and size of each member's data in the
+ * archive is written along, download_member fetches single members with
+ * it. The index is removed if the upload fails.
+ *
+ * Usage: jirafeau <host> upload -R <dir> --bundle <index> [upload options]
+ *
+ * @param client Client to upload with, without compression or encryption
+ * @param dir Directory to upload
+ * @param index_path Where to write the index
+ * @param failures Receives the number of files that could not be added
+ * @return Result of the upload of the archive
+ */
+UploadResultT upload_bundle(JirafeauClientT *client, const char *dir,
+                            const char *index_path, const char *time,
+                            const char *upload_password,
+                            int one_time_download, const char *key,
+                            int *failures);
+
+/**
+ * Downloads one member of an archive uploaded with upload_bundle, with a
+ * range request for just its data.
+ *
+ * Usage: jirafeau <host> download <file_id> --member <path> --index <index>
+ *
+ * @param client Client to download with
+ * @param file_id ID of the archive
+ * @param index_path Index written by upload_bundle
+ * @param member Path of the member in the archive
+ * @param output_path File or directory to write the member to, "-" for
+ * stdout, NULL for the current directory
+ * @return Result of the download, `download_path` is where the member went
+ */
+DownloadResultT download_member(JirafeauClientT *client, const char *file_id,
+                                const char *index_path, const char *member,
+                                const char *output_path, const char *key,
+                                const char *crypt_key);
+
+#endif // BUNDLE_H
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE /* copy_file_range */
+#include "jirafeau_private.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* leftovers of stores that were interrupted are removed after a day */
+#define CACHE_STALE_TEMP_AGE (24 * 60 * 60)
+
+#define CACHE_COPY_BUFFER_SIZE (1024 * 1024)
+
+struct CacheEntry {
+  char            name[JIRAFEAU_SHA256_HEX_SIZE];
+  off_t           size;
+  struct timespec used;
+};
+
+static char *cache_path(const char *cache_dir, const char *entry,
+                        const char *suffix) {
+  size_t size = strlen(cache_dir) + strlen(entry) + strlen(suffix) + 2;
+  char * path = malloc(size);
+
+  if (path) {
+    snprintf(path, size, "%s/%s%s", cache_dir, entry, suffix);
+  }
+  return path;
+}
+
+void jirafeau_cache_entry_key(const char *host_url, const char *file_id,
+                              const char *file_key, const char *crypt_key,
+                              bool        decompress,
+                              char        entry[JIRAFEAU_SHA256_HEX_SIZE]) {
+  const char *fields[] = { host_url, file_id, file_key, crypt_key,
+                           decompress ? "z" : "-" };
+
+  jirafeau_sha256_fields(fields, 5, entry);
+}
+
+/**
+ * Copies the content of `in` to `out`, sharing the blocks (reflink) if the
+ * file system supports it.
+ */
+static bool clone_or_copy(int in, int out) {
+  if (ioctl(out, FICLONE, in) == 0) {
+    return true;
+  }
+
+  /* copy_file_range copies inside the kernel, without a round trip */
+  for (;;) {
+    ssize_t n = copy_file_range(in, NULL, out, NULL, CACHE_COPY_BUFFER_SIZE,
+                                0);
+    if (n == 0) {
+      return true;
+    }
+    if (n < 0) {
+      break;
+    }
+  }
+
+  /* e.g. across file systems on old kernels */
+  char *buffer = malloc(CACHE_COPY_BUFFER_SIZE);
+  bool  ok     = buffer && lseek(in, 0, SEEK_SET) == 0 &&
+            lseek(out, 0, SEEK_SET) == 0 && ftruncate(out, 0) == 0;
+
+  while (ok) {
+    ssize_t n = read(in, buffer, CACHE_COPY_BUFFER_SIZE);
+    if (n <= 0) {
+      ok = n == 0;
+      break;
+    }
+    for (ssize_t done = 0; ok && done < n;) {
+      ssize_t written = write(out, buffer + done, n - done);
+      ok              = written > 0;
+      done           += written;
+    }
+  }
+  free(buffer);
+  return ok;
+}
+
+/**
+ * @return The first line of the file an entry keeps next to it (to be
+ * freed), NULL if there is none
+ */
+static char *read_sidecar(const char *cache_dir, const char *entry,
+                          const char *suffix) {
+  char * path = cache_path(cache_dir, entry, suffix);
+  FILE * file = path ? fopen(path, "r") : NULL;
+  char * line = NULL;
+  size_t size = 0;
+
+  if (file && getline(&line, &size, file) > 0) {
+    line[strcspn(line, "\n")] = '\0';
+  } else {
+    free(line);
+    line = NULL;
+  }
+
+  if (file) {
+    fclose(file);
+  }
+  free(path);
+  return line;
+}
+
+char *jirafeau_cache_name(const char *cache_dir, const char *entry) {
+  return read_sidecar(cache_dir, entry, ".name");
+}
+
+void jirafeau_cache_sha256(const char *cache_dir, const char *entry,
+                           char        hex[JIRAFEAU_SHA256_HEX_SIZE]) {
+  char *line = read_sidecar(cache_dir, entry, ".sha256");
+
+  hex[0] = '\0';
+  if (line && strlen(line) == JIRAFEAU_SHA256_HEX_SIZE - 1) {
+    memcpy(hex, line, JIRAFEAU_SHA256_HEX_SIZE);
+  }
+  free(line);
+}
+
+static bool is_sidecar(const char *name, size_t len, const char *suffix) {
+  size_t suffix_len = strlen(suffix);
+
+  return len == JIRAFEAU_SHA256_HEX_SIZE - 1 + suffix_len &&
+         strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+bool jirafeau_cache_deliver(const char *cache_dir, const char *entry,
+                            const char *destination) {
+  char *path = cache_path(cache_dir, entry, "");
+  int   in   = path ? open(path, O_RDONLY) : -1;
+  bool  ok   = false;
+
+  if (in == -1) {
+    free(path);
+    return false;
+  }
+
+  /* the modification time orders the entries for eviction */
+  futimens(in, NULL);
+
+  unlink(destination);
+
+  int out = open(destination, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (out != -1 && ioctl(out, FICLONE, in) == 0) {
+    ok = true;
+  } else {
+    /*
+     * A hardlink shares the read-only cache file, it stays valid when the
+     * entry gets evicted.
+     */
+    if (out != -1) {
+      close(out);
+      unlink(destination);
+    }
+    if (link(path, destination) == 0) {
+      ok  = true;
+      out = -1;
+    } else {
+      out = open(destination, O_WRONLY | O_CREAT | O_EXCL, 0644);
+      ok  = out != -1 && clone_or_copy(in, out);
+    }
+  }
+
+  if (out != -1 && close(out) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    unlink(destination);
+  }
+  close(in);
+  free(path);
+  return ok;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const struct CacheEntry *x = a;
+  const struct CacheEntry *y = b;
+
+  if (x->used.tv_sec != y->used.tv_sec) {
+    return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+  }
+  return (x->used.tv_nsec > y->used.tv_nsec) -
+         (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+/**
+ * Removes the least recently used entries until the cache fits into
+ * `max_size`, and leftovers of interrupted stores.
+ */
+static void evict(const char *cache_dir, curl_off_t max_size) {
+  char *             lock_path = cache_path(cache_dir, ".lock", "");
+  int                lock      = open(lock_path, O_RDWR | O_CREAT, 0600);
+  DIR *              dir       = opendir(cache_dir);
+  struct CacheEntry *entries   = NULL;
+  size_t             count     = 0;
+  size_t             capacity  = 0;
+  curl_off_t         total     = 0;
+  time_t             now       = time(NULL);
+  struct dirent *    file;
+
+  if (lock == -1 || !dir) {
+    goto done;
+  }
+  /* only one process evicts at a time, the others find it done */
+  flock(lock, LOCK_EX);
+
+  while ((file = readdir(dir))) {
+    struct stat st;
+    size_t      len = strlen(file->d_name);
+
+    if (file->d_name[0] == '.' ||
+        fstatat(dirfd(dir), file->d_name, &st, 0) != 0 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    if (len == JIRAFEAU_SHA256_HEX_SIZE - 1) {
+      if (count == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        struct CacheEntry *grown = realloc(entries,
+                                           capacity * sizeof(*entries));
+        if (!grown) {
+          goto done;
+        }
+        entries = grown;
+      }
+      memcpy(entries[count].name, file->d_name, len + 1);
+      entries[count].size = st.st_size;
+      entries[count].used = st.st_mtim;
+      total              += st.st_size;
+      count++;
+    } else if (!is_sidecar(file->d_name, len, ".name") &&
+               !is_sidecar(file->d_name, len, ".sha256") &&
+               now - st.st_mtime > CACHE_STALE_TEMP_AGE) {
+      unlinkat(dirfd(dir), file->d_name, 0);
+    }
+  }
+
+  qsort(entries, count, sizeof(*entries), compare_entries);
+  for (size_t i = 0; i < count && total > max_size; i++) {
+    char name[JIRAFEAU_SHA256_HEX_SIZE + 7];
+
+    unlinkat(dirfd(dir), entries[i].name, 0);
+    snprintf(name, sizeof(name), "%s.name", entries[i].name);
+    unlinkat(dirfd(dir), name, 0);
+    snprintf(name, sizeof(name), "%s.sha256", entries[i].name);
+    unlinkat(dirfd(dir), name, 0);
+    total -= entries[i].size;
+  }
+
+done:
+  if (dir) {
+    closedir(dir);
+  }
+  if (lock != -1) {
+    close(lock);
+  }
+  free(entries);
+  free(lock_path);
+}
+
+/**
+ * Writes `content` to `path` through a temporary file so readers never see
+ * it half written.
+ */
+static bool write_atomically(const char *path, const char *content) {
+  size_t size = strlen(path) + 8;
+  char * temp = malloc(size);
+  int    fd;
+  bool   ok;
+
+  if (!temp) {
+    return false;
+  }
+  snprintf(temp, size, "%s.XXXXXX", path);
+  fd = mkstemp(temp);
+  if (fd == -1) {
+    free(temp);
+    return false;
+  }
+
+  ok = dprintf(fd, "%s\n", content) == (int)strlen(content) + 1;
+  ok = close(fd) == 0 && ok && rename(temp, path) == 0;
+  if (!ok) {
+    unlink(temp);
+  }
+  free(temp);
+  return ok;
+}
+
+void jirafeau_cache_store(const char *cache_dir, const char *entry,
+                          const char *source_path, const char *name,
+                          const char *sha256, curl_off_t max_size) {
+  char *path = cache_path(cache_dir, entry, "");
+  char *temp = cache_path(cache_dir, entry, ".XXXXXX");
+  int   in   = open(source_path, O_RDONLY);
+  int   out  = -1;
+  bool  ok   = false;
+
+  if (mkdir(cache_dir, 0700) == -1 && errno != EEXIST) {
+    perror("Error: Could not create the download cache\n");
+    goto done;
+  }
+
+  if (!path || !temp || in == -1 || (out = mkstemp(temp)) == -1) {
+    goto done;
+  }
+
+  /* read-only so a hardlinked delivery can't change the cached content */
+  ok = clone_or_copy(in, out) && fchmod(out, 0444) == 0;
+  ok = close(out) == 0 && ok;
+  if (ok && name) {
+    char *name_path = cache_path(cache_dir, entry, ".name");
+
+    ok = name_path && write_atomically(name_path, name);
+    free(name_path);
+  }
+  if (ok) {
+    /* a digest of what was stored before must not stay around */
+    char *sha256_path = cache_path(cache_dir, entry, ".sha256");
+
+    if (sha256 && sha256[0]) {
+      ok = sha256_path && write_atomically(sha256_path, sha256);
+    } else if (sha256_path) {
+      unlink(sha256_path);
+    }
+    free(sha256_path);
+  }
+  ok = ok && rename(temp, path) == 0;
+  if (!ok) {
+    unlink(temp);
+  }
+
+  evict(cache_dir, max_size);
+
+done:
+  if (in != -1) {
+    close(in);
+  }
+  free(temp);
+  free(path);
+}
@@ -0,0 +1,178 @@
+#include "jirafeau_private.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef JIRAFEAU_WITH_ZSTD
+
+#include <zstd.h>
+
+struct Compressor {
+  ZSTD_CCtx *   cctx;
+  char *        input;
+  size_t        input_capacity;
+  ZSTD_inBuffer in;
+  bool          source_done;
+  bool          done;
+};
+
+struct Decompressor {
+  ZSTD_DCtx *dctx;
+  char *     output;
+  size_t     output_capacity;
+  size_t     frame_left; /* last hint of ZSTD_decompressStream, 0 at the end */
+};
+
+bool jirafeau_compression_supported(void) {
+  return true;
+}
+
+struct Compressor *jirafeau_compressor_new(int level, int workers) {
+  struct Compressor *c = calloc(1, sizeof(struct Compressor));
+
+  if (!c) {
+    return NULL;
+  }
+
+  c->cctx           = ZSTD_createCCtx();
+  c->input_capacity = ZSTD_CStreamInSize();
+  c->input          = malloc(c->input_capacity);
+  if (!c->cctx || !c->input ||
+      ZSTD_isError(ZSTD_CCtx_setParameter(c->cctx, ZSTD_c_compressionLevel,
+                                          level))) {
+    jirafeau_compressor_free(c);
+    return NULL;
+  }
+
+  /* fails if libzstd was built without threads, then compress inline */
+  if (workers > 0) {
+    ZSTD_CCtx_setParameter(c->cctx, ZSTD_c_nbWorkers, workers);
+  }
+  return c;
+}
+
+size_t jirafeau_compressor_read(struct Compressor *c, char *buffer,
+                                size_t size, JirafeauSourceFunction source,
+                                void *arg) {
+  ZSTD_outBuffer out = { buffer, size, 0 };
+
+  /* curl treats 0 as the end, keep going until there is output */
+  while (out.pos == 0 && !c->done) {
+    if (c->in.pos == c->in.size && !c->source_done) {
+      size_t n = source(c->input, c->input_capacity, arg);
+      if (n == CURL_READFUNC_ABORT || n > c->input_capacity) {
+        return CURL_READFUNC_ABORT;
+      }
+      c->in.src      = c->input;
+      c->in.size     = n;
+      c->in.pos      = 0;
+      c->source_done = n == 0;
+    }
+
+    size_t left = ZSTD_compressStream2(c->cctx, &out, &c->in,
+                                       c->source_done ? ZSTD_e_end
+                                                      : ZSTD_e_continue);
+    if (ZSTD_isError(left)) {
+      fprintf(stderr, "Error: zstd: %s\n", ZSTD_getErrorName(left));
+      return CURL_READFUNC_ABORT;
+    }
+    c->done = c->source_done && left == 0;
+  }
+  return out.pos;
+}
+
+void jirafeau_compressor_free(struct Compressor *c) {
+  if (c) {
+    ZSTD_freeCCtx(c->cctx);
+    free(c->input);
+    free(c);
+  }
+}
+
+struct Decompressor *jirafeau_decompressor_new(void) {
+  struct Decompressor *d = calloc(1, sizeof(struct Decompressor));
+
+  if (!d) {
+    return NULL;
+  }
+
+  d->dctx            = ZSTD_createDCtx();
+  d->output_capacity = ZSTD_DStreamOutSize();
+  d->output          = malloc(d->output_capacity);
+  if (!d->dctx || !d->output) {
+    jirafeau_decompressor_free(d);
+    return NULL;
+  }
+  return d;
+}
+
+bool jirafeau_decompressor_write(struct Decompressor *d, const char *data,
+                                 size_t size, JirafeauSinkFunction sink,
+                                 void *arg) {
+  ZSTD_inBuffer in = { data, size, 0 };
+
+  /* the output may be full before the input is used up, drain it */
+  while (in.pos < in.size) {
+    ZSTD_outBuffer out  = { d->output, d->output_capacity, 0 };
+    size_t         left = ZSTD_decompressStream(d->dctx, &out, &in);
+
+    if (ZSTD_isError(left)) {
+      fprintf(stderr, "Error: zstd: %s\n", ZSTD_getErrorName(left));
+      return false;
+    }
+    d->frame_left = left;
+    if (out.pos && !sink(d->output, out.pos, arg)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool jirafeau_decompressor_finished(const struct Decompressor *d) {
+  return d->frame_left == 0;
+}
+
+void jirafeau_decompressor_free(struct Decompressor *d) {
+  if (d) {
+    ZSTD_freeDCtx(d->dctx);
+    free(d->output);
+    free(d);
+  }
+}
+
+#else
+
+bool jirafeau_compression_supported(void) {
+  return false;
+}
+
+struct Compressor *jirafeau_compressor_new(int level, int workers) {
+  return NULL;
+}
+
+size_t jirafeau_compressor_read(struct Compressor *c, char *buffer,
+                                size_t size, JirafeauSourceFunction source,
+                                void *arg) {
+  return CURL_READFUNC_ABORT;
+}
+
+void jirafeau_compressor_free(struct Compressor *c) {
+}
+
+struct Decompressor *jirafeau_decompressor_new(void) {
+  return NULL;
+}
+
+bool jirafeau_decompressor_write(struct Decompressor *d, const char *data,
+                                 size_t size, JirafeauSinkFunction sink,
+                                 void *arg) {
+  return false;
+}
+
+bool jirafeau_decompressor_finished(const struct Decompressor *d) {
+  return false;
+}
+
+void jirafeau_decompressor_free(struct Decompressor *d) {
+}
+
+#endif // JIRAFEAU_WITH_ZSTD
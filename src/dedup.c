@@ -0,0 +1,338 @@
+#include "jirafeau_private.h"
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+/* how much longer than now an entry has to live to be handed out */
+#define DEDUP_MIN_LIFETIME 60
+
+#define HASH_BUFFER_SIZE (1024 * 1024)
+
+static void to_hex(const unsigned char *digest, unsigned int size,
+                   char *hex) {
+  static const char digits[] = "0123456789abcdef";
+
+  for (unsigned int i = 0; i < size; i++) {
+    hex[2 * i]     = digits[digest[i] >> 4];
+    hex[2 * i + 1] = digits[digest[i] & 0xf];
+  }
+  hex[2 * size] = '\0';
+}
+
+static bool finish_digest(EVP_MD_CTX *ctx, char *hex) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int  size;
+  bool          ok = EVP_DigestFinal_ex(ctx, digest, &size) == 1;
+
+  EVP_MD_CTX_free(ctx);
+  if (ok) {
+    to_hex(digest, size, hex);
+  }
+  return ok;
+}
+
+bool jirafeau_sha256_buffer(const void *data, size_t size,
+                            char hex[JIRAFEAU_SHA256_HEX_SIZE]) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+  if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1 ||
+      EVP_DigestUpdate(ctx, data, size) != 1) {
+    EVP_MD_CTX_free(ctx);
+    return false;
+  }
+  return finish_digest(ctx, hex);
+}
+
+bool jirafeau_sha256_fields(const char *const *fields, int count,
+                            char hex[JIRAFEAU_SHA256_HEX_SIZE]) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  bool        ok  = ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1;
+
+  /* NUL separated so that no two combinations give the same text */
+  for (int i = 0; ok && i < count; i++) {
+    const char *field = fields[i] ? fields[i] : "";
+
+    ok = (i == 0 || EVP_DigestUpdate(ctx, "", 1) == 1) &&
+         EVP_DigestUpdate(ctx, field, strlen(field)) == 1;
+  }
+  if (!ok) {
+    EVP_MD_CTX_free(ctx);
+  }
+  if (!ok || !finish_digest(ctx, hex)) {
+    hex[0] = '\0';
+    return false;
+  }
+  return true;
+}
+
+struct Digest {
+  EVP_MD_CTX *ctx;
+  curl_off_t  position; /* bytes of the content hashed so far */
+  bool        failed;
+};
+
+struct Digest *jirafeau_digest_new(void) {
+  struct Digest *d = calloc(1, sizeof(struct Digest));
+
+  if (d) {
+    d->ctx = EVP_MD_CTX_new();
+    if (!d->ctx || EVP_DigestInit_ex(d->ctx, EVP_sha256(), NULL) != 1) {
+      jirafeau_digest_free(d);
+      return NULL;
+    }
+  }
+  return d;
+}
+
+void jirafeau_digest_update(struct Digest *d, const void *data, size_t size,
+                            curl_off_t offset) {
+  curl_off_t end = offset + (curl_off_t)size;
+
+  if (!d || !d->ctx || offset > d->position || end <= d->position) {
+    return;
+  }
+
+  size_t skip = (size_t)(d->position - offset);
+  if (EVP_DigestUpdate(d->ctx, (const char *)data + skip, size - skip) != 1) {
+    d->failed = true;
+  }
+  d->position = end;
+}
+
+bool jirafeau_digest_read(struct Digest *d, int fd, curl_off_t end) {
+  char *buffer = d->position < end ? malloc(HASH_BUFFER_SIZE) : NULL;
+  bool  ok     = d->position >= end || buffer;
+
+  while (ok && d->position < end) {
+    size_t  len = HASH_BUFFER_SIZE;
+    ssize_t n;
+
+    if ((curl_off_t)len > end - d->position) {
+      len = (size_t)(end - d->position);
+    }
+    n  = pread(fd, buffer, len, d->position);
+    ok = n > 0;
+    if (ok) {
+      jirafeau_digest_update(d, buffer, n, d->position);
+    }
+  }
+  free(buffer);
+  return ok;
+}
+
+curl_off_t jirafeau_digest_position(const struct Digest *d) {
+  return d->position;
+}
+
+bool jirafeau_digest_finish(struct Digest *d,
+                            char           hex[JIRAFEAU_SHA256_HEX_SIZE]) {
+  EVP_MD_CTX *ctx = d->ctx;
+
+  d->ctx = NULL;
+  if (ctx && d->failed) {
+    EVP_MD_CTX_free(ctx);
+    return false;
+  }
+  return ctx && finish_digest(ctx, hex);
+}
+
+void jirafeau_digest_free(struct Digest *d) {
+  if (d) {
+    EVP_MD_CTX_free(d->ctx);
+    free(d);
+  }
+}
+
+bool jirafeau_sha256_file(const char *path,
+                          char        hex[JIRAFEAU_SHA256_HEX_SIZE]) {
+  EVP_MD_CTX *ctx    = EVP_MD_CTX_new();
+  char *      buffer = malloc(HASH_BUFFER_SIZE);
+  int         fd     = open(path, O_RDONLY);
+  bool        ok     = ctx && buffer && fd != -1 &&
+                EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1;
+
+  if (fd != -1) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  while (ok) {
+    ssize_t n = read(fd, buffer, HASH_BUFFER_SIZE);
+    if (n <= 0) {
+      ok = n == 0;
+      break;
+    }
+    ok = EVP_DigestUpdate(ctx, buffer, n) == 1;
+  }
+
+  if (fd != -1) {
+    close(fd);
+  }
+  free(buffer);
+
+  if (!ok) {
+    EVP_MD_CTX_free(ctx);
+    return false;
+  }
+  return finish_digest(ctx, hex);
+}
+
+void jirafeau_dedup_entry_key(const char *content_hash, const char *host_url,
+                              const char *filename, const char *key,
+                              char        entry[JIRAFEAU_SHA256_HEX_SIZE]) {
+  const char *fields[] = { content_hash, host_url, filename, key };
+
+  jirafeau_sha256_fields(fields, 4, entry);
+}
+
+time_t jirafeau_dedup_expiry(const char *time_name, time_t now) {
+  static const struct {
+    const char *name;
+    time_t      seconds;
+  } lifetimes[] = {
+    { "minute", 60 },         { "hour", 3600 },
+    { "day", 86400 },         { "week", 604800 },
+    { "fortnight", 1209600 }, { "fornight", 1209600 },
+    { "month", 2419200 },     { "quarter", 7257600 },
+    { "year", 31536000 },
+  };
+
+  if (!time_name || strcmp(time_name, "none") == 0) {
+    return 0;
+  }
+  for (size_t i = 0; i < sizeof(lifetimes) / sizeof(lifetimes[0]); i++) {
+    if (strcmp(time_name, lifetimes[i].name) == 0) {
+      return now + lifetimes[i].seconds;
+    }
+  }
+  return -1;
+}
+
+static bool entry_alive(time_t expires, time_t now) {
+  return expires == 0 || expires > now + DEDUP_MIN_LIFETIME;
+}
+
+/**
+ * Splits an index line "ENTRY\tFILE_ID\tDELETE_KEY\tCRYPT_KEY\tEXPIRES" in
+ * place.
+ *
+ * @return false if the line is malformed
+ */
+static bool split_line(char *line, char *fields[5]) {
+  line[strcspn(line, "\n")] = '\0';
+
+  /* not strtok_r, it would merge the tabs around an empty crypt key */
+  for (int i = 0; i < 5; i++) {
+    fields[i] = line;
+    line      = strchr(line, '\t');
+    if (!line) {
+      return i == 4;
+    }
+    *line++ = '\0';
+  }
+  return false;
+}
+
+bool jirafeau_dedup_lookup(const char *index_path, const char *entry,
+                           UploadResultT *result) {
+  FILE * index = fopen(index_path, "r");
+  char * line  = NULL;
+  size_t size  = 0;
+  time_t now   = time(NULL);
+  bool   found = false;
+
+  if (!index) {
+    return false;
+  }
+  flock(fileno(index), LOCK_SH);
+
+  /* later lines are newer, the last alive match wins */
+  while (getline(&line, &size, index) != -1) {
+    char *fields[5];
+
+    if (!split_line(line, fields) || strcmp(fields[0], entry) != 0 ||
+        !entry_alive(strtoll(fields[4], NULL, 10), now)) {
+      continue;
+    }
+
+    free(result->file_id);
+    free(result->delete_key);
+    free(result->crypt_key);
+    result->file_id    = strdup(fields[1]);
+    result->delete_key = strdup(fields[2]);
+    result->crypt_key  = fields[3][0] ? strdup(fields[3]) : NULL;
+    result->state      = SUCCESS;
+    found              = true;
+  }
+
+  flock(fileno(index), LOCK_UN);
+  fclose(index);
+  free(line);
+  return found;
+}
+
+void jirafeau_dedup_store(const char *index_path, const char *entry,
+                          const UploadResultT *result,
+                          const char *         time_name) {
+  time_t expires = jirafeau_dedup_expiry(time_name, time(NULL));
+  /* the index holds delete keys, keep it private */
+  int    fd      = open(index_path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+
+  if (fd == -1) {
+    perror("Error: Could not open the dedup index\n");
+    return;
+  }
+  flock(fd, LOCK_EX);
+  dprintf(fd, "%s\t%s\t%s\t%s\t%lld\n", entry, result->file_id,
+          result->delete_key, result->crypt_key ? result->crypt_key : "",
+          (long long)expires);
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+void jirafeau_dedup_forget(const char *index_path, const char *file_id) {
+  FILE * index = fopen(index_path, "r+");
+  char * line  = NULL;
+  size_t size  = 0;
+  time_t now   = time(NULL);
+  char * kept  = NULL;
+  size_t kept_size;
+  FILE * out;
+
+  if (!index) {
+    return;
+  }
+  flock(fileno(index), LOCK_EX);
+
+  /* rewrite the index in place, dropping expired entries on the way */
+  out = open_memstream(&kept, &kept_size);
+  while (out && getline(&line, &size, index) != -1) {
+    char *fields[5];
+    char *copy = strdup(line);
+
+    if (copy && split_line(copy, fields) &&
+        strcmp(fields[1], file_id) != 0 &&
+        entry_alive(strtoll(fields[4], NULL, 10), now)) {
+      fputs(line, out);
+    }
+    free(copy);
+  }
+
+  if (out && fclose(out) == 0) {
+    rewind(index);
+    /* a shorter index would keep the tail of the old lines */
+    if (fwrite(kept, 1, kept_size, index) != kept_size ||
+        fflush(index) != 0 || ftruncate(fileno(index), kept_size) != 0) {
+      perror("Error: Could not rewrite the dedup index\n");
+    }
+  }
+
+  flock(fileno(index), LOCK_UN);
+  fclose(index);
+  free(kept);
+  free(line);
+}
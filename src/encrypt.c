@@ -0,0 +1,463 @@
+#include "jirafeau_private.h"
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * An encrypted file is a header followed by chunks sealed with AES-256-GCM:
+ *
+ *   "JFEGCM01" | salt[16] | iterations (u32 BE) | chunk size (u32 BE) |
+ *   nonce prefix[4]
+ *   chunk 0 | chunk 1 | ... | last chunk
+ *
+ * Every chunk is `chunk size` bytes of ciphertext and a 16 byte tag, except
+ * the last one, which is shorter (possibly empty). The nonce of a chunk is
+ * the prefix and its index (u64 BE). The header and whether the chunk is the
+ * last one are authenticated with it, so chunks can neither be reordered,
+ * dropped nor cut off at the end.
+ */
+#define ENCRYPTION_MAGIC             "JFEGCM01"
+#define ENCRYPTION_MAGIC_SIZE        8
+#define ENCRYPTION_SALT_SIZE         16
+#define ENCRYPTION_NONCE_PREFIX_SIZE 4
+#define ENCRYPTION_HEADER_SIZE       36
+#define ENCRYPTION_NONCE_SIZE        12
+#define ENCRYPTION_TAG_SIZE          16
+#define ENCRYPTION_KEY_SIZE          32
+
+#define ENCRYPTION_CHUNK_SIZE     (64 * 1024)
+#define ENCRYPTION_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+/* PBKDF2-HMAC-SHA256 rounds to derive the key from the passphrase */
+#define ENCRYPTION_ITERATIONS     200000
+#define ENCRYPTION_MAX_ITERATIONS 10000000
+
+enum SlotState { SLOT_FREE, SLOT_QUEUED, SLOT_BUSY, SLOT_DONE, SLOT_FAILED };
+
+/**
+ * A chunk on its way through the pipeline, encrypted in place.
+ */
+struct Slot {
+  unsigned char *data;
+  size_t         len;
+  size_t         sent;
+  uint64_t       index;
+  bool           last;
+  enum SlotState state;
+};
+
+struct Encryptor {
+  unsigned char key[ENCRYPTION_KEY_SIZE];
+  unsigned char header[ENCRYPTION_HEADER_SIZE];
+  size_t        header_sent;
+  size_t        chunk_size;
+
+  /* ring of the chunks in flight, the oldest at `head` */
+  struct Slot *slots;
+  int          slot_count;
+  int          head;
+  int          in_flight;
+  uint64_t     next_index;
+  bool         source_done;
+
+  pthread_t *     threads;
+  int             thread_count;
+  pthread_mutex_t lock;
+  pthread_cond_t  queued;
+  pthread_cond_t  done;
+  bool            stop;
+};
+
+struct Decryptor {
+  char *        passphrase;
+  unsigned char key[ENCRYPTION_KEY_SIZE];
+  unsigned char header[ENCRYPTION_HEADER_SIZE];
+  size_t        header_len;
+  size_t        chunk_size;
+
+  unsigned char *chunk;
+  size_t         chunk_len;
+  uint64_t       index;
+};
+
+static void put_u32(unsigned char *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static bool derive_key(const char *passphrase, const unsigned char *salt,
+                       uint32_t iterations, unsigned char *key) {
+  return PKCS5_PBKDF2_HMAC(passphrase, strlen(passphrase), salt,
+                           ENCRYPTION_SALT_SIZE, iterations, EVP_sha256(),
+                           ENCRYPTION_KEY_SIZE, key) == 1;
+}
+
+static void chunk_nonce(const unsigned char *header, uint64_t index,
+                        unsigned char nonce[ENCRYPTION_NONCE_SIZE]) {
+  memcpy(nonce, header + ENCRYPTION_HEADER_SIZE - ENCRYPTION_NONCE_PREFIX_SIZE,
+         ENCRYPTION_NONCE_PREFIX_SIZE);
+  for (int i = 0; i < 8; i++) {
+    nonce[ENCRYPTION_NONCE_PREFIX_SIZE + i] = index >> (56 - 8 * i);
+  }
+}
+
+/**
+ * Encrypts or decrypts `len` bytes of `data` in place. Encryption appends the
+ * tag, decryption checks the one that follows the data.
+ */
+static bool gcm_chunk(bool encrypt, const unsigned char *key,
+                      const unsigned char *header, uint64_t index, bool last,
+                      unsigned char *data, size_t len) {
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  unsigned char   nonce[ENCRYPTION_NONCE_SIZE];
+  unsigned char   flag = last;
+  int             n;
+  bool            ok;
+
+  chunk_nonce(header, index, nonce);
+  ok = ctx &&
+       EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, nonce, encrypt) ==
+         1 &&
+       EVP_CipherUpdate(ctx, NULL, &n, header, ENCRYPTION_HEADER_SIZE) == 1 &&
+       EVP_CipherUpdate(ctx, NULL, &n, &flag, 1) == 1 &&
+       EVP_CipherUpdate(ctx, data, &n, data, len) == 1;
+
+  if (ok && !encrypt) {
+    ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, ENCRYPTION_TAG_SIZE,
+                             data + len) == 1;
+  }
+  ok = ok && EVP_CipherFinal_ex(ctx, data + len, &n) == 1;
+  if (ok && encrypt) {
+    ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, ENCRYPTION_TAG_SIZE,
+                             data + len) == 1;
+  }
+
+  EVP_CIPHER_CTX_free(ctx);
+  return ok;
+}
+
+static bool seal(struct Encryptor *e, struct Slot *slot) {
+  if (!gcm_chunk(true, e->key, e->header, slot->index, slot->last,
+                 slot->data, slot->len)) {
+    return false;
+  }
+  slot->len += ENCRYPTION_TAG_SIZE;
+  return true;
+}
+
+/**
+ * @return The oldest chunk waiting for a worker, NULL if there is none
+ */
+static struct Slot *next_queued(struct Encryptor *e) {
+  for (int i = 0; i < e->in_flight; i++) {
+    struct Slot *slot = &e->slots[(e->head + i) % e->slot_count];
+    if (slot->state == SLOT_QUEUED) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+static void *encrypt_worker(void *arg) {
+  struct Encryptor *e = (struct Encryptor *)arg;
+
+  pthread_mutex_lock(&e->lock);
+  for (;;) {
+    struct Slot *slot = NULL;
+
+    while (!e->stop && !(slot = next_queued(e))) {
+      pthread_cond_wait(&e->queued, &e->lock);
+    }
+    if (e->stop) {
+      break;
+    }
+
+    slot->state = SLOT_BUSY;
+    pthread_mutex_unlock(&e->lock);
+    bool ok = seal(e, slot);
+    pthread_mutex_lock(&e->lock);
+
+    slot->state = ok ? SLOT_DONE : SLOT_FAILED;
+    pthread_cond_broadcast(&e->done);
+  }
+  pthread_mutex_unlock(&e->lock);
+  return NULL;
+}
+
+struct Encryptor *jirafeau_encryptor_new(const char *passphrase, int workers) {
+  struct Encryptor *e = calloc(1, sizeof(struct Encryptor));
+  unsigned char *   salt;
+
+  if (!e) {
+    return NULL;
+  }
+  pthread_mutex_init(&e->lock, NULL);
+  pthread_cond_init(&e->queued, NULL);
+  pthread_cond_init(&e->done, NULL);
+
+  e->chunk_size = ENCRYPTION_CHUNK_SIZE;
+  salt          = e->header + ENCRYPTION_MAGIC_SIZE;
+  memcpy(e->header, ENCRYPTION_MAGIC, ENCRYPTION_MAGIC_SIZE);
+  put_u32(salt + ENCRYPTION_SALT_SIZE, ENCRYPTION_ITERATIONS);
+  put_u32(salt + ENCRYPTION_SALT_SIZE + 4, e->chunk_size);
+
+  if (RAND_bytes(salt, ENCRYPTION_SALT_SIZE) != 1 ||
+      RAND_bytes(e->header + ENCRYPTION_HEADER_SIZE -
+                   ENCRYPTION_NONCE_PREFIX_SIZE,
+                 ENCRYPTION_NONCE_PREFIX_SIZE) != 1 ||
+      !derive_key(passphrase, salt, ENCRYPTION_ITERATIONS, e->key)) {
+    jirafeau_encryptor_free(e);
+    return NULL;
+  }
+
+  /* two chunks per worker keep them busy while curl sends the oldest */
+  e->slot_count = workers > 0 ? 2 * workers : 1;
+  e->slots      = calloc(e->slot_count, sizeof(struct Slot));
+  if (!e->slots) {
+    jirafeau_encryptor_free(e);
+    return NULL;
+  }
+  for (int i = 0; i < e->slot_count; i++) {
+    e->slots[i].data = malloc(e->chunk_size + ENCRYPTION_TAG_SIZE);
+    if (!e->slots[i].data) {
+      jirafeau_encryptor_free(e);
+      return NULL;
+    }
+  }
+
+  e->threads = workers > 0 ? calloc(workers, sizeof(pthread_t)) : NULL;
+  for (int i = 0; e->threads && i < workers; i++) {
+    if (pthread_create(&e->threads[i], NULL, encrypt_worker, e) != 0) {
+      /* go on with the workers there are, or inline */
+      break;
+    }
+    e->thread_count++;
+  }
+  return e;
+}
+
+/**
+ * Reads the next chunk from `source` into `slot`.
+ */
+static bool fill_slot(struct Encryptor *e, struct Slot *slot,
+                      JirafeauSourceFunction source, void *arg) {
+  slot->len  = 0;
+  slot->sent = 0;
+
+  while (slot->len < e->chunk_size) {
+    size_t room = e->chunk_size - slot->len;
+    size_t n    = source((char *)slot->data + slot->len, room, arg);
+
+    if (n == CURL_READFUNC_ABORT || n > room) {
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    slot->len += n;
+  }
+
+  slot->index    = e->next_index++;
+  slot->last     = slot->len < e->chunk_size;
+  e->source_done = slot->last;
+  return true;
+}
+
+size_t jirafeau_encryptor_read(struct Encryptor *e, char *buffer, size_t size,
+                               JirafeauSourceFunction source, void *arg) {
+  if (e->header_sent < ENCRYPTION_HEADER_SIZE) {
+    size_t n = ENCRYPTION_HEADER_SIZE - e->header_sent;
+    if (n > size) {
+      n = size;
+    }
+    memcpy(buffer, e->header + e->header_sent, n);
+    e->header_sent += n;
+    return n;
+  }
+
+  /* keep the pipeline full, the workers encrypt while curl sends */
+  while (e->in_flight < e->slot_count && !e->source_done) {
+    struct Slot *slot = &e->slots[(e->head + e->in_flight) % e->slot_count];
+
+    if (!fill_slot(e, slot, source, arg)) {
+      return CURL_READFUNC_ABORT;
+    }
+
+    pthread_mutex_lock(&e->lock);
+    if (e->thread_count) {
+      slot->state = SLOT_QUEUED;
+      pthread_cond_signal(&e->queued);
+    } else {
+      slot->state = seal(e, slot) ? SLOT_DONE : SLOT_FAILED;
+    }
+    e->in_flight++;
+    pthread_mutex_unlock(&e->lock);
+  }
+
+  if (e->in_flight == 0) {
+    return 0;
+  }
+
+  struct Slot *slot = &e->slots[e->head];
+
+  pthread_mutex_lock(&e->lock);
+  while (slot->state == SLOT_QUEUED || slot->state == SLOT_BUSY) {
+    pthread_cond_wait(&e->done, &e->lock);
+  }
+  pthread_mutex_unlock(&e->lock);
+
+  if (slot->state == SLOT_FAILED) {
+    fprintf(stderr, "Error: Could not encrypt the upload\n");
+    return CURL_READFUNC_ABORT;
+  }
+
+  size_t n = slot->len - slot->sent;
+  if (n > size) {
+    n = size;
+  }
+  memcpy(buffer, slot->data + slot->sent, n);
+  slot->sent += n;
+
+  if (slot->sent == slot->len) {
+    pthread_mutex_lock(&e->lock);
+    slot->state = SLOT_FREE;
+    e->head     = (e->head + 1) % e->slot_count;
+    e->in_flight--;
+    pthread_mutex_unlock(&e->lock);
+  }
+  return n;
+}
+
+void jirafeau_encryptor_free(struct Encryptor *e) {
+  if (!e) {
+    return;
+  }
+
+  pthread_mutex_lock(&e->lock);
+  e->stop = true;
+  pthread_cond_broadcast(&e->queued);
+  pthread_mutex_unlock(&e->lock);
+  for (int i = 0; i < e->thread_count; i++) {
+    pthread_join(e->threads[i], NULL);
+  }
+
+  for (int i = 0; e->slots && i < e->slot_count; i++) {
+    free(e->slots[i].data);
+  }
+  OPENSSL_cleanse(e->key, sizeof(e->key));
+  pthread_mutex_destroy(&e->lock);
+  pthread_cond_destroy(&e->queued);
+  pthread_cond_destroy(&e->done);
+  free(e->threads);
+  free(e->slots);
+  free(e);
+}
+
+struct Decryptor *jirafeau_decryptor_new(const char *passphrase) {
+  struct Decryptor *d = calloc(1, sizeof(struct Decryptor));
+
+  if (d) {
+    d->passphrase = strdup(passphrase);
+    if (!d->passphrase) {
+      free(d);
+      return NULL;
+    }
+  }
+  return d;
+}
+
+/**
+ * Checks the header once it is complete and derives the key from it.
+ */
+static bool read_header(struct Decryptor *d) {
+  const unsigned char *salt       = d->header + ENCRYPTION_MAGIC_SIZE;
+  uint32_t             iterations = get_u32(salt + ENCRYPTION_SALT_SIZE);
+
+  d->chunk_size = get_u32(salt + ENCRYPTION_SALT_SIZE + 4);
+  if (memcmp(d->header, ENCRYPTION_MAGIC, ENCRYPTION_MAGIC_SIZE) != 0 ||
+      iterations == 0 || iterations > ENCRYPTION_MAX_ITERATIONS ||
+      d->chunk_size == 0 || d->chunk_size > ENCRYPTION_MAX_CHUNK_SIZE) {
+    fprintf(stderr, "Error: The file is not encrypted by jirafeau\n");
+    return false;
+  }
+
+  d->chunk = malloc(d->chunk_size + ENCRYPTION_TAG_SIZE);
+  return d->chunk && derive_key(d->passphrase, salt, iterations, d->key);
+}
+
+static bool open_chunk(struct Decryptor *d, bool last,
+                       JirafeauSinkFunction sink, void *arg) {
+  size_t len = d->chunk_len - ENCRYPTION_TAG_SIZE;
+
+  if (!gcm_chunk(false, d->key, d->header, d->index, last, d->chunk, len)) {
+    fprintf(stderr,
+            "Error: Wrong passphrase or the encrypted file is damaged\n");
+    return false;
+  }
+  d->index++;
+  d->chunk_len = 0;
+  return len == 0 || sink((const char *)d->chunk, len, arg);
+}
+
+bool jirafeau_decryptor_write(struct Decryptor *d, const char *data,
+                              size_t size, JirafeauSinkFunction sink,
+                              void *arg) {
+  while (size > 0) {
+    size_t take;
+
+    if (d->header_len < ENCRYPTION_HEADER_SIZE) {
+      take = ENCRYPTION_HEADER_SIZE - d->header_len;
+      take = take < size ? take : size;
+      memcpy(d->header + d->header_len, data, take);
+      d->header_len += take;
+      if (d->header_len == ENCRYPTION_HEADER_SIZE && !read_header(d)) {
+        return false;
+      }
+    } else {
+      /* a full chunk is never the last one, that one is shorter */
+      take = d->chunk_size + ENCRYPTION_TAG_SIZE - d->chunk_len;
+      take = take < size ? take : size;
+      memcpy(d->chunk + d->chunk_len, data, take);
+      d->chunk_len += take;
+      if (d->chunk_len == d->chunk_size + ENCRYPTION_TAG_SIZE &&
+          !open_chunk(d, false, sink, arg)) {
+        return false;
+      }
+    }
+    data += take;
+    size -= take;
+  }
+  return true;
+}
+
+bool jirafeau_decryptor_finish(struct Decryptor *d, JirafeauSinkFunction sink,
+                               void *arg) {
+  if (d->header_len < ENCRYPTION_HEADER_SIZE ||
+      d->chunk_len < ENCRYPTION_TAG_SIZE) {
+    fprintf(stderr, "Error: The encrypted file ended early\n");
+    return false;
+  }
+  return open_chunk(d, true, sink, arg);
+}
+
+void jirafeau_decryptor_free(struct Decryptor *d) {
+  if (d) {
+    OPENSSL_cleanse(d->passphrase, strlen(d->passphrase));
+    OPENSSL_cleanse(d->key, sizeof(d->key));
+    free(d->passphrase);
+    free(d->chunk);
+    free(d);
+  }
+}
@@ -1,24 +1,97 @@
 #include "jirafeau.h"
+#include "jirafeau_private.h"
 #include <curl/curl.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-static char * host_url;
-static char * output_dir       = NULL;
-static char * output_file_path = NULL;
-static FILE * output_file      = NULL;
-static Status state;
+/* how much of a page is searched for Jirafeau's messages */
+#define PAGE_LOOKAHEAD (64 * 1024)
 
-struct MemoryStruct {
-  char * memory;
-  size_t size;
+/* clients of the jirafeau_upload/download functions kept for the next call */
+#define IDLE_CLIENTS 4
+
+/* host, cache and compression of the jirafeau_upload/download functions */
+static char *          host_url;
+static char *          download_cache_dir;
+static curl_off_t      download_cache_size;
+static int             compression_level;
+static int             compression_workers;
+static bool            decompress_downloads;
+static char *          encryption_passphrase;
+static int             encryption_workers;
+static int             retry_count;
+static long            retry_delay_ms;
+static pthread_mutex_t host_url_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* guarded by host_url_lock, their connections stay open between calls */
+static JirafeauClientT *idle_clients[IDLE_CLIENTS];
+static int              idle_count;
+
+static pthread_once_t curl_initialized = PTHREAD_ONCE_INIT;
+
+/* DNS and TLS session caches of all handles in the process */
+static CURLSH *        share;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+struct JirafeauClient {
+  char * host_url;
+  CURL * curl;
+  CURLM *multi;
+  char * dedup_index;
+
+  char *     cache_dir;
+  curl_off_t cache_size;
+
+  int  compression_level;
+  int  compression_workers;
+  bool decompress;
+
+  char *passphrase;
+  int   encryption_workers;
+
+  curl_off_t max_speed;
+
+  long receive_buffer;
+  int  write_queue;
+  bool direct_io;
+
+  int   retries;
+  long  retry_delay;
+  char *journal_dir;
 };
 
+static char *build_url(const char *template, ...) {
+  va_list args;
+
+  va_start(args, template);
+  int len = vsnprintf(NULL, 0, template, args);
+  va_end(args);
+
+  char *url = malloc(len + 1);
+  if (!url) {
+    return NULL;
+  }
+
+  va_start(args, template);
+  vsnprintf(url, len + 1, template, args);
+  va_end(args);
+
+  return url;
+}
+
 static size_t write_request_body_to_memory(void *contents, size_t size,
                                            size_t nmemb, void *userdata) {
   size_t realsize          = size * nmemb;
@@ -38,338 +111,2664 @@ static size_t write_request_body_to_memory(void *contents, size_t size,
   return realsize;
 }
 
-static size_t handle_request_body(void *ptr, size_t size, size_t nmemb,
-                                  void *stream) {
-  if (strstr(ptr, "file is not found")) {
-    state = FILE_NOT_FOUND;
+static bool has_output(const struct DownloadContext *ctx) {
+  return ctx->write_callback || ctx->output_file;
+}
+
+/**
+ * Writes to the output file, through a writer thread unless that is turned
+ * off or can't be started.
+ */
+static bool write_file(struct DownloadContext *ctx, const char *data,
+                       size_t len) {
+  if (!ctx->writer && ctx->write_queue) {
+    ctx->writer = jirafeau_writer_new(fileno(ctx->output_file), ctx->written,
+                                      ctx->write_queue, ctx->direct_io);
+    if (!ctx->writer) {
+      ctx->write_queue = 0;
+    }
+
+    /* decoded files end up at another size than the response */
+    curl_off_t end = ctx->content_length +
+                     (ctx->status == 206 ? ctx->resume_from : 0);
+    if (ctx->writer && ctx->content_length > 0 && !ctx->decryptor &&
+        !ctx->decompressor) {
+      jirafeau_writer_reserve(ctx->writer, end - ctx->written);
+    }
+  }
+
+  if (ctx->writer) {
+    return jirafeau_writer_write(ctx->writer, data, len);
+  }
+  return fwrite(data, 1, len, ctx->output_file) == len;
+}
+
+static bool write_plain(const char *data, size_t len, void *arg) {
+  struct DownloadContext *ctx = (struct DownloadContext *)arg;
+  bool                    ok  = false;
+
+  if (ctx->write_callback) {
+    ok = ctx->write_callback(data, len, ctx->write_userdata) == 0;
+  } else if (ctx->output_file) {
+    ok = write_file(ctx, data, len);
+  }
+
+  if (ok) {
+    jirafeau_digest_update(ctx->digest, data, len, ctx->written);
+    ctx->written += len;
+  }
+  return ok;
+}
+
+static bool write_decrypted(const char *data, size_t len, void *arg) {
+  struct DownloadContext *ctx = (struct DownloadContext *)arg;
+
+  if (ctx->decompressor) {
+    return jirafeau_decompressor_write(ctx->decompressor, data, len,
+                                       write_plain, ctx);
+  }
+  return write_plain(data, len, ctx);
+}
+
+/**
+ * Passes a part of the file through decryption and decompression, if the
+ * file needs them, to the output.
+ */
+static size_t write_output(struct DownloadContext *ctx, const char *data,
+                           size_t len) {
+  size_t skip = ctx->skip < (curl_off_t)len ? (size_t)ctx->skip : len;
+  size_t take = len - skip;
+  bool   ok;
+
+  ctx->skip -= skip;
+  if (skip == len) {
+    return len;
+  }
+
+  /* a server that ignores the range sends the file beyond its end */
+  if (ctx->range_length &&
+      (curl_off_t)take > ctx->range_length - ctx->received) {
+    take = (size_t)(ctx->range_length - ctx->received);
+  }
+  if (!take) {
     return 0;
   }
 
-  if (!output_file) {
-    state = ERROR;
+  if (ctx->decryptor) {
+    ok = jirafeau_decryptor_write(ctx->decryptor, data + skip, take,
+                                  write_decrypted, ctx);
+  } else {
+    ok = write_decrypted(data + skip, take, ctx);
+  }
+  if (!ok) {
+    return 0;
+  }
+  ctx->received += take;
+  return skip + take == len ? len : 0;
+}
 
-    if (strstr(ptr, "File has been deleted")) {
-      state = SUCCESS;
-      return 0;
-    }
-    return 1;
+/**
+ * Decides what a response is once its headers are complete. Files come with
+ * a Content-Disposition header (or as a 206 range), their body goes
+ * straight to the output. Anything else is a page of Jirafeau whose start
+ * is looked at by classify_page, or the 416 answer to a retry that asked
+ * for the rest of a file it already has.
+ */
+static void classify_headers(struct DownloadContext *ctx) {
+  /* a server that ignores the range sends the part we have again */
+  ctx->skip = ctx->status == 206 ? 0 : ctx->range_offset + ctx->resume_from;
+
+  if (ctx->status == 416 && ctx->resume_from) {
+    /* the part we have may be all there is */
+    curl_off_t end = ctx->range_offset + ctx->resume_from;
+
+    ctx->response = RESPONSE_IGNORED;
+    ctx->state    = !ctx->range_length && ctx->range_total == end ? SUCCESS
+                                                                  : ERROR;
+  } else if (ctx->attachment || ctx->status == 206) {
+    ctx->response = RESPONSE_DATA;
+    ctx->state    = has_output(ctx) ? SUCCESS : ERROR;
   } else {
-    state = SUCCESS;
-    size_t written = fwrite(ptr, size, nmemb, output_file);
-    return written;
+    ctx->response = RESPONSE_PAGE;
+    ctx->state    = ERROR;
   }
 }
 
-static void
-set_output_file_by_content_disposition(const char *disposition_header) {
-  const char *query    = "filename=\"";
-  char *      start    = strstr(disposition_header, query);
-  char *      filename = NULL;
-  char *      output_path;
+/**
+ * Looks for Jirafeau's messages in the start of a page, once per response.
+ * A successful page without a message is treated as the file itself and
+ * written to the output.
+ *
+ * @return false if the transfer should stop
+ */
+static bool classify_page(struct DownloadContext *ctx) {
+  ctx->response = RESPONSE_CLASSIFIED;
+  ctx->state    = ERROR;
+
+  if (!ctx->lookahead) {
+    ctx->lookahead = malloc(PAGE_LOOKAHEAD + 1);
+    if (!ctx->lookahead) {
+      return false;
+    }
+  }
+  ctx->lookahead[ctx->lookahead_size] = '\0';
 
-  if (start) {
-    start += strlen(query);
-    char *end = strstr(start, "\"");
+  if (strstr(ctx->lookahead, "file is not found")) {
+    ctx->state = FILE_NOT_FOUND;
+    return false;
+  }
 
-    if (end) {
-      size_t len = end - start;
+  if (!has_output(ctx)) {
+    ctx->state = strstr(ctx->lookahead, "File has been deleted") ? SUCCESS
+                                                                 : ERROR;
+    return false;
+  }
 
-      filename = (char *)malloc(len + 1);
-      if (filename) {
-        memcpy(filename, start, len);
-        filename[len] = '\0';
-
-        size_t out_dir_len = strlen(output_dir);
-        output_file_path = (char *)malloc(out_dir_len + len + 2);
-        if (output_file_path) {
-          strcpy(output_file_path, output_dir);
-          strcat(output_file_path, "/");
-          strcat(output_file_path, filename);
-
-          output_file = fopen(output_file_path, "wb");
-          if (!output_file) {
-            perror("Failed to open file\n");
-          }
-        }
+  if (ctx->status >= 300) {
+    ctx->state = ctx->status == 404 ? FILE_NOT_FOUND : ERROR;
+    return false;
+  }
 
-        free(filename);
-      }
+  ctx->response = RESPONSE_DATA;
+  ctx->state    = SUCCESS;
+  if (write_output(ctx, ctx->lookahead, ctx->lookahead_size) !=
+      ctx->lookahead_size) {
+    ctx->state = ERROR;
+    return false;
+  }
+  return true;
+}
+
+static size_t handle_request_body(void *ptr, size_t size, size_t nmemb,
+                                  void *userdata) {
+  struct DownloadContext *ctx = (struct DownloadContext *)userdata;
+  size_t                  len = size * nmemb;
+
+  if (ctx->response == RESPONSE_HEADERS) {
+    classify_headers(ctx);
+  }
+
+  if (ctx->response == RESPONSE_DATA) {
+    return write_output(ctx, ptr, len);
+  }
+
+  if (ctx->response == RESPONSE_IGNORED) {
+    return len;
+  }
+
+  if (ctx->response != RESPONSE_PAGE) {
+    return 0;
+  }
+
+  if (!ctx->lookahead) {
+    ctx->lookahead = malloc(PAGE_LOOKAHEAD + 1);
+    if (!ctx->lookahead) {
+      return 0;
     }
   }
+
+  size_t room = PAGE_LOOKAHEAD - ctx->lookahead_size;
+  size_t take = len < room ? len : room;
+
+  memcpy(ctx->lookahead + ctx->lookahead_size, ptr, take);
+  ctx->lookahead_size += take;
+
+  if (take == len) {
+    return len;
+  }
+
+  if (!classify_page(ctx)) {
+    return 0;
+  }
+  return take + write_output(ctx, (char *)ptr + take, len - take);
 }
 
-static size_t handle_request_headers(char *buffer, size_t size, size_t nitems,
-                                     void *userdata) {
-  if (strncmp(buffer, "content-disposition:", 19) == 0) {
-    set_output_file_by_content_disposition(buffer);
+/**
+ * Classifies a page that ended before the lookahead was full.
+ */
+static void finish_response(struct DownloadContext *ctx) {
+  if (ctx->response == RESPONSE_PAGE) {
+    classify_page(ctx);
   }
-  return nitems * size;
 }
 
-static void set_output_dir_or_file(const char *output_path) {
-  if (output_path) {
-    char *      temp_path = strdup(output_path);
-    struct stat st        = { 0 };
+/**
+ * Extracts the filename from a Content-Disposition header, without any
+ * directory part the server might have put in.
+ *
+ * @return The filename (to be freed) or NULL if the header contains none.
+ */
+static char *disposition_filename(const char *disposition_header) {
+  const char *query = "filename=\"";
+  const char *start = strstr(disposition_header, query);
+
+  if (!start) {
+    return NULL;
+  }
+  start += strlen(query);
 
-    if (stat(temp_path, &st) == 0) {
-      if (S_ISDIR(st.st_mode)) {
-        output_dir = strdup(temp_path);
-        int len = strlen(output_dir);
-        if (output_dir[len - 1] == '/') {
-          output_dir[len - 1] = '\0';
-        }
-        free(temp_path);
-        return;
-      }
+  const char *end = strchr(start, '"');
+  if (!end) {
+    return NULL;
+  }
+
+  for (const char *slash = start; slash < end; slash++) {
+    if (*slash == '/') {
+      start = slash + 1;
     }
+  }
+  if (start == end) {
+    return NULL;
+  }
 
-    char *dir = dirname(temp_path);
+  return strndup(start, end - start);
+}
+
+static char *join_path(const char *dir, const char *filename) {
+  return build_url("%s/%s", dir, filename);
+}
+
+static bool has_suffix(const char *filename, const char *suffix) {
+  size_t len        = filename ? strlen(filename) : 0;
+  size_t suffix_len = strlen(suffix);
 
-    if (stat(dir, &st) == -1) {
-      perror("Error: Provided output directory does not exist\n");
-      free(temp_path);
+  return len > suffix_len && strcmp(filename + len - suffix_len, suffix) == 0;
+}
+
+/**
+ * Sets up the decryption and decompression of a file named `filename` as
+ * far as the download should undo them, and strips their suffixes.
+ */
+static void start_decoding(struct DownloadContext *ctx, char *filename) {
+  /* a part of an encoded file can't be decoded on its own */
+  if (ctx->range_offset || ctx->range_length) {
+    return;
+  }
+  if (ctx->passphrase && !ctx->decryptor &&
+      has_suffix(filename, JIRAFEAU_ENCRYPTED_SUFFIX)) {
+    ctx->decryptor = jirafeau_decryptor_new(ctx->passphrase);
+    if (!ctx->decryptor) {
+      fprintf(stderr, "Error: Could not set up the decryption\n");
       return;
     }
+    filename[strlen(filename) - strlen(JIRAFEAU_ENCRYPTED_SUFFIX)] = '\0';
+  }
 
-    if (S_ISDIR(st.st_mode) && strcmp(dir, output_path) == 0) {
-      output_dir = strdup(dir);
-      int len = strlen(output_dir);
-      if (output_dir[len - 1] == '/') {
-        output_dir[len - 1] = '\0';
-      }
-    } else {
-      output_file_path = strdup(output_path);
-      output_file      = fopen(output_path, "wb");
-
-      if (!output_file) {
-        perror("Error: Could not open output file\n");
-        free(temp_path);
-        return;
-      }
+  if (ctx->decompress && !ctx->decompressor &&
+      has_suffix(filename, JIRAFEAU_COMPRESSED_SUFFIX)) {
+    ctx->decompressor = jirafeau_decompressor_new();
+    if (!ctx->decompressor) {
+      fprintf(stderr, "Error: Could not set up the decompression\n");
+      return;
     }
+    filename[strlen(filename) - strlen(JIRAFEAU_COMPRESSED_SUFFIX)] = '\0';
+  }
+}
 
-    free(temp_path);
+/**
+ * Opens the output file under its ".part" name, `output_file_path` is only
+ * taken once the file is complete.
+ *
+ * @param resume Continue a part an earlier download left, what it holds
+ * counts as received
+ */
+static void open_part(struct DownloadContext *ctx, bool resume) {
+  struct stat st;
+
+  ctx->part_path = build_url("%s.part", ctx->output_file_path);
+  if (!ctx->part_path) {
+    return;
+  }
+
+  if (resume && stat(ctx->part_path, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size > 0) {
+    ctx->output_file = fopen(ctx->part_path, "a+b");
+    if (ctx->output_file) {
+      ctx->received = st.st_size;
+      ctx->written  = st.st_size;
+    }
+    /* the part is read once more for the hash, the rest is hashed inline */
+    if (ctx->output_file && ctx->digest &&
+        !jirafeau_digest_read(ctx->digest, fileno(ctx->output_file),
+                              st.st_size)) {
+      jirafeau_digest_free(ctx->digest);
+      ctx->digest = NULL;
+    }
   } else {
-    output_dir = strdup(".");
+    ctx->output_file = fopen(ctx->part_path, "wb");
   }
 }
 
-void jirafeau_set_host(const char *new_host_url) {
-  if (new_host_url) {
-    host_url = strdup(new_host_url);
+/**
+ * Closes the output file and moves a complete one to its name. The part of
+ * an incomplete file is kept for a later download to continue, unless it
+ * is empty or holds decoded data, which can't be continued.
+ *
+ * @return true if the complete file is in place
+ */
+static bool close_output(struct DownloadContext *ctx, bool complete) {
+  bool closed = !ctx->writer || jirafeau_writer_flush(ctx->writer);
+
+  jirafeau_writer_free(ctx->writer);
+  closed           = fclose(ctx->output_file) == 0 && closed;
+  ctx->writer      = NULL;
+  ctx->output_file = NULL;
+  if (complete && closed &&
+      rename(ctx->part_path, ctx->output_file_path) == 0) {
+    return true;
+  }
+
+  if (complete || !closed || !ctx->received || ctx->decryptor ||
+      ctx->decompressor) {
+    unlink(ctx->part_path);
   }
+  return false;
 }
 
-char *jirafeau_get_host() {
-  return host_url;
+/**
+ * Throws away what a download received so far, to start over.
+ *
+ * @return false if the data has been passed on already
+ */
+static bool restart_output(struct DownloadContext *ctx) {
+  if (ctx->write_callback || ctx->decryptor || ctx->decompressor) {
+    return false;
+  }
+  if (ctx->writer) {
+    bool flushed = jirafeau_writer_flush(ctx->writer);
+
+    /* a new writer starts at the front of the file */
+    jirafeau_writer_free(ctx->writer);
+    ctx->writer = NULL;
+    if (!flushed) {
+      return false;
+    }
+  }
+  if (ctx->output_file && (fflush(ctx->output_file) != 0 ||
+                           ftruncate(fileno(ctx->output_file), 0) != 0)) {
+    return false;
+  }
+  if (ctx->output_file) {
+    rewind(ctx->output_file);
+  }
+  ctx->received = 0;
+  ctx->written  = 0;
+
+  jirafeau_digest_free(ctx->digest);
+  ctx->digest = jirafeau_digest_new();
+  return true;
 }
 
-UploadResultT jirafeau_upload(const char *file_path, const char *time,
-                              const char *upload_password,
-                              int one_time_download, const char *key,
-                              const char *filename) {
-  struct UploadResult result = { 0 };
+static void set_output_file_by_filename(struct DownloadContext *ctx,
+                                        const char *            filename) {
+  if (!ctx->output_file) {
+    ctx->output_file_path = join_path(ctx->output_dir, filename);
+    if (ctx->output_file_path) {
+      /* the name is only known now, the request asked for the whole file */
+      open_part(ctx, false);
+      if (!ctx->output_file) {
+        perror("Failed to open file\n");
+      }
+    }
+  }
+}
 
-  if (!host_url) {
-    perror("`host_url` has not been defined previously to calling "
-           "jirafeau_upload\n");
-    result.state = ERROR;
-    return result;
+static size_t handle_request_headers(char *buffer, size_t size, size_t nitems,
+                                     void *userdata) {
+  struct DownloadContext *ctx = (struct DownloadContext *)userdata;
+  size_t                  len = size * nitems;
+
+  if (len > 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+    /* a new response starts, e.g. after a 100 Continue */
+    const char *code = memchr(buffer, ' ', len);
+    ctx->status         = code ? strtol(code + 1, NULL, 10) : 0;
+    ctx->attachment     = false;
+    ctx->response       = RESPONSE_HEADERS;
+    ctx->range_total    = -1;
+    ctx->content_length = -1;
+  } else if (strncasecmp(buffer, "content-length:", 15) == 0) {
+    ctx->content_length = strtoll(buffer + 15, NULL, 10);
+  } else if (strncasecmp(buffer, "content-range:", 14) == 0) {
+    /* a 416 answer tells the size of the file after the slash */
+    const char *total = memchr(buffer, '/', len);
+    if (total && total[1] != '*') {
+      ctx->range_total = strtoll(total + 1, NULL, 10);
+    }
+  } else if (strncasecmp(buffer, "content-disposition:", 20) == 0) {
+    ctx->attachment = true;
+    if (ctx->output_dir || ctx->decompress || ctx->passphrase) {
+      char *header   = strndup(buffer, len);
+      char *filename = header ? disposition_filename(header) : NULL;
+
+      if (filename) {
+        start_decoding(ctx, filename);
+        if (ctx->output_dir) {
+          set_output_file_by_filename(ctx, filename);
+        }
+      }
+      free(filename);
+      free(header);
+    }
+  } else if (len <= 2 && ctx->status >= 200) {
+    classify_headers(ctx);
   }
+  return len;
+}
 
-  CURL *         curl;
-  CURLcode       res;
-  curl_mime *    mime;
-  curl_mimepart *part;
-  const char *   endpoint = "/script.php";
+/**
+ * Checks whether the downloaded file should be put into a directory, which is
+ * the case when no output path is given or it is an existing directory.
+ *
+ * @return The directory without trailing slash (to be freed), NULL if
+ * `output_path` names a file.
+ */
+static char *output_directory(const char *output_path) {
+  struct stat st = { 0 };
+
+  if (!output_path) {
+    return strdup(".");
+  }
 
-  struct MemoryStruct chunk;
-  chunk.memory = malloc(1); /* will be grown as needed by the realloc above */
-  chunk.size   = 0;         /* no data at this point */
+  if (stat(output_path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    char * dir = strdup(output_path);
+    size_t len = strlen(dir);
+    if (len > 1 && dir[len - 1] == '/') {
+      dir[len - 1] = '\0';
+    }
+    return dir;
+  }
 
-  curl_global_init(CURL_GLOBAL_ALL);
-  curl = curl_easy_init();
-  if (curl) {
-    char *url = malloc(strlen(host_url) + strlen(endpoint) + 1);
-    snprintf(url, strlen(host_url) + strlen(endpoint) + 1, "%s%s", host_url,
-             endpoint);
+  return NULL;
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    /* send all data to this function  */
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_request_body_to_memory);
+static void set_output_dir_or_file(struct DownloadContext *ctx,
+                                   const char *output_path) {
+  ctx->output_dir = output_directory(output_path);
+  if (ctx->output_dir) {
+    return;
+  }
 
-    /* we pass our 'chunk' struct to the callback function */
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+  char *      temp_path = strdup(output_path);
+  struct stat st        = { 0 };
 
-    mime = curl_mime_init(curl);
+  if (stat(dirname(temp_path), &st) == -1) {
+    perror("Error: Provided output directory does not exist\n");
+    free(temp_path);
+    return;
+  }
+  free(temp_path);
 
-    part = curl_mime_addpart(mime);
-    curl_mime_name(part, "file");
-    curl_mime_filedata(part, file_path);
+  ctx->output_file_path = strdup(output_path);
+  if (ctx->output_file_path) {
+    /* the part of a decoded file can't be told apart from the raw one */
+    open_part(ctx, !ctx->decompress && !ctx->passphrase);
+  }
 
-    if (filename) {
-      curl_mime_filename(part, filename);
-    }
+  if (!ctx->output_file) {
+    perror("Error: Could not open output file\n");
+  }
+}
 
-    if (time) {
-      part = curl_mime_addpart(mime);
-      curl_mime_name(part, "time");
-      curl_mime_data(part, time, CURL_ZERO_TERMINATED);
-    }
+/**
+ * Hands out the client's easy handle with all per-request options cleared.
+ * `curl_easy_reset` keeps the connection, DNS and TLS session caches alive,
+ * so consecutive requests to the same host reuse the open connection.
+ */
+static CURL *client_handle(JirafeauClientT *client) {
+  curl_easy_reset(client->curl);
+  jirafeau_set_common_options(client->curl);
+  if (client->max_speed) {
+    curl_easy_setopt(client->curl, CURLOPT_MAX_SEND_SPEED_LARGE,
+                     client->max_speed);
+    curl_easy_setopt(client->curl, CURLOPT_MAX_RECV_SPEED_LARGE,
+                     client->max_speed);
+  }
+  return client->curl;
+}
 
-    if (upload_password) {
-      part = curl_mime_addpart(mime);
-      curl_mime_name(part, "upload_password");
-      curl_mime_data(part, upload_password, CURL_ZERO_TERMINATED);
-    }
+int jirafeau_client_connect(JirafeauClientT *client) {
+  CURL *curl = client_handle(client);
 
-    if (one_time_download) {
-      part = curl_mime_addpart(mime);
-      curl_mime_name(part, "one_time_download");
-      curl_mime_data(part, one_time_download ? "1" : "0", CURL_ZERO_TERMINATED);
-    }
+  curl_easy_setopt(curl, CURLOPT_URL, client->host_url);
+  curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+  return curl_easy_perform(curl) == CURLE_OK ? 0 : -1;
+}
 
-    if (key) {
-      part = curl_mime_addpart(mime);
-      curl_mime_name(part, "key");
-      curl_mime_data(part, key, CURL_ZERO_TERMINATED);
-    }
+static void lock_share(CURL *curl, curl_lock_data data,
+                       curl_lock_access access, void *userptr) {
+  pthread_mutex_lock(&share_locks[data]);
+}
 
-    curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
+static void unlock_share(CURL *curl, curl_lock_data data, void *userptr) {
+  pthread_mutex_unlock(&share_locks[data]);
+}
 
-    res = curl_easy_perform(curl);
+static void init_curl(void) {
+  curl_global_init(CURL_GLOBAL_ALL);
 
-    if (res != CURLE_OK) {
-      result.state = ERROR;
-    } else {
-      char *line = strtok(chunk.memory, "\n");
-      if (!line) {
-        result.state = ERROR;
-        return result;
-      }
-      result.file_id = strdup(line);
-      line           = strtok(NULL, "\n");
-      if (!line) {
-        fprintf(stderr, "%s\n", result.file_id);
-        result.state = ERROR;
-        return result;
-      }
-      result.delete_key = strdup(line);
-      line = strtok(NULL, "\n");
-      if (line) {
-        result.crypt_key = strdup(line);
-      }
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_init(&share_locks[i], NULL);
+  }
 
-      result.state = SUCCESS;
-    }
+  /*
+   * libcurl can't share a connection pool between threads that use it at the
+   * same time, connections stay with their client or multi handle.
+   */
+  share = curl_share_init();
+  if (share) {
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_share);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+}
+
+/*
+ * curl_global_init is not thread-safe before libcurl 7.84, so it is done
+ * exactly once and never undone. The matching curl_global_cleanup happens
+ * implicitly at process exit, as does the cleanup of the share.
+ */
+void jirafeau_global_init(void) {
+  pthread_once(&curl_initialized, init_curl);
+}
 
-    curl_easy_cleanup(curl);
-    curl_mime_free(mime);
+void jirafeau_set_common_options(CURL *curl) {
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  /* signals would hit random threads of the application */
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  /* a later handle to the same host skips the DNS lookup and TLS handshake */
+  if (share) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
   }
-  curl_global_cleanup();
-  return result;
 }
 
-DownloadResultT jirafeau_download(const char *file_id, const char *output_path,
-                                  const char *file_key, const char *crypt_key) {
-  struct DownloadResult result = { 0 };
+JirafeauClientT *jirafeau_client_new(const char *host_url) {
+  if (!host_url) {
+    return NULL;
+  }
 
-  set_output_dir_or_file(output_path);
+  JirafeauClientT *client = calloc(1, sizeof(JirafeauClientT));
+  if (!client) {
+    return NULL;
+  }
 
-  if (!output_dir && !output_file_path) {
-    result.state = ERROR;
-    return result;
+  jirafeau_global_init();
+
+  client->host_url    = strdup(host_url);
+  client->curl        = curl_easy_init();
+  client->write_queue = JIRAFEAU_DEFAULT_WRITE_QUEUE;
+  if (!client->host_url || !client->curl) {
+    jirafeau_client_free(client);
+    return NULL;
   }
 
-  char *endpoint_template = "%s/f.php?h=%s&d=1";
-  int   len = strlen(host_url) + strlen(endpoint_template) - 4 + strlen(file_id) +
-              +1; // -4 due to 2 %s in template and + 1 for \0
-  char *url = malloc(len);
-  snprintf(url, len, endpoint_template, host_url, file_id);
+  return client;
+}
 
-  CURL *   curl;
-  CURLcode res;
+void jirafeau_client_free(JirafeauClientT *client) {
+  if (!client) {
+    return;
+  }
 
-  curl_global_init(CURL_GLOBAL_ALL);
-  curl = curl_easy_init();
-  if (curl) {
-    if (crypt_key) {
-      strcat(url, "&k=");
-      strcat(url, crypt_key);
-    }
+  if (client->curl) {
+    curl_easy_cleanup(client->curl);
+  }
+  if (client->multi) {
+    curl_multi_cleanup(client->multi);
+  }
+  free(client->host_url);
+  free(client->dedup_index);
+  free(client->cache_dir);
+  free(client->journal_dir);
+  if (client->passphrase) {
+    OPENSSL_cleanse(client->passphrase, strlen(client->passphrase));
+    free(client->passphrase);
+  }
+  free(client);
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, url);
+const char *jirafeau_client_get_host(const JirafeauClientT *client) {
+  return client->host_url;
+}
 
-    if (!output_file) {
-      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, handle_request_headers);
-    }
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, handle_request_body);
+void jirafeau_client_set_dedup_index(JirafeauClientT *client,
+                                     const char *     index_path) {
+  free(client->dedup_index);
+  client->dedup_index = index_path ? strdup(index_path) : NULL;
+}
 
-    if (file_key) {
-      char post_fields[256];
-      snprintf(post_fields, sizeof(post_fields), "key=%s", file_key);
-      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
-    }
+void jirafeau_client_set_download_cache(JirafeauClientT *client,
+                                        const char *     cache_dir,
+                                        curl_off_t       max_size) {
+  free(client->cache_dir);
+  client->cache_dir  = cache_dir ? strdup(cache_dir) : NULL;
+  client->cache_size = max_size > 0 ? max_size : JIRAFEAU_DEFAULT_CACHE_SIZE;
+}
 
-    res = curl_easy_perform(curl);
+int jirafeau_client_set_compression(JirafeauClientT *client, int level,
+                                    int workers) {
+  if (level && !jirafeau_compression_supported()) {
+    return -1;
+  }
+  client->compression_level   = level;
+  client->compression_workers = workers > 0 ? workers : 0;
+  return 0;
+}
 
-    if (state == SUCCESS && res != CURLE_OK) {
-      state = ERROR;
-    }
+int jirafeau_client_set_decompression(JirafeauClientT *client, int enabled) {
+  if (enabled && !jirafeau_compression_supported()) {
+    return -1;
+  }
+  client->decompress = enabled;
+  return 0;
+}
 
-    result.state = state;
-    if (result.state == SUCCESS) {
-      result.download_path = strdup(output_file_path);
-      fclose(output_file);
-      free(output_file_path);
-    } else if (output_file) {
-      fclose(output_file);
-      unlink(output_file_path);
-    }
+static void replace_passphrase(char **passphrase, const char *new_passphrase) {
+  if (*passphrase) {
+    OPENSSL_cleanse(*passphrase, strlen(*passphrase));
+    free(*passphrase);
+  }
+  *passphrase = new_passphrase ? strdup(new_passphrase) : NULL;
+}
+
+void jirafeau_client_set_encryption(JirafeauClientT *client,
+                                    const char *     passphrase,
+                                    int              workers) {
+  replace_passphrase(&client->passphrase, passphrase);
+  client->encryption_workers = workers > 0 ? workers : 0;
+}
+
+void jirafeau_client_set_max_speed(JirafeauClientT *client,
+                                   curl_off_t       bytes_per_second) {
+  client->max_speed = bytes_per_second > 0 ? bytes_per_second : 0;
+}
+
+void jirafeau_client_set_download_io(JirafeauClientT *client,
+                                     long receive_buffer, int write_queue,
+                                     int direct) {
+  client->receive_buffer = receive_buffer > 0 ? receive_buffer : 0;
+  client->write_queue    = write_queue > 0 ? write_queue : 0;
+  client->direct_io      = direct;
+}
+
+void jirafeau_client_set_retry(JirafeauClientT *client, int retries,
+                               long delay_ms) {
+  client->retries     = retries > 0 ? retries : 0;
+  client->retry_delay = delay_ms > 0 ? delay_ms : 0;
+}
+
+void jirafeau_client_set_upload_journal(JirafeauClientT *client,
+                                        const char *     journal_dir) {
+  free(client->journal_dir);
+  client->journal_dir = journal_dir ? strdup(journal_dir) : NULL;
+}
 
-    curl_easy_cleanup(curl);
+void jirafeau_set_host(const char *new_host_url) {
+  if (new_host_url) {
+    pthread_mutex_lock(&host_url_lock);
+    free(host_url);
+    host_url = strdup(new_host_url);
+    pthread_mutex_unlock(&host_url_lock);
   }
+}
 
-  curl_global_cleanup();
-  return result;
+char *jirafeau_get_host() {
+  char *copy;
+
+  pthread_mutex_lock(&host_url_lock);
+  copy = host_url ? strdup(host_url) : NULL;
+  pthread_mutex_unlock(&host_url_lock);
+  return copy;
 }
 
-DeleteResultT jirafeau_delete(const char *file_id, const char *delete_key) {
-  struct DeleteResult result = { 0 };
-  CURL *         curl;
-  CURLcode       res;
-  curl_mime *    mime;
-  curl_mimepart *part;
+void jirafeau_set_download_cache(const char *cache_dir, curl_off_t max_size) {
+  pthread_mutex_lock(&host_url_lock);
+  free(download_cache_dir);
+  download_cache_dir  = cache_dir ? strdup(cache_dir) : NULL;
+  download_cache_size = max_size;
+  pthread_mutex_unlock(&host_url_lock);
+}
 
-  char *endpoint_template = "%s/f.php?h=%s&d=%s";
-  int   len = strlen(host_url) + strlen(endpoint_template) - 6 + strlen(file_id) +
-              strlen(delete_key) + 1; // -6 due to 3 %s in template and + 1 for \0
-  char *url = malloc(len);
-  snprintf(url, len, endpoint_template, host_url, file_id, delete_key);
+int jirafeau_set_compression(int level, int workers, int decompress) {
+  if ((level || decompress) && !jirafeau_compression_supported()) {
+    return -1;
+  }
+  pthread_mutex_lock(&host_url_lock);
+  compression_level    = level;
+  compression_workers  = workers > 0 ? workers : 0;
+  decompress_downloads = decompress;
+  pthread_mutex_unlock(&host_url_lock);
+  return 0;
+}
 
-  curl_global_init(CURL_GLOBAL_ALL);
-  curl = curl_easy_init();
+void jirafeau_set_encryption(const char *passphrase, int workers) {
+  pthread_mutex_lock(&host_url_lock);
+  replace_passphrase(&encryption_passphrase, passphrase);
+  encryption_workers = workers;
+  pthread_mutex_unlock(&host_url_lock);
+}
 
-  if (curl) {
-    curl_easy_setopt(curl, CURLOPT_URL, url);
+void jirafeau_set_retry(int retries, long delay_ms) {
+  pthread_mutex_lock(&host_url_lock);
+  retry_count    = retries;
+  retry_delay_ms = delay_ms;
+  pthread_mutex_unlock(&host_url_lock);
+}
 
-    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, handle_request_headers);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, handle_request_body);
+static void add_mime_field(curl_mime *mime, const char *name,
+                           const char *value) {
+  curl_mimepart *part = curl_mime_addpart(mime);
 
-    mime = curl_mime_init(curl);
+  curl_mime_name(part, name);
+  curl_mime_data(part, value, CURL_ZERO_TERMINATED);
+}
+
+static void add_upload_options(curl_mime *mime, const char *time,
+                               const char *upload_password,
+                               int one_time_download, const char *key) {
+  if (time) {
+    add_mime_field(mime, "time", time);
+  }
 
-    part = curl_mime_addpart(mime);
-    curl_mime_name(part, "do_delete");
-    curl_mime_data(part, "1", CURL_ZERO_TERMINATED);
+  if (upload_password) {
+    add_mime_field(mime, "upload_password", upload_password);
+  }
 
-    curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
+  if (one_time_download) {
+    add_mime_field(mime, "one_time_download", "1");
+  }
 
-    res = curl_easy_perform(curl);
-    curl_easy_cleanup(curl);
+  if (key) {
+    add_mime_field(mime, "key", key);
+  }
+}
 
-    result.state = state;
+/**
+ * Parses the "FILE_ID\nDELETE_KEY[\nCRYPT_KEY]" answer Jirafeau sends after
+ * a finished upload.
+ */
+static void parse_upload_response(char *body, UploadResultT *result) {
+  char *save;
+  char *line = strtok_r(body, "\n", &save);
+
+  if (!line) {
+    result->state = ERROR;
+    return;
+  }
+  result->file_id = strdup(line);
+  line            = strtok_r(NULL, "\n", &save);
+  if (!line) {
+    fprintf(stderr, "%s\n", result->file_id);
+    result->state = ERROR;
+    return;
+  }
+  result->delete_key = strdup(line);
+  line = strtok_r(NULL, "\n", &save);
+  if (line) {
+    result->crypt_key = strdup(line);
   }
 
-  curl_global_cleanup();
+  result->state = SUCCESS;
+}
+
+static char *dup_or_null(const char *value) {
+  return value ? strdup(value) : NULL;
+}
+
+void jirafeau_transfer_init_upload(struct JirafeauTransfer *transfer,
+                                   const char *file_path, const char *time,
+                                   const char *upload_password,
+                                   int one_time_download, const char *key,
+                                   const char *filename) {
+  transfer->operation         = UPLOAD;
+  transfer->file_path         = dup_or_null(file_path);
+  transfer->time              = dup_or_null(time);
+  transfer->upload_password   = dup_or_null(upload_password);
+  transfer->one_time_download = one_time_download;
+  transfer->key               = dup_or_null(key);
+  transfer->filename          = dup_or_null(filename);
+}
+
+void jirafeau_transfer_init_download(struct JirafeauTransfer *transfer,
+                                     const char *file_id,
+                                     const char *output_path,
+                                     const char *file_key,
+                                     const char *crypt_key) {
+  transfer->operation   = DOWNLOAD;
+  transfer->file_id     = dup_or_null(file_id);
+  transfer->output_path = dup_or_null(output_path);
+  transfer->file_key    = dup_or_null(file_key);
+  transfer->crypt_key   = dup_or_null(crypt_key);
+}
+
+void jirafeau_transfer_init_delete(struct JirafeauTransfer *transfer,
+                                   const char *file_id,
+                                   const char *delete_key) {
+  transfer->operation  = DELETE;
+  transfer->file_id    = dup_or_null(file_id);
+  transfer->delete_key = dup_or_null(delete_key);
+}
+
+/**
+ * Hashes data of the upload as it is read, `source_position` is where it
+ * starts.
+ */
+static size_t digest_source(struct JirafeauTransfer *transfer,
+                            const char *buffer, size_t n) {
+  jirafeau_digest_update(transfer->digest, buffer, n,
+                         transfer->source_position);
+  transfer->source_position += n;
+  return n;
+}
+
+static size_t read_from_callback(char *buffer, size_t size, size_t nitems,
+                                 void *arg) {
+  struct JirafeauTransfer *transfer = (struct JirafeauTransfer *)arg;
+  size_t n = transfer->read_callback(buffer, size * nitems,
+                                     transfer->read_userdata);
+
+  if (n == CURL_READFUNC_ABORT || n > size * nitems) {
+    return n;
+  }
+  return digest_source(transfer, buffer, n);
+}
+
+static size_t read_from_buffer(char *buffer, size_t size, size_t nitems,
+                               void *arg) {
+  struct JirafeauTransfer *transfer = (struct JirafeauTransfer *)arg;
+  curl_off_t left = transfer->buffer_size - transfer->buffer_position;
+  size_t     len  = size * nitems;
+
+  if ((curl_off_t)len > left) {
+    len = (size_t)left;
+  }
+  memcpy(buffer, transfer->buffer + transfer->buffer_position, len);
+  transfer->source_position  = transfer->buffer_position;
+  transfer->buffer_position += len;
+  return digest_source(transfer, buffer, len);
+}
+
+static size_t read_from_file(char *buffer, size_t size, size_t nitems,
+                             void *arg) {
+  struct JirafeauTransfer *transfer = (struct JirafeauTransfer *)arg;
+  size_t n = fread(buffer, 1, size * nitems, transfer->source_file);
+
+  if (n == 0 && ferror(transfer->source_file)) {
+    return CURL_READFUNC_ABORT;
+  }
+  return digest_source(transfer, buffer, n);
+}
+
+static int seek_file(void *arg, curl_off_t offset, int origin) {
+  struct JirafeauTransfer *transfer = (struct JirafeauTransfer *)arg;
+
+  if (origin != SEEK_SET || fseeko(transfer->source_file, offset, SEEK_SET)) {
+    return CURL_SEEKFUNC_CANTSEEK;
+  }
+  transfer->source_position = offset;
+  return CURL_SEEKFUNC_OK;
+}
+
+/**
+ * Opens the file of an upload that is not read from memory or a callback.
+ */
+static bool open_source(struct JirafeauTransfer *transfer) {
+  if (!transfer->buffer && !transfer->read_callback) {
+    transfer->source_file = fopen(transfer->file_path, "rb");
+    if (!transfer->source_file) {
+      perror("Error: Could not open file to upload\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+static int seek_buffer(void *arg, curl_off_t offset, int origin) {
+  struct JirafeauTransfer *transfer = (struct JirafeauTransfer *)arg;
+
+  if (origin != SEEK_SET || offset > transfer->buffer_size) {
+    return CURL_SEEKFUNC_CANTSEEK;
+  }
+  transfer->buffer_position = offset;
+  return CURL_SEEKFUNC_OK;
+}
+
+static size_t read_source(char *buffer, size_t size, void *arg) {
+  struct JirafeauTransfer *transfer = (struct JirafeauTransfer *)arg;
+
+  if (transfer->buffer) {
+    return read_from_buffer(buffer, 1, size, transfer);
+  }
+  if (transfer->read_callback) {
+    return read_from_callback(buffer, 1, size, transfer);
+  }
+  return read_from_file(buffer, 1, size, transfer);
+}
+
+static size_t read_compressed(char *buffer, size_t size, void *arg) {
+  struct JirafeauTransfer *transfer = (struct JirafeauTransfer *)arg;
+
+  if (!transfer->compressor) {
+    return read_source(buffer, size, arg);
+  }
+  return jirafeau_compressor_read(transfer->compressor, buffer, size,
+                                  read_source, transfer);
+}
+
+/**
+ * Reads the upload through compression and encryption, as far as they are
+ * turned on.
+ */
+static size_t read_encoded(char *buffer, size_t size, size_t nitems,
+                           void *arg) {
+  struct JirafeauTransfer *transfer = (struct JirafeauTransfer *)arg;
+
+  if (!transfer->encryptor) {
+    return read_compressed(buffer, size * nitems, arg);
+  }
+  return jirafeau_encryptor_read(transfer->encryptor, buffer, size * nitems,
+                                 read_compressed, transfer);
+}
+
+/**
+ * Sets up the compression and encryption of an upload and marks its
+ * filename with their suffixes.
+ */
+static bool prepare_encoding(struct JirafeauTransfer *transfer) {
+  const char *name     = transfer->filename;
+  char *      name_buf = NULL;
+
+  if (!open_source(transfer)) {
+    return false;
+  }
+
+  if (transfer->compression_level) {
+    transfer->compressor = jirafeau_compressor_new(
+      transfer->compression_level, transfer->compression_workers);
+    if (!transfer->compressor) {
+      fprintf(stderr, "Error: Could not set up the compression\n");
+      return false;
+    }
+  }
+
+  if (transfer->passphrase) {
+    transfer->encryptor = jirafeau_encryptor_new(
+      transfer->passphrase, transfer->encryption_workers);
+    if (!transfer->encryptor) {
+      fprintf(stderr, "Error: Could not set up the encryption\n");
+      return false;
+    }
+  }
+
+  if (!name) {
+    if (transfer->buffer) {
+      name = JIRAFEAU_BUFFER_FILENAME;
+    } else if (transfer->read_callback) {
+      name = JIRAFEAU_STREAM_FILENAME;
+    } else {
+      name_buf = strdup(transfer->file_path);
+      name     = basename(name_buf);
+    }
+  }
+
+  char *encoded = build_url(
+    "%s%s%s", name, transfer->compressor ? JIRAFEAU_COMPRESSED_SUFFIX : "",
+    transfer->encryptor ? JIRAFEAU_ENCRYPTED_SUFFIX : "");
+  free(name_buf);
+  free(transfer->encoded_filename);
+  transfer->encoded_filename = encoded;
+  return encoded != NULL;
+}
+
+static bool prepare_upload(struct JirafeauTransfer *transfer, CURL *curl,
+                           const char *host_url) {
+  curl_mimepart *part;
+  struct stat    st;
+
+  /* a retry reads the content again, the digest skips what it has */
+  if (!transfer->digest && !transfer->sha256[0]) {
+    transfer->digest = jirafeau_digest_new();
+  }
+
+  if ((transfer->compression_level || transfer->passphrase) &&
+      !prepare_encoding(transfer)) {
+    return false;
+  }
+
+  transfer->url = build_url("%s/script.php", host_url);
+
+  curl_easy_setopt(curl, CURLOPT_URL, transfer->url);
+  /* send all data to this function  */
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_request_body_to_memory);
+
+  /* we pass our 'chunk' struct to the callback function */
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&transfer->body);
+
+  transfer->mime = curl_mime_init(curl);
+
+  part = curl_mime_addpart(transfer->mime);
+  curl_mime_name(part, "file");
+  if (transfer->compressor || transfer->encryptor) {
+    /* the encoded size is only known at the end */
+    curl_mime_data_cb(part, -1, read_encoded, NULL, NULL, transfer);
+  } else if (transfer->buffer) {
+    /* read straight from the caller's memory, curl_mime_data would copy */
+    curl_mime_data_cb(part, transfer->buffer_size, read_from_buffer,
+                      seek_buffer, NULL, transfer);
+    curl_mime_filename(part, JIRAFEAU_BUFFER_FILENAME);
+  } else if (transfer->read_callback) {
+    /* unknown size, curl sends the body with chunked transfer encoding */
+    curl_mime_data_cb(part, -1, read_from_callback, NULL, NULL, transfer);
+    curl_mime_filename(part, JIRAFEAU_STREAM_FILENAME);
+  } else {
+    /* read by us rather than curl_mime_filedata, to hash it on the way */
+    if (!open_source(transfer) ||
+        fstat(fileno(transfer->source_file), &st) == -1) {
+      return false;
+    }
+    char *name_buf = strdup(transfer->file_path);
+    curl_mime_data_cb(part, st.st_size, read_from_file, seek_file, NULL,
+                      transfer);
+    curl_mime_filename(part, name_buf ? basename(name_buf) : NULL);
+    free(name_buf);
+  }
+
+  if (transfer->encoded_filename) {
+    curl_mime_filename(part, transfer->encoded_filename);
+  } else if (transfer->filename) {
+    curl_mime_filename(part, transfer->filename);
+  }
+
+  add_upload_options(transfer->mime, transfer->time,
+                     transfer->upload_password, transfer->one_time_download,
+                     transfer->key);
+
+  curl_easy_setopt(curl, CURLOPT_MIMEPOST, transfer->mime);
+  return true;
+}
+
+static bool prepare_download(struct JirafeauTransfer *transfer, CURL *curl,
+                             const char *host_url) {
+  struct DownloadContext *ctx = &transfer->download;
+
+  if (!ctx->digest && !ctx->written) {
+    ctx->digest = jirafeau_digest_new();
+  }
+
+  /* a retry keeps writing to the output of the earlier attempts */
+  if (!ctx->write_callback && !ctx->output_dir && !ctx->output_file) {
+    set_output_dir_or_file(ctx, transfer->output_path);
+
+    if (!ctx->output_dir && !ctx->output_file) {
+      return false;
+    }
+  }
+
+  if (transfer->crypt_key) {
+    transfer->url = build_url("%s/f.php?h=%s&d=1&k=%s", host_url,
+                              transfer->file_id, transfer->crypt_key);
+  } else {
+    transfer->url = build_url("%s/f.php?h=%s&d=1", host_url,
+                              transfer->file_id);
+  }
+
+  curl_easy_setopt(curl, CURLOPT_URL, transfer->url);
+
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, handle_request_headers);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)ctx);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, handle_request_body);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)ctx);
+  if (ctx->receive_buffer) {
+    curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, ctx->receive_buffer);
+  }
+
+  if (transfer->file_key) {
+    transfer->post_fields = build_url("key=%s", transfer->file_key);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, transfer->post_fields);
+  }
+
+  /* curl turns CURLOPT_RANGE into a Content-Range for POSTs */
+  ctx->resume_from = ctx->received;
+  if (ctx->received || ctx->range_offset || ctx->range_length) {
+    char       range[96];
+    curl_off_t start = ctx->range_offset + ctx->received;
+
+    if (ctx->range_length) {
+      snprintf(range, sizeof(range),
+               "Range: bytes=%" CURL_FORMAT_CURL_OFF_T
+               "-%" CURL_FORMAT_CURL_OFF_T,
+               start, ctx->range_offset + ctx->range_length - 1);
+    } else {
+      snprintf(range, sizeof(range),
+               "Range: bytes=%" CURL_FORMAT_CURL_OFF_T "-", start);
+    }
+    transfer->headers = curl_slist_append(NULL, range);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, transfer->headers);
+  }
+
+  return true;
+}
+
+static void prepare_delete(struct JirafeauTransfer *transfer, CURL *curl,
+                           const char *host_url) {
+  curl_mimepart *part;
+
+  transfer->url = build_url("%s/f.php?h=%s&d=%s", host_url,
+                            transfer->file_id, transfer->delete_key);
+
+  curl_easy_setopt(curl, CURLOPT_URL, transfer->url);
+
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, handle_request_headers);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)&transfer->download);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, handle_request_body);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&transfer->download);
+
+  transfer->mime = curl_mime_init(curl);
+
+  part = curl_mime_addpart(transfer->mime);
+  curl_mime_name(part, "do_delete");
+  curl_mime_data(part, "1", CURL_ZERO_TERMINATED);
+
+  curl_easy_setopt(curl, CURLOPT_MIMEPOST, transfer->mime);
+}
+
+bool jirafeau_transfer_prepare(struct JirafeauTransfer *transfer, CURL *curl,
+                               const char *host_url) {
+  transfer->curl           = curl;
+  transfer->download.state = ERROR;
+
+  switch (transfer->operation) {
+  case UPLOAD:
+    return prepare_upload(transfer, curl, host_url);
+
+  case DOWNLOAD:
+    return prepare_download(transfer, curl, host_url);
+
+  case DELETE:
+    prepare_delete(transfer, curl, host_url);
+    return true;
+  }
+  return false;
+}
+
+static curl_off_t info_off_t(CURL *curl, CURLINFO info) {
+  curl_off_t value = 0;
+
+  curl_easy_getinfo(curl, info, &value);
+  return value;
+}
+
+static void set_speeds(TransferMetricsT *metrics) {
+  if (metrics->total > 0) {
+    metrics->upload_speed   = (curl_off_t)((double)metrics->bytes_uploaded *
+                                           1000000 / metrics->total);
+    metrics->download_speed = (curl_off_t)((double)metrics->bytes_downloaded *
+                                           1000000 / metrics->total);
+  }
+}
+
+/**
+ * Adds the timings and sizes of the request `curl` just did to `metrics`.
+ */
+static void add_metrics(TransferMetricsT *metrics, CURL *curl) {
+  long connects = 0;
+
+  metrics->namelookup       += info_off_t(curl, CURLINFO_NAMELOOKUP_TIME_T);
+  metrics->connect          += info_off_t(curl, CURLINFO_CONNECT_TIME_T);
+  metrics->appconnect       += info_off_t(curl, CURLINFO_APPCONNECT_TIME_T);
+  metrics->pretransfer      += info_off_t(curl, CURLINFO_PRETRANSFER_TIME_T);
+  metrics->starttransfer    += info_off_t(curl,
+                                          CURLINFO_STARTTRANSFER_TIME_T);
+  metrics->total            += info_off_t(curl, CURLINFO_TOTAL_TIME_T);
+  metrics->bytes_uploaded   += info_off_t(curl, CURLINFO_SIZE_UPLOAD_T);
+  metrics->bytes_downloaded += info_off_t(curl, CURLINFO_SIZE_DOWNLOAD_T);
+
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+  metrics->new_connections += connects;
+  metrics->requests++;
+
+  set_speeds(metrics);
+}
+
+static void finish_download(struct JirafeauTransfer *transfer, CURLcode res,
+                            DownloadResultT *result) {
+  struct DownloadContext *ctx = &transfer->download;
+
+  finish_response(ctx);
+
+  /* the end of a range is where the transfer was cut off on purpose */
+  if (ctx->state == SUCCESS && res != CURLE_OK &&
+      !(res == CURLE_WRITE_ERROR && ctx->range_length &&
+        ctx->received == ctx->range_length)) {
+    ctx->state = ERROR;
+  }
+  if (ctx->state == SUCCESS && ctx->decryptor &&
+      !jirafeau_decryptor_finish(ctx->decryptor, write_decrypted, ctx)) {
+    ctx->state = ERROR;
+  }
+  if (ctx->state == SUCCESS && ctx->decompressor &&
+      !jirafeau_decompressor_finished(ctx->decompressor)) {
+    fprintf(stderr, "Error: The compressed file ended early\n");
+    ctx->state = ERROR;
+  }
+
+  /* a digest that missed some of the output would be wrong */
+  if (ctx->state == SUCCESS && ctx->digest &&
+      jirafeau_digest_position(ctx->digest) == ctx->written) {
+    jirafeau_digest_finish(ctx->digest, result->sha256);
+  }
+
+  result->state = ctx->state;
+  if (ctx->output_file) {
+    if (close_output(ctx, result->state == SUCCESS)) {
+      result->download_path = strdup(ctx->output_file_path);
+    } else if (result->state == SUCCESS) {
+      perror("Error: Could not write the output file\n");
+      result->state = ERROR;
+    }
+  }
+  free(ctx->output_file_path);
+  ctx->output_file_path = NULL;
+}
+
+void jirafeau_transfer_finish(struct JirafeauTransfer *transfer, CURLcode res,
+                              OperationResultT *result) {
+  TransferMetricsT *metrics = NULL;
+
+  result->operation = transfer->operation;
+
+  switch (transfer->operation) {
+  case UPLOAD:
+    if (res != CURLE_OK || !transfer->body.memory) {
+      result->upload.state = ERROR;
+    } else {
+      parse_upload_response(transfer->body.memory, &result->upload);
+    }
+    if (result->upload.state == SUCCESS && transfer->digest) {
+      jirafeau_digest_finish(transfer->digest, result->upload.sha256);
+    } else if (result->upload.state == SUCCESS) {
+      memcpy(result->upload.sha256, transfer->sha256,
+             sizeof(transfer->sha256));
+    }
+    metrics = &result->upload.metrics;
+    break;
+
+  case DOWNLOAD:
+    finish_download(transfer, res, &result->download);
+    metrics = &result->download.metrics;
+    break;
+
+  case DELETE:
+    finish_response(&transfer->download);
+    result->delete.state = transfer->download.state;
+    metrics = &result->delete.metrics;
+    break;
+  }
+
+  if (metrics) {
+    *metrics = transfer->metrics;
+  }
+  /* CURLE_FAILED_INIT: the request was never sent */
+  if (metrics && transfer->curl && res != CURLE_FAILED_INIT) {
+    add_metrics(metrics, transfer->curl);
+  }
+}
+
+bool jirafeau_is_transient(CURLcode res, long status) {
+  if (status == 408 || status == 429 || status >= 500) {
+    return true;
+  }
+
+  switch (res) {
+  case CURLE_COULDNT_RESOLVE_HOST:
+  case CURLE_COULDNT_CONNECT:
+  case CURLE_OPERATION_TIMEDOUT:
+  case CURLE_SEND_ERROR:
+  case CURLE_RECV_ERROR:
+  case CURLE_PARTIAL_FILE:
+  case CURLE_GOT_NOTHING:
+  case CURLE_SSL_CONNECT_ERROR:
+  case CURLE_HTTP2:
+  case CURLE_HTTP2_STREAM:
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+long jirafeau_retry_delay(int retry, long delay_ms) {
+  long         delay  = delay_ms > 0 ? delay_ms : JIRAFEAU_DEFAULT_RETRY_DELAY;
+  unsigned int random = 0;
+
+  for (int i = 1; i < retry && delay < JIRAFEAU_MAX_RETRY_DELAY; i++) {
+    delay *= 2;
+  }
+  if (delay > JIRAFEAU_MAX_RETRY_DELAY) {
+    delay = JIRAFEAU_MAX_RETRY_DELAY;
+  }
+
+  /* clients that failed together must not come back together */
+  RAND_bytes((unsigned char *)&random, sizeof(random));
+  return delay / 2 + (long)(random % (unsigned int)(delay / 2 + 1));
+}
+
+curl_off_t jirafeau_now_ms(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (curl_off_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void sleep_ms(long ms) {
+  struct timespec delay = { ms / 1000, (ms % 1000) * 1000000 };
+
+  while (nanosleep(&delay, &delay) == -1) {
+  }
+}
+
+/**
+ * Frees what an attempt of the transfer set up, but keeps the output of a
+ * download and its decoding.
+ */
+static void reset_attempt(struct JirafeauTransfer *transfer) {
+  struct DownloadContext *ctx = &transfer->download;
+
+  curl_mime_free(transfer->mime);
+  curl_slist_free_all(transfer->headers);
+  free(transfer->url);
+  free(transfer->post_fields);
+  free(transfer->body.memory);
+  transfer->mime            = NULL;
+  transfer->headers         = NULL;
+  transfer->url             = NULL;
+  transfer->post_fields     = NULL;
+  transfer->body.memory     = NULL;
+  transfer->body.size       = 0;
+  transfer->buffer_position = 0;
+
+  /* an upload is encoded from the start again */
+  jirafeau_compressor_free(transfer->compressor);
+  jirafeau_encryptor_free(transfer->encryptor);
+  if (transfer->source_file) {
+    fclose(transfer->source_file);
+  }
+  transfer->compressor      = NULL;
+  transfer->encryptor       = NULL;
+  transfer->source_file     = NULL;
+  transfer->source_position = 0;
+
+  ctx->status         = 0;
+  ctx->attachment     = false;
+  ctx->response       = RESPONSE_HEADERS;
+  ctx->lookahead_size = 0;
+  ctx->skip           = 0;
+}
+
+long jirafeau_transfer_retry(struct JirafeauTransfer *transfer, CURLcode res,
+                             int retries, long delay_ms) {
+  struct DownloadContext *ctx    = &transfer->download;
+  long                    status = 0;
+
+  if (transfer->attempt >= retries || !transfer->curl ||
+      res == CURLE_FAILED_INIT) {
+    return -1;
+  }
+  curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status);
+
+  if (transfer->operation == DOWNLOAD && status == 416 &&
+      ctx->state != SUCCESS) {
+    /* the part is longer than the file, it belongs to another one */
+    if (!restart_output(ctx)) {
+      return -1;
+    }
+  } else if (!jirafeau_is_transient(res, status) ||
+             (transfer->operation == UPLOAD && transfer->read_callback)) {
+    return -1;
+  }
+
+  add_metrics(&transfer->metrics, transfer->curl);
+  reset_attempt(transfer);
+  transfer->attempt++;
+
+  long delay = jirafeau_retry_delay(transfer->attempt, delay_ms);
+  if (res != CURLE_OK && res != CURLE_WRITE_ERROR) {
+    fprintf(stderr, "Warning: %s, retry %d of %d in %ld ms\n",
+            curl_easy_strerror(res), transfer->attempt, retries, delay);
+  } else {
+    fprintf(stderr, "Warning: HTTP %ld, retry %d of %d in %ld ms\n", status,
+            transfer->attempt, retries, delay);
+  }
+  return delay;
+}
+
+void jirafeau_transfer_release(struct JirafeauTransfer *transfer) {
+  struct DownloadContext *ctx = &transfer->download;
+
+  if (ctx->output_file) {
+    close_output(ctx, false);
+  }
+  free(ctx->output_file_path);
+  free(ctx->part_path);
+  free(ctx->output_dir);
+  free(ctx->lookahead);
+  jirafeau_decompressor_free(ctx->decompressor);
+  jirafeau_decryptor_free(ctx->decryptor);
+  jirafeau_digest_free(ctx->digest);
+
+  jirafeau_compressor_free(transfer->compressor);
+  jirafeau_encryptor_free(transfer->encryptor);
+  if (transfer->source_file) {
+    fclose(transfer->source_file);
+  }
+
+  curl_mime_free(transfer->mime);
+  curl_slist_free_all(transfer->headers);
+  free(transfer->url);
+  free(transfer->post_fields);
+  free(transfer->body.memory);
+  free(transfer->encoded_filename);
+  jirafeau_digest_free(transfer->digest);
+
+  free(transfer->file_path);
+  free(transfer->time);
+  free(transfer->upload_password);
+  free(transfer->key);
+  free(transfer->filename);
+  free(transfer->file_id);
+  free(transfer->output_path);
+  free(transfer->file_key);
+  free(transfer->crypt_key);
+  free(transfer->delete_key);
+}
+
+/**
+ * Runs a transfer on the easy handle of the client.
+ */
+static OperationResultT perform_transfer(JirafeauClientT *       client,
+                                         struct JirafeauTransfer *transfer) {
+  OperationResultT result = { 0 };
+  CURLcode         res;
+  long             delay;
+
+  transfer->compression_level   = client->compression_level;
+  transfer->compression_workers = client->compression_workers;
+  transfer->download.decompress = client->decompress;
+  transfer->passphrase          = client->passphrase;
+  transfer->encryption_workers  = client->encryption_workers;
+  transfer->download.passphrase = client->passphrase;
+
+  transfer->download.receive_buffer = client->receive_buffer;
+  transfer->download.write_queue    = client->write_queue;
+  transfer->download.direct_io      = client->direct_io;
+
+  do {
+    res = CURLE_FAILED_INIT;
+    if (jirafeau_transfer_prepare(transfer, client_handle(client),
+                                  client->host_url)) {
+      res = curl_easy_perform(transfer->curl);
+    }
+    delay = jirafeau_transfer_retry(transfer, res, client->retries,
+                                    client->retry_delay);
+    if (delay >= 0) {
+      sleep_ms(delay);
+    }
+  } while (delay >= 0);
+  jirafeau_transfer_finish(transfer, res, &result);
+  jirafeau_transfer_release(transfer);
+
+  return result;
+}
+
+/**
+ * Looks an upload of `file_path` or, if that is NULL, of `data` up in the
+ * dedup index of the client.
+ *
+ * @param entry Receives the key to store the result under, empty if the
+ * upload is not deduplicated
+ * @param content_hash Receives the SHA-256 of the content if it had to be
+ * hashed, empty otherwise
+ * @return true if `result` was taken from the index
+ */
+static bool dedup_lookup(JirafeauClientT *client, const char *file_path,
+                         const void *data, size_t size, const char *time,
+                         int one_time_download, const char *key,
+                         const char *filename, char *entry,
+                         char *content_hash, UploadResultT *result) {
+  char *name_buf = NULL;
+
+  entry[0]        = '\0';
+  content_hash[0] = '\0';
+
+  /*
+   * One time downloads are gone once someone fetched them, and an encrypted
+   * upload is only the same for the same passphrase.
+   */
+  if (!client->dedup_index || one_time_download || client->passphrase ||
+      jirafeau_dedup_expiry(time, 0) == -1) {
+    return false;
+  }
+
+  if (file_path ? !jirafeau_sha256_file(file_path, content_hash)
+                : !jirafeau_sha256_buffer(data, size, content_hash)) {
+    content_hash[0] = '\0';
+    return false;
+  }
+
+  if (!filename) {
+    if (file_path) {
+      name_buf = strdup(file_path);
+      filename = basename(name_buf);
+    } else {
+      filename = JIRAFEAU_BUFFER_FILENAME;
+    }
+  }
+
+  /* a compressed upload is a different file on the server */
+  char *compressed = NULL;
+  if (client->compression_level) {
+    compressed = build_url("%s%s", filename, JIRAFEAU_COMPRESSED_SUFFIX);
+    filename   = compressed;
+  }
+  if (filename) {
+    jirafeau_dedup_entry_key(content_hash, client->host_url, filename, key,
+                             entry);
+  }
+  free(compressed);
+  free(name_buf);
+
+  if (entry[0] && jirafeau_dedup_lookup(client->dedup_index, entry, result)) {
+    memcpy(result->sha256, content_hash, JIRAFEAU_SHA256_HEX_SIZE);
+    return true;
+  }
+  return false;
+}
+
+static void dedup_store(JirafeauClientT *client, const char *entry,
+                        const char *time, const UploadResultT *result) {
+  if (entry[0] && result->state == SUCCESS) {
+    jirafeau_dedup_store(client->dedup_index, entry, result, time);
+  }
+}
+
+UploadResultT jirafeau_client_upload(JirafeauClientT *client,
+                                     const char *file_path, const char *time,
+                                     const char *upload_password,
+                                     int one_time_download, const char *key,
+                                     const char *filename) {
+  struct JirafeauTransfer transfer = { 0 };
+  UploadResultT           result   = { 0 };
+  char                    entry[JIRAFEAU_SHA256_HEX_SIZE];
+
+  /* the dedup index had to hash the file, it is not hashed again */
+  if (dedup_lookup(client, file_path, NULL, 0, time, one_time_download, key,
+                   filename, entry, transfer.sha256, &result)) {
+    return result;
+  }
+
+  jirafeau_transfer_init_upload(&transfer, file_path, time, upload_password,
+                                one_time_download, key, filename);
+  result = perform_transfer(client, &transfer).upload;
+  dedup_store(client, entry, time, &result);
+  return result;
+}
+
+struct ChunkSource {
+  int            fd;
+  curl_off_t     offset;
+  curl_off_t     size;
+  curl_off_t     position;
+  struct Digest *digest;
+};
+
+static size_t read_chunk(char *buffer, size_t size, size_t nitems, void *arg) {
+  struct ChunkSource *chunk = (struct ChunkSource *)arg;
+  curl_off_t          left  = chunk->size - chunk->position;
+  size_t              len   = size * nitems;
+
+  if (left <= 0) {
+    return 0;
+  }
+  if ((curl_off_t)len > left) {
+    len = (size_t)left;
+  }
+
+  ssize_t n = pread(chunk->fd, buffer, len, chunk->offset + chunk->position);
+  if (n <= 0) {
+    /* the file got shorter while we were uploading it */
+    return CURL_READFUNC_ABORT;
+  }
+
+  jirafeau_digest_update(chunk->digest, buffer, n,
+                         chunk->offset + chunk->position);
+  chunk->position += n;
+  return n;
+}
+
+static int seek_chunk(void *arg, curl_off_t offset, int origin) {
+  struct ChunkSource *chunk = (struct ChunkSource *)arg;
+
+  if (origin != SEEK_SET || offset > chunk->size) {
+    return CURL_SEEKFUNC_CANTSEEK;
+  }
+  chunk->position = offset;
+  return CURL_SEEKFUNC_OK;
+}
+
+/**
+ * Sends one step (init_async, push_async or end_async) of Jirafeau's async
+ * upload protocol, retried as configured for the client. Takes ownership
+ * of `mime`, the requests are added to `metrics`.
+ *
+ * @param rejected Set if Jirafeau answered with an error rather than the
+ * request failing
+ * @return The body of the answer, NULL if the request failed or Jirafeau
+ * answered with an error.
+ */
+static char *async_request(JirafeauClientT *client, CURL *curl,
+                           const char *step, curl_mime *mime,
+                           TransferMetricsT *metrics, bool *rejected) {
+  struct MemoryStruct chunk  = { 0 };
+  char *              url    = build_url("%s/script.php?%s", client->host_url,
+                                         step);
+  long                status = 0;
+  CURLcode            res;
+
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_request_body_to_memory);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+  curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
+
+  for (int retry = 1;; retry++) {
+    res = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    add_metrics(metrics, curl);
+
+    if (retry > client->retries || !jirafeau_is_transient(res, status)) {
+      break;
+    }
+
+    long delay = jirafeau_retry_delay(retry, client->retry_delay);
+    fprintf(stderr, "Warning: %s failed, retry %d of %d in %ld ms\n", step,
+            retry, client->retries, delay);
+    free(chunk.memory);
+    chunk.memory = NULL;
+    chunk.size   = 0;
+    sleep_ms(delay);
+  }
+
+  curl_mime_free(mime);
+  free(url);
+
+  *rejected = res == CURLE_OK && status < 400 && chunk.memory &&
+              strncmp(chunk.memory, "Error", 5) == 0;
+  if (res == CURLE_OK && status >= 400) {
+    /* the body of an error page is no code to go on with */
+    fprintf(stderr, "Error: %s failed: HTTP %ld\n", step, status);
+    free(chunk.memory);
+    return NULL;
+  }
+  if (res != CURLE_OK || !chunk.memory || *rejected) {
+    fprintf(stderr, "Error: %s failed: %s\n", step,
+            res != CURLE_OK ? curl_easy_strerror(res)
+                            : chunk.memory ? chunk.memory : "empty answer");
+    free(chunk.memory);
+    return NULL;
+  }
+
+  return chunk.memory;
+}
+
+/**
+ * Pushes the chunks of the file from `offset` on and ends the async upload,
+ * recording every chunk the server confirmed in the journal.
+ *
+ * @param code Code the next push has to present, replaced by the ones the
+ * server hands out
+ * @param journal Name of the journal, empty for none
+ * @param digest Hashes the chunks as they are read, may be NULL
+ * @param rejected Set if Jirafeau refused a request, see async_request
+ * @return The answer of end_async (to be freed), NULL on failure
+ */
+static char *push_chunks(JirafeauClientT *client, int fd, curl_off_t size,
+                         size_t chunk_size, const char *filename,
+                         const char *ref, char **code, curl_off_t offset,
+                         const char *journal, struct Digest *digest,
+                         TransferMetricsT *metrics, bool *rejected) {
+  CURL *     curl;
+  curl_mime *mime;
+
+  /*
+   * Every push_async answers with the code the next push has to present, and
+   * the server appends the chunks in the order it receives them. The chunks
+   * therefore have to go one after the other, over the kept-alive connection
+   * of the client.
+   */
+  for (; offset < size; offset += chunk_size) {
+    struct ChunkSource chunk = { fd, offset, size - offset, 0, digest };
+    if (chunk.size > (curl_off_t)chunk_size) {
+      chunk.size = chunk_size;
+    }
+
+    curl = client_handle(client);
+    mime = curl_mime_init(curl);
+    add_mime_field(mime, "ref", ref);
+    add_mime_field(mime, "code", *code);
+
+    curl_mimepart *part = curl_mime_addpart(mime);
+    curl_mime_name(part, "data");
+    curl_mime_filename(part, filename);
+    curl_mime_data_cb(part, chunk.size, read_chunk, seek_chunk, NULL, &chunk);
+
+    char *next = async_request(client, curl, "push_async", mime, metrics,
+                               rejected);
+    if (!next) {
+      return NULL;
+    }
+    next[strcspn(next, "\r\n")] = '\0';
+    free(*code);
+    *code = next;
+
+    if (journal[0]) {
+      jirafeau_journal_save(client->journal_dir, journal, ref, next,
+                            offset + chunk.size);
+    }
+  }
+
+  curl = client_handle(client);
+  mime = curl_mime_init(curl);
+  add_mime_field(mime, "ref", ref);
+  add_mime_field(mime, "code", *code);
+
+  return async_request(client, curl, "end_async", mime, metrics, rejected);
+}
+
+UploadResultT jirafeau_client_upload_chunked(JirafeauClientT *client,
+                                             const char *file_path,
+                                             const char *time,
+                                             const char *upload_password,
+                                             int one_time_download,
+                                             const char *key,
+                                             const char *filename,
+                                             size_t chunk_size) {
+  struct UploadResult result   = { 0 };
+  struct stat         st       = { 0 };
+  char *              name_buf = NULL;
+  char *              ref      = NULL;
+  char *              code     = NULL;
+  char *              answer   = NULL;
+  curl_off_t          offset   = 0;
+  bool                rejected = false;
+  struct Digest *     digest   = NULL;
+  char                entry[JIRAFEAU_SHA256_HEX_SIZE];
+  char                journal[JIRAFEAU_SHA256_HEX_SIZE] = "";
+  char                content_hash[JIRAFEAU_SHA256_HEX_SIZE];
+  CURL *              curl;
+  curl_mime *         mime;
+
+  if (dedup_lookup(client, file_path, NULL, 0, time, one_time_download, key,
+                   filename, entry, content_hash, &result)) {
+    return result;
+  }
+
+  result.state = ERROR;
+
+  /* every chunk is a request of its own, they can't be one encrypted stream */
+  if (client->passphrase) {
+    fprintf(stderr, "Error: Chunked uploads can't be encrypted\n");
+    return result;
+  }
+
+  if (chunk_size == 0) {
+    chunk_size = JIRAFEAU_DEFAULT_CHUNK_SIZE;
+  }
+
+  int fd = open(file_path, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror("Error: Could not open file to upload\n");
+    if (fd != -1) {
+      close(fd);
+    }
+    return result;
+  }
+
+  if (!filename) {
+    name_buf = strdup(file_path);
+    filename = basename(name_buf);
+  }
+
+  if (!content_hash[0]) {
+    digest = jirafeau_digest_new();
+  }
+
+  if (client->journal_dir) {
+    jirafeau_journal_entry_key(client->host_url, file_path, &st, chunk_size,
+                               filename, time, upload_password,
+                               one_time_download, key, journal);
+  }
+
+  /* continue an upload of the same file that was interrupted */
+  if (journal[0] && jirafeau_journal_load(client->journal_dir, journal, &ref,
+                                          &code, &offset)) {
+    /* the chunks sent before are hashed from the file */
+    if (offset <= st.st_size && offset % chunk_size == 0 &&
+        (!digest || jirafeau_digest_read(digest, fd, offset))) {
+      answer = push_chunks(client, fd, st.st_size, chunk_size, filename, ref,
+                           &code, offset, journal, digest, &result.metrics,
+                           &rejected);
+      if (!answer && !rejected) {
+        goto done;
+      }
+    }
+
+    /* the server no longer knows the upload, e.g. it expired */
+    if (!answer) {
+      jirafeau_journal_remove(client->journal_dir, journal);
+      free(ref);
+      free(code);
+      ref  = NULL;
+      code = NULL;
+    }
+  }
+
+  if (!answer) {
+    curl = client_handle(client);
+    mime = curl_mime_init(curl);
+    add_mime_field(mime, "filename", filename);
+    add_mime_field(mime, "type", "application/octet-stream");
+    add_upload_options(mime, time, upload_password, one_time_download, key);
+
+    ref = async_request(client, curl, "init_async", mime, &result.metrics,
+                        &rejected);
+    if (!ref) {
+      goto done;
+    }
+
+    /* init_async answers with "REF\nCODE" */
+    char *separator = strchr(ref, '\n');
+    if (!separator) {
+      fprintf(stderr, "Error: init_async did not return a code\n");
+      goto done;
+    }
+    *separator = '\0';
+    code       = strdup(separator + 1);
+    code[strcspn(code, "\r\n")] = '\0';
+
+    if (journal[0]) {
+      jirafeau_journal_save(client->journal_dir, journal, ref, code, 0);
+    }
+    answer = push_chunks(client, fd, st.st_size, chunk_size, filename, ref,
+                         &code, 0, journal, digest, &result.metrics,
+                         &rejected);
+  }
+
+  if (answer) {
+    parse_upload_response(answer, &result);
+    free(answer);
+    if (result.state == SUCCESS && digest) {
+      jirafeau_digest_finish(digest, result.sha256);
+    } else if (result.state == SUCCESS) {
+      memcpy(result.sha256, content_hash, sizeof(content_hash));
+    }
+    if (journal[0]) {
+      jirafeau_journal_remove(client->journal_dir, journal);
+    }
+    dedup_store(client, entry, time, &result);
+  }
+
+done:
+  close(fd);
+  jirafeau_digest_free(digest);
+  free(name_buf);
+  free(ref);
+  free(code);
+  return result;
+}
+
+UploadResultT jirafeau_client_upload_callback(JirafeauClientT *client,
+                                              JirafeauReadCallback read_callback,
+                                              void *userdata, const char *time,
+                                              const char *upload_password,
+                                              int one_time_download,
+                                              const char *key,
+                                              const char *filename) {
+  struct JirafeauTransfer transfer = { 0 };
+
+  jirafeau_transfer_init_upload(&transfer, NULL, time, upload_password,
+                                one_time_download, key, filename);
+  transfer.read_callback = read_callback;
+  transfer.read_userdata = userdata;
+  return perform_transfer(client, &transfer).upload;
+}
+
+UploadResultT jirafeau_client_upload_buffer(JirafeauClientT *client,
+                                            const void *data, size_t size,
+                                            const char *time,
+                                            const char *upload_password,
+                                            int one_time_download,
+                                            const char *key,
+                                            const char *filename) {
+  struct JirafeauTransfer transfer = { 0 };
+  UploadResultT           result   = { 0 };
+  char                    entry[JIRAFEAU_SHA256_HEX_SIZE];
+  /* the empty file still needs a non-NULL buffer to be sent as buffer */
+  static const char       empty[1] = { 0 };
+
+  if (dedup_lookup(client, NULL, size ? data : empty, size, time,
+                   one_time_download, key, filename, entry, transfer.sha256,
+                   &result)) {
+    return result;
+  }
+
+  jirafeau_transfer_init_upload(&transfer, NULL, time, upload_password,
+                                one_time_download, key, filename);
+  transfer.buffer      = size ? data : empty;
+  transfer.buffer_size = size;
+  result               = perform_transfer(client, &transfer).upload;
+  dedup_store(client, entry, time, &result);
+  return result;
+}
+
+UploadResultT jirafeau_client_upload_mmap(JirafeauClientT *client,
+                                          const char *file_path,
+                                          const char *time,
+                                          const char *upload_password,
+                                          int one_time_download,
+                                          const char *key,
+                                          const char *filename) {
+  struct UploadResult result   = { 0 };
+  struct stat         st       = { 0 };
+  void *              data     = NULL;
+  char *              name_buf = NULL;
+
+  result.state = ERROR;
+
+  int fd = open(file_path, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror("Error: Could not open file to upload\n");
+    if (fd != -1) {
+      close(fd);
+    }
+    return result;
+  }
+
+  if (st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      perror("Error: Could not map file to upload\n");
+      close(fd);
+      return result;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+  }
+
+  if (!filename) {
+    name_buf = strdup(file_path);
+    filename = basename(name_buf);
+  }
+
+  result = jirafeau_client_upload_buffer(client, data, st.st_size, time,
+                                         upload_password, one_time_download,
+                                         key, filename);
+
+  if (data) {
+    munmap(data, st.st_size);
+  }
+  close(fd);
+  free(name_buf);
+  return result;
+}
+
+/**
+ * Serves a download from the cache of the client.
+ *
+ * @param entry Receives the name of the download in the cache, empty if the
+ * client has no cache
+ * @return true if `result` has been filled from the cache
+ */
+static bool cache_fetch(JirafeauClientT *client, const char *file_id,
+                        const char *output_path, const char *file_key,
+                        const char *crypt_key, char *entry,
+                        DownloadResultT *result) {
+  char *destination = NULL;
+  char *dir;
+
+  entry[0] = '\0';
+  /* decrypted files are not kept around in the cache */
+  if (!client->cache_dir || client->passphrase) {
+    return false;
+  }
+
+  jirafeau_cache_entry_key(client->host_url, file_id, file_key, crypt_key,
+                           client->decompress, entry);
+  if (!entry[0]) {
+    return false;
+  }
+
+  dir = output_directory(output_path);
+  if (dir) {
+    char *name = jirafeau_cache_name(client->cache_dir, entry);
+    if (name) {
+      destination = join_path(dir, name);
+    }
+    free(name);
+    free(dir);
+  } else {
+    destination = strdup(output_path);
+  }
+
+  if (destination &&
+      jirafeau_cache_deliver(client->cache_dir, entry, destination)) {
+    result->download_path = destination;
+    result->state         = SUCCESS;
+    jirafeau_cache_sha256(client->cache_dir, entry, result->sha256);
+    return true;
+  }
+  free(destination);
+  return false;
+}
+
+static void cache_store(JirafeauClientT *client, const char *entry,
+                        const char *output_path,
+                        const DownloadResultT *result) {
+  char *dir;
+  char *name_buf = NULL;
+
+  if (!entry[0] || result->state != SUCCESS || !result->download_path) {
+    return;
+  }
+
+  /* the name only came from the server for downloads into a directory */
+  dir = output_directory(output_path);
+  if (dir) {
+    name_buf = strdup(result->download_path);
+  }
+  jirafeau_cache_store(client->cache_dir, entry, result->download_path,
+                       name_buf ? basename(name_buf) : NULL, result->sha256,
+                       client->cache_size);
+  free(name_buf);
+  free(dir);
+}
+
+DownloadResultT jirafeau_client_download(JirafeauClientT *client,
+                                         const char *file_id,
+                                         const char *output_path,
+                                         const char *file_key,
+                                         const char *crypt_key) {
+  struct JirafeauTransfer transfer = { 0 };
+  DownloadResultT         result   = { 0 };
+  char                    entry[JIRAFEAU_SHA256_HEX_SIZE];
+
+  if (cache_fetch(client, file_id, output_path, file_key, crypt_key, entry,
+                  &result)) {
+    return result;
+  }
+
+  jirafeau_transfer_init_download(&transfer, file_id, output_path, file_key,
+                                  crypt_key);
+  result = perform_transfer(client, &transfer).download;
+  cache_store(client, entry, output_path, &result);
+  return result;
+}
+
+DownloadResultT jirafeau_client_download_callback(
+  JirafeauClientT *client, const char *file_id, const char *file_key,
+  const char *crypt_key, JirafeauWriteCallback write_callback,
+  void *userdata) {
+  struct JirafeauTransfer transfer = { 0 };
+
+  jirafeau_transfer_init_download(&transfer, file_id, NULL, file_key,
+                                  crypt_key);
+  transfer.download.write_callback = write_callback;
+  transfer.download.write_userdata = userdata;
+  return perform_transfer(client, &transfer).download;
+}
+
+DownloadResultT jirafeau_client_download_range(
+  JirafeauClientT *client, const char *file_id, const char *file_key,
+  const char *crypt_key, curl_off_t offset, curl_off_t length,
+  JirafeauWriteCallback write_callback, void *userdata) {
+  struct JirafeauTransfer transfer = { 0 };
+
+  jirafeau_transfer_init_download(&transfer, file_id, NULL, file_key,
+                                  crypt_key);
+  transfer.download.write_callback = write_callback;
+  transfer.download.write_userdata = userdata;
+  transfer.download.range_offset   = offset > 0 ? offset : 0;
+  transfer.download.range_length   = length > 0 ? length : 0;
+  return perform_transfer(client, &transfer).download;
+}
+
+struct SegmentProbe {
+  char *     filename;
+  curl_off_t total_size;
+  bool       not_found;
+};
+
+static size_t handle_probe_headers(char *buffer, size_t size, size_t nitems,
+                                   void *userdata) {
+  struct SegmentProbe *probe = (struct SegmentProbe *)userdata;
+  size_t               len   = size * nitems;
+
+  if (strncasecmp(buffer, "content-disposition:", 20) == 0) {
+    char *header = strndup(buffer, len);
+    free(probe->filename);
+    probe->filename = disposition_filename(header);
+    free(header);
+  } else if (strncasecmp(buffer, "content-range:", 14) == 0) {
+    /* Content-Range: bytes 0-0/TOTAL */
+    const char *total = memchr(buffer, '/', len);
+    if (total && total[1] != '*') {
+      probe->total_size = strtoll(total + 1, NULL, 10);
+    }
+  }
+  return len;
+}
+
+static size_t handle_probe_body(void *ptr, size_t size, size_t nmemb,
+                                void *userdata) {
+  struct SegmentProbe *probe = (struct SegmentProbe *)userdata;
+  size_t               len   = size * nmemb;
+
+  /* only Jirafeau's error page comes without a Content-Range */
+  if (probe->total_size <= 0) {
+    char *body = strndup(ptr, len);
+    if (body && strstr(body, "file is not found")) {
+      probe->not_found = true;
+    }
+    free(body);
+    return 0;
+  }
+  return len;
+}
+
+struct Segment {
+  CURL *     curl;
+  int        fd;
+  curl_off_t offset;
+  curl_off_t end;
+  bool       failed;
+  CURLcode   result;
+
+  /* shared by all segments, takes what continues the hashed part */
+  struct Digest *digest;
+
+  /* writes through a descriptor of its own, so O_DIRECT stays per segment */
+  struct Writer *writer;
+  int            writer_fd;
+
+  struct curl_slist *range_header;
+};
+
+static bool segment_complete(const struct Segment *segment) {
+  return segment->result == CURLE_OK && !segment->failed &&
+         segment->offset == segment->end + 1;
+}
+
+/* curl turns CURLOPT_RANGE into a Content-Range for POSTs (file keys) */
+static void set_segment_range(struct Segment *segment) {
+  char range[96];
+
+  snprintf(range, sizeof(range), "Range: bytes=%" CURL_FORMAT_CURL_OFF_T "-%"
+           CURL_FORMAT_CURL_OFF_T, segment->offset, segment->end);
+  curl_slist_free_all(segment->range_header);
+  segment->range_header = curl_slist_append(NULL, range);
+  curl_easy_setopt(segment->curl, CURLOPT_HTTPHEADER, segment->range_header);
+}
+
+static size_t write_segment(void *ptr, size_t size, size_t nmemb,
+                            void *userdata) {
+  struct Segment *segment = (struct Segment *)userdata;
+  size_t          len     = size * nmemb;
+  long            status  = 0;
+
+  curl_easy_getinfo(segment->curl, CURLINFO_RESPONSE_CODE, &status);
+  if (status != 206 || segment->offset + (curl_off_t)len > segment->end + 1) {
+    segment->failed = true;
+    return 0;
+  }
+
+  jirafeau_digest_update(segment->digest, ptr, len, segment->offset);
+  if (segment->writer) {
+    if (!jirafeau_writer_write(segment->writer, ptr, len)) {
+      segment->failed = true;
+      return 0;
+    }
+    segment->offset += len;
+    return len;
+  }
+  for (size_t done = 0; done < len;) {
+    ssize_t n = pwrite(segment->fd, (char *)ptr + done, len - done,
+                       segment->offset);
+    if (n < 0) {
+      segment->failed = true;
+      return 0;
+    }
+    done            += n;
+    segment->offset += n;
+  }
+  return len;
+}
+
+static void set_download_options(CURL *curl, const char *url,
+                                 const char *post_fields) {
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  if (post_fields) {
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
+  }
+}
+
+DownloadResultT jirafeau_client_download_segmented(JirafeauClientT *client,
+                                                   const char *file_id,
+                                                   const char *output_path,
+                                                   const char *file_key,
+                                                   const char *crypt_key,
+                                                   int segments) {
+  struct DownloadResult result = { 0 };
+  struct SegmentProbe   probe  = { 0 };
+  struct curl_slist *   probe_range = NULL;
+  char *                post_fields = NULL;
+  char *                part_path   = NULL;
+  char *                url;
+  char *                dir;
+  struct Digest *       digest = NULL;
+  char                  entry[JIRAFEAU_SHA256_HEX_SIZE];
+
+  if (cache_fetch(client, file_id, output_path, file_key, crypt_key, entry,
+                  &result)) {
+    return result;
+  }
+
+  result.state = ERROR;
+
+  if (segments <= 0) {
+    segments = JIRAFEAU_DEFAULT_SEGMENTS;
+  }
+
+  if (crypt_key) {
+    url = build_url("%s/f.php?h=%s&d=1&k=%s", client->host_url, file_id,
+                    crypt_key);
+  } else {
+    url = build_url("%s/f.php?h=%s&d=1", client->host_url, file_id);
+  }
+  if (file_key) {
+    post_fields = build_url("key=%s", file_key);
+  }
+
+  /* learn the size and the name of the file from a one byte range */
+  CURL *curl = client_handle(client);
+  set_download_options(curl, url, post_fields);
+  probe_range = curl_slist_append(NULL, "Range: bytes=0-0");
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, probe_range);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, handle_probe_headers);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)&probe);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, handle_probe_body);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&probe);
+
+  CURLcode res    = curl_easy_perform(curl);
+  long     status = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+  add_metrics(&result.metrics, curl);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+  curl_slist_free_all(probe_range);
+
+  if (probe.not_found) {
+    result.state = FILE_NOT_FOUND;
+    goto done;
+  }
+
+  /*
+   * The server does not do ranges (or the file is empty), or the file is
+   * compressed or encrypted, which can only be decoded front to back.
+   */
+  if (res != CURLE_OK || status != 206 || probe.total_size <= 0 ||
+      (client->decompress &&
+       has_suffix(probe.filename, JIRAFEAU_COMPRESSED_SUFFIX)) ||
+      (client->passphrase &&
+       has_suffix(probe.filename, JIRAFEAU_ENCRYPTED_SUFFIX))) {
+    free(probe.filename);
+    free(post_fields);
+    free(url);
+
+    TransferMetricsT probe_metrics = result.metrics;
+    result = jirafeau_client_download(client, file_id, output_path, file_key,
+                                      crypt_key);
+    result.metrics.requests        += probe_metrics.requests;
+    result.metrics.new_connections += probe_metrics.new_connections;
+    result.metrics.total           += probe_metrics.total;
+    set_speeds(&result.metrics);
+    return result;
+  }
+
+  dir = output_directory(output_path);
+  if (dir) {
+    if (!probe.filename) {
+      free(dir);
+      goto done;
+    }
+    result.download_path = join_path(dir, probe.filename);
+    free(dir);
+  } else {
+    result.download_path = strdup(output_path);
+  }
+
+  /* like a single stream, an existing file is only replaced once complete */
+  part_path = build_url("%s.part", result.download_path);
+  if (!part_path) {
+    goto done;
+  }
+
+  /* readable, the hash reads back what arrived out of order */
+  int fd = open(part_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror("Error: Could not open output file\n");
+    goto done;
+  }
+
+  /* reserve the space up front so the segments never extend the file */
+  if (posix_fallocate(fd, 0, probe.total_size) != 0 &&
+      ftruncate(fd, probe.total_size) != 0) {
+    perror("Error: Could not allocate the output file\n");
+    close(fd);
+    unlink(part_path);
+    goto done;
+  }
+
+  curl_off_t segment_size = probe.total_size / segments;
+  if (segment_size < JIRAFEAU_MIN_SEGMENT_SIZE) {
+    segment_size = JIRAFEAU_MIN_SEGMENT_SIZE;
+    segments     = (probe.total_size + segment_size - 1) / segment_size;
+  }
+
+  if (!client->multi) {
+    client->multi = curl_multi_init();
+  }
+
+  struct Segment *parts = calloc(segments, sizeof(struct Segment));
+  if (!parts) {
+    close(fd);
+    unlink(part_path);
+    goto done;
+  }
+  digest = jirafeau_digest_new();
+  for (int i = 0; i < segments; i++) {
+    parts[i].fd        = fd;
+    parts[i].digest    = digest;
+    parts[i].offset    = i * segment_size;
+    parts[i].end       = i == segments - 1 ? probe.total_size - 1
+                                           : (i + 1) * segment_size - 1;
+    parts[i].writer_fd = client->write_queue
+                             ? open(part_path, O_WRONLY)
+                             : -1;
+    if (parts[i].writer_fd != -1) {
+      parts[i].writer = jirafeau_writer_new(parts[i].writer_fd,
+                                            parts[i].offset,
+                                            client->write_queue,
+                                            client->direct_io);
+    }
+
+    parts[i].curl = curl_easy_init();
+    jirafeau_set_common_options(parts[i].curl);
+    set_download_options(parts[i].curl, url, post_fields);
+    set_segment_range(&parts[i]);
+    curl_easy_setopt(parts[i].curl, CURLOPT_PRIVATE, (void *)&parts[i]);
+    if (client->max_speed) {
+      curl_off_t speed = client->max_speed / segments;
+      curl_easy_setopt(parts[i].curl, CURLOPT_MAX_RECV_SPEED_LARGE,
+                       speed > 0 ? speed : 1);
+    }
+    if (client->receive_buffer) {
+      curl_easy_setopt(parts[i].curl, CURLOPT_BUFFERSIZE,
+                       client->receive_buffer);
+    }
+    curl_easy_setopt(parts[i].curl, CURLOPT_WRITEFUNCTION, write_segment);
+    curl_easy_setopt(parts[i].curl, CURLOPT_WRITEDATA, (void *)&parts[i]);
+    curl_multi_add_handle(client->multi, parts[i].curl);
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int retry = 1;; retry++) {
+    int running = 1;
+    while (running) {
+      if (curl_multi_perform(client->multi, &running) != CURLM_OK) {
+        break;
+      }
+      if (running) {
+        curl_multi_poll(client->multi, NULL, 0, 1000, NULL);
+      }
+    }
+
+    CURLMsg *msg;
+    int      queued;
+    while ((msg = curl_multi_info_read(client->multi, &queued))) {
+      if (msg->msg == CURLMSG_DONE) {
+        struct Segment *segment;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+                          (char **)&segment);
+        segment->result = msg->data.result;
+      }
+    }
+
+    int  broken = 0;
+    bool fatal  = false;
+    for (int i = 0; i < segments; i++) {
+      long status = 0;
+
+      if (segment_complete(&parts[i])) {
+        continue;
+      }
+      curl_easy_getinfo(parts[i].curl, CURLINFO_RESPONSE_CODE, &status);
+      if (retry > client->retries ||
+          !jirafeau_is_transient(parts[i].result, status)) {
+        fatal = true;
+      }
+      broken++;
+    }
+    if (!broken || fatal) {
+      break;
+    }
+
+    long delay = jirafeau_retry_delay(retry, client->retry_delay);
+    fprintf(stderr, "Warning: %d segments failed, retry %d of %d in %ld ms\n",
+            broken, retry, client->retries, delay);
+    sleep_ms(delay);
+
+    /* the broken segments continue where they stopped */
+    for (int i = 0; i < segments; i++) {
+      if (!segment_complete(&parts[i])) {
+        add_metrics(&result.metrics, parts[i].curl);
+        curl_multi_remove_handle(client->multi, parts[i].curl);
+        parts[i].failed = false;
+        set_segment_range(&parts[i]);
+        curl_multi_add_handle(client->multi, parts[i].curl);
+      }
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  result.state = SUCCESS;
+
+  for (int i = 0; i < segments; i++) {
+    if (!segment_complete(&parts[i]) ||
+        (parts[i].writer && !jirafeau_writer_flush(parts[i].writer))) {
+      result.state = ERROR;
+    }
+    jirafeau_writer_free(parts[i].writer);
+    if (parts[i].writer_fd != -1) {
+      close(parts[i].writer_fd);
+    }
+    add_metrics(&result.metrics, parts[i].curl);
+    curl_multi_remove_handle(client->multi, parts[i].curl);
+    curl_easy_cleanup(parts[i].curl);
+    curl_slist_free_all(parts[i].range_header);
+  }
+  free(parts);
+
+  /* the segments ran side by side, their times don't add up */
+  result.metrics.total = info_off_t(curl, CURLINFO_TOTAL_TIME_T) +
+                         (end.tv_sec - start.tv_sec) * 1000000 +
+                         (end.tv_nsec - start.tv_nsec) / 1000;
+  set_speeds(&result.metrics);
+
+  /*
+   * Only the first segment could be hashed as it arrived, the others are
+   * read back while they are likely still in the page cache.
+   */
+  if (result.state == SUCCESS && digest &&
+      jirafeau_digest_read(digest, fd, probe.total_size)) {
+    jirafeau_digest_finish(digest, result.sha256);
+  }
+  jirafeau_digest_free(digest);
+  close(fd);
+
+  if (result.state == SUCCESS &&
+      rename(part_path, result.download_path) != 0) {
+    perror("Error: Could not rename the output file\n");
+    result.state = ERROR;
+  }
+  if (result.state != SUCCESS) {
+    unlink(part_path);
+  } else {
+    cache_store(client, entry, output_path, &result);
+  }
+
+done:
+  if (result.state != SUCCESS) {
+    free(result.download_path);
+    result.download_path = NULL;
+  }
+  free(part_path);
+  free(probe.filename);
+  free(post_fields);
+  free(url);
+  return result;
+}
+
+DeleteResultT jirafeau_client_delete(JirafeauClientT *client,
+                                     const char *file_id,
+                                     const char *delete_key) {
+  struct JirafeauTransfer transfer = { 0 };
+  DeleteResultT           result;
+
+  jirafeau_transfer_init_delete(&transfer, file_id, delete_key);
+  result = perform_transfer(client, &transfer).delete;
+
+  /* don't hand out files that are gone anymore */
+  if (client->dedup_index && result.state != ERROR) {
+    jirafeau_dedup_forget(client->dedup_index, file_id);
+  }
+  return result;
+}
+
+/**
+ * Hands out a client for `host_url`, one that an earlier call left if there
+ * is one, so that a burst of calls goes over the same connection.
+ */
+static JirafeauClientT *host_client() {
+  JirafeauClientT *client = NULL;
+
+  pthread_mutex_lock(&host_url_lock);
+  while (!client && idle_count > 0) {
+    client = idle_clients[--idle_count];
+    if (!host_url || strcmp(client->host_url, host_url) != 0) {
+      jirafeau_client_free(client);
+      client = NULL;
+    }
+  }
+  if (!client) {
+    client = jirafeau_client_new(host_url);
+  }
+  if (client) {
+    jirafeau_client_set_download_cache(client, download_cache_dir,
+                                       download_cache_size);
+    jirafeau_client_set_compression(client, compression_level,
+                                    compression_workers);
+    jirafeau_client_set_decompression(client, decompress_downloads);
+    jirafeau_client_set_encryption(client, encryption_passphrase,
+                                   encryption_workers);
+    jirafeau_client_set_retry(client, retry_count, retry_delay_ms);
+  }
+  pthread_mutex_unlock(&host_url_lock);
+
+  return client;
+}
+
+static void release_host_client(JirafeauClientT *client) {
+  pthread_mutex_lock(&host_url_lock);
+  if (idle_count < IDLE_CLIENTS && host_url &&
+      strcmp(client->host_url, host_url) == 0) {
+    idle_clients[idle_count++] = client;
+    client = NULL;
+  }
+  pthread_mutex_unlock(&host_url_lock);
+
+  jirafeau_client_free(client);
+}
+
+UploadResultT jirafeau_upload(const char *file_path, const char *time,
+                              const char *upload_password,
+                              int one_time_download, const char *key,
+                              const char *filename) {
+  struct UploadResult result = { 0 };
+
+  JirafeauClientT *client = host_client();
+  if (!client) {
+    perror("`host_url` has not been defined previously to calling "
+           "jirafeau_upload\n");
+    result.state = ERROR;
+    return result;
+  }
+
+  result = jirafeau_client_upload(client, file_path, time, upload_password,
+                                  one_time_download, key, filename);
+  release_host_client(client);
+  return result;
+}
+
+UploadResultT jirafeau_upload_buffer(const void *data, size_t size,
+                                     const char *time,
+                                     const char *upload_password,
+                                     int one_time_download, const char *key,
+                                     const char *filename) {
+  struct UploadResult result = { 0 };
+
+  JirafeauClientT *client = host_client();
+  if (!client) {
+    perror("`host_url` has not been defined previously to calling "
+           "jirafeau_upload_buffer\n");
+    result.state = ERROR;
+    return result;
+  }
+
+  result = jirafeau_client_upload_buffer(client, data, size, time,
+                                         upload_password, one_time_download,
+                                         key, filename);
+  release_host_client(client);
+  return result;
+}
+
+DownloadResultT jirafeau_download(const char *file_id, const char *output_path,
+                                  const char *file_key, const char *crypt_key) {
+  struct DownloadResult result = { 0 };
+
+  JirafeauClientT *client = host_client();
+  if (client) {
+    result = jirafeau_client_download(client, file_id, output_path, file_key,
+                                      crypt_key);
+    release_host_client(client);
+  }
+  return result;
+}
+
+DeleteResultT jirafeau_delete(const char *file_id, const char *delete_key) {
+  struct DeleteResult result = { 0 };
+
+  JirafeauClientT *client = host_client();
+  if (client) {
+    result = jirafeau_client_delete(client, file_id, delete_key);
+    release_host_client(client);
+  }
   return result;
 }
@@ -0,0 +1,610 @@
+#ifndef JIRAFEAU_PRIVATE_H
+#define JIRAFEAU_PRIVATE_H
+
+#include "jirafeau.h"
+#include <curl/curl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/**
+ * Growing buffer the answer of the server is collected in.
+ */
+struct MemoryStruct {
+  char * memory;
+  size_t size;
+};
+
+/**
+ * Streaming zstd stages, see compress.c.
+ */
+struct Compressor;
+struct Decompressor;
+
+/**
+ * Streaming AES-256-GCM stages, see encrypt.c.
+ */
+struct Encryptor;
+struct Decryptor;
+
+/**
+ * Streaming SHA-256 of data that passes by in order, but may pass by again
+ * when a request is repeated, see dedup.c.
+ */
+struct Digest;
+
+/**
+ * Thread that writes a download to its file in large blocks, see writer.c.
+ */
+struct Writer;
+
+/**
+ * Where a Compressor pulls its input from.
+ *
+ * @return Number of bytes put into `buffer`, 0 at the end or
+ * CURL_READFUNC_ABORT
+ */
+typedef size_t (*JirafeauSourceFunction)(char *buffer, size_t size,
+                                         void *arg);
+
+/**
+ * Where a Decompressor pushes its output to.
+ *
+ * @return false to abort
+ */
+typedef bool (*JirafeauSinkFunction)(const char *data, size_t size,
+                                     void *arg);
+
+/**
+ * What is known about the response a DownloadContext receives.
+ */
+enum ResponseKind {
+  RESPONSE_HEADERS,    /* headers still coming in */
+  RESPONSE_DATA,       /* the file, body goes straight to the output */
+  RESPONSE_PAGE,       /* a page of Jirafeau, collecting its start */
+  RESPONSE_CLASSIFIED, /* the page has been looked at */
+  RESPONSE_IGNORED,    /* nothing left to fetch, the body is dropped */
+};
+
+/**
+ * Where a download is written to, handed to the curl callbacks through
+ * CURLOPT_WRITEDATA and CURLOPT_HEADERDATA. Either `write_callback` is set
+ * or the file to write is taken from `output_dir` and the Content-Disposition
+ * header or `output_file_path`. Files are written to `part_path` and renamed
+ * once complete. Deletes use it without any output.
+ */
+struct DownloadContext {
+  char *                output_dir;
+  char *                output_file_path;
+  char *                part_path;
+  FILE *                output_file;
+  JirafeauWriteCallback write_callback;
+  void *                write_userdata;
+  Status                state;
+
+  /* set up once the filename shows the file is compressed or encrypted */
+  bool                 decompress;
+  struct Decompressor *decompressor;
+  const char *         passphrase; /* owned by the client */
+  struct Decryptor *   decryptor;
+
+  long              status;
+  bool              attachment;
+  enum ResponseKind response;
+  char *            lookahead;
+  size_t            lookahead_size;
+
+  /*
+   * Bytes of the file passed on so far. A retry asks for the rest with a
+   * range starting at `resume_from`, and skips what a server that ignores
+   * the range sends again.
+   */
+  curl_off_t received;
+  curl_off_t resume_from;
+  curl_off_t skip;
+  curl_off_t range_total; /* of a 416 answer, -1 if unknown */
+
+  /*
+   * Part of the file a range download asks for: `range_length` bytes (0 for
+   * the rest of the file) from `range_offset` on, passed on undecoded.
+   */
+  curl_off_t range_offset;
+  curl_off_t range_length;
+
+  /* hash of what went to the output, `written` bytes after decoding */
+  struct Digest *digest;
+  curl_off_t     written;
+
+  /*
+   * A file gets a writer thread with `write_queue` blocks on the first
+   * write. It reserves the space of the `content_length` of the response
+   * (-1 if unknown) if the data is written as it comes.
+   */
+  long           receive_buffer; /* CURLOPT_BUFFERSIZE, 0 for curl's */
+  int            write_queue;
+  bool           direct_io;
+  struct Writer *writer;
+  curl_off_t     content_length;
+};
+
+/**
+ * A single upload, download or delete request. The blocking functions keep
+ * it on the stack, JirafeauMultiT queues them.
+ */
+struct JirafeauTransfer {
+  Operation              operation;
+  CURL *                 curl;
+  curl_mime *            mime;
+  char *                 url;
+  char *                 post_fields;
+  struct curl_slist *    headers;
+  struct MemoryStruct    body;
+  struct DownloadContext download;
+  int                    attempt; /* number of retries done */
+  TransferMetricsT       metrics; /* of the attempts before the last one */
+
+  /* copies of the arguments of the operation */
+  char *file_path;
+  char *time;
+  char *upload_password;
+  int   one_time_download;
+  char *key;
+  char *filename;
+  char *file_id;
+  char *output_path;
+  char *file_key;
+  char *crypt_key;
+  char *delete_key;
+
+  /* uploads read from here instead of `file_path` if set */
+  JirafeauReadCallback read_callback;
+  void *               read_userdata;
+  const char *         buffer;
+  curl_off_t           buffer_size;
+  curl_off_t           buffer_position;
+
+  /* compress the upload with zstd on the fly if the level is not 0 */
+  int                compression_level;
+  int                compression_workers;
+  struct Compressor *compressor;
+  FILE *             source_file;
+
+  /* encrypt the upload (after compressing it) if there is a passphrase */
+  const char *      passphrase; /* owned by the client */
+  int               encryption_workers;
+  struct Encryptor *encryptor;
+
+  /* `filename` with the suffixes of the compression and encryption */
+  char *encoded_filename;
+
+  /*
+   * Hash of the content of an upload, taken as it is read. `source_position`
+   * is where the next read of a file or stream starts, `sha256` is set
+   * instead if the hash was known before the upload.
+   */
+  struct Digest *digest;
+  curl_off_t     source_position;
+  char           sha256[JIRAFEAU_SHA256_HEX_SIZE];
+
+  /* only used by JirafeauMultiT */
+  JirafeauCallback         callback;
+  void *                   userdata;
+  struct JirafeauTransfer *next;
+  Priority                 priority;
+  curl_off_t               max_speed;
+  curl_off_t               speed; /* share of the multi's limit, 0 for none */
+  curl_off_t               retry_at; /* monotonic ms, queued until then */
+};
+
+/**
+ * Initializes libcurl, safe to call from any thread and any number of times.
+ */
+void jirafeau_global_init(void);
+
+/**
+ * Sets the options every easy handle of the library gets.
+ */
+void jirafeau_set_common_options(CURL *curl);
+
+void jirafeau_transfer_init_upload(struct JirafeauTransfer *transfer,
+                                   const char *file_path, const char *time,
+                                   const char *upload_password,
+                                   int one_time_download, const char *key,
+                                   const char *filename);
+
+void jirafeau_transfer_init_download(struct JirafeauTransfer *transfer,
+                                     const char *file_id,
+                                     const char *output_path,
+                                     const char *file_key,
+                                     const char *crypt_key);
+
+void jirafeau_transfer_init_delete(struct JirafeauTransfer *transfer,
+                                   const char *file_id,
+                                   const char *delete_key);
+
+/**
+ * Sets up `curl` for the transfer.
+ *
+ * @return false if the transfer can't be started (e.g. the output file can't
+ * be opened), jirafeau_transfer_finish then reports an error.
+ */
+bool jirafeau_transfer_prepare(struct JirafeauTransfer *transfer, CURL *curl,
+                               const char *host_url);
+
+/**
+ * Fills `result` once curl is done with the transfer.
+ *
+ * @param res Result of the curl transfer
+ */
+void jirafeau_transfer_finish(struct JirafeauTransfer *transfer, CURLcode res,
+                              OperationResultT *result);
+
+/**
+ * Frees everything the transfer holds except its curl handle.
+ */
+void jirafeau_transfer_release(struct JirafeauTransfer *transfer);
+
+/**
+ * Whether a request that ended with `res` and the HTTP `status` may
+ * succeed when it is sent again, e.g. after a dropped connection or a 503.
+ */
+bool jirafeau_is_transient(CURLcode res, long status);
+
+/**
+ * Exponential backoff with jitter: a random time between half and all of
+ * `delay_ms` doubled for every earlier retry, capped at
+ * JIRAFEAU_MAX_RETRY_DELAY.
+ *
+ * @param retry Number of the retry, starting at 1
+ * @param delay_ms Delay before the first retry, 0 for
+ * JIRAFEAU_DEFAULT_RETRY_DELAY
+ * @return Milliseconds to wait
+ */
+long jirafeau_retry_delay(int retry, long delay_ms);
+
+/**
+ * Checks whether a finished attempt of a transfer should be repeated and if
+ * so, gets the transfer ready for jirafeau_transfer_prepare again. Downloads
+ * continue after the bytes they already have. Streamed uploads can't be
+ * sent twice and are never retried.
+ *
+ * @param res Result of the curl transfer
+ * @param retries How often the transfer may be repeated in total
+ * @param delay_ms See jirafeau_retry_delay
+ * @return Milliseconds to wait before the next attempt, -1 if the transfer
+ * is done and jirafeau_transfer_finish has to be called
+ */
+long jirafeau_transfer_retry(struct JirafeauTransfer *transfer, CURLcode res,
+                             int retries, long delay_ms);
+
+/**
+ * @return CLOCK_MONOTONIC in milliseconds
+ */
+curl_off_t jirafeau_now_ms(void);
+
+/**
+ * Whether the library has been built with zstd (JIRAFEAU_WITH_ZSTD).
+ */
+bool jirafeau_compression_supported(void);
+
+/**
+ * @param level zstd compression level
+ * @param workers Threads to compress with, 0 to compress inline
+ * @return NULL without zstd or on failure
+ */
+struct Compressor *jirafeau_compressor_new(int level, int workers);
+
+/**
+ * Fills `buffer` with compressed data of what `source` provides, in the
+ * shape of a CURLOPT_READFUNCTION.
+ *
+ * @return Bytes put into `buffer`, 0 once everything has been sent or
+ * CURL_READFUNC_ABORT
+ */
+size_t jirafeau_compressor_read(struct Compressor *c, char *buffer,
+                                size_t size, JirafeauSourceFunction source,
+                                void *arg);
+
+void jirafeau_compressor_free(struct Compressor *c);
+
+/**
+ * @return NULL without zstd or on failure
+ */
+struct Decompressor *jirafeau_decompressor_new(void);
+
+/**
+ * Decompresses the next part of the input and passes the output on.
+ *
+ * @return false if the data is corrupt or `sink` failed
+ */
+bool jirafeau_decompressor_write(struct Decompressor *d, const char *data,
+                                 size_t size, JirafeauSinkFunction sink,
+                                 void *arg);
+
+/**
+ * Whether the input ended at the end of a frame, false if it was cut off.
+ */
+bool jirafeau_decompressor_finished(const struct Decompressor *d);
+
+void jirafeau_decompressor_free(struct Decompressor *d);
+
+/**
+ * @param passphrase The key is derived from it with a random salt
+ * @param workers Threads that encrypt chunks ahead of the transfer, 0 to
+ * encrypt in the thread of the transfer
+ * @return NULL on failure
+ */
+struct Encryptor *jirafeau_encryptor_new(const char *passphrase, int workers);
+
+/**
+ * Fills `buffer` with the encrypted form of what `source` provides, in the
+ * shape of a CURLOPT_READFUNCTION.
+ *
+ * @return Bytes put into `buffer`, 0 once everything has been sent or
+ * CURL_READFUNC_ABORT
+ */
+size_t jirafeau_encryptor_read(struct Encryptor *e, char *buffer, size_t size,
+                               JirafeauSourceFunction source, void *arg);
+
+void jirafeau_encryptor_free(struct Encryptor *e);
+
+/**
+ * @return NULL on failure
+ */
+struct Decryptor *jirafeau_decryptor_new(const char *passphrase);
+
+/**
+ * Decrypts the next part of the input and passes every chunk on once it
+ * has been authenticated.
+ *
+ * @return false if the passphrase is wrong, the data is damaged or `sink`
+ * failed
+ */
+bool jirafeau_decryptor_write(struct Decryptor *d, const char *data,
+                              size_t size, JirafeauSinkFunction sink,
+                              void *arg);
+
+/**
+ * Authenticates and passes on the last chunk once the input is complete.
+ *
+ * @return false if the input was cut off or damaged
+ */
+bool jirafeau_decryptor_finish(struct Decryptor *d, JirafeauSinkFunction sink,
+                               void *arg);
+
+void jirafeau_decryptor_free(struct Decryptor *d);
+
+/**
+ * Starts a thread that writes what it is given to `fd`, which stays owned
+ * by the caller, from `offset` on. The data is collected in blocks of
+ * JIRAFEAU_WRITE_BUFFER_SIZE that end on a multiple of their size.
+ *
+ * @param queue Blocks that may wait for the thread before a write blocks
+ * @param direct Write the aligned blocks with O_DIRECT, if the file system
+ * supports it
+ * @return NULL on failure
+ */
+struct Writer *jirafeau_writer_new(int fd, curl_off_t offset, int queue,
+                                   bool direct);
+
+/**
+ * Copies `data` into the current block and queues the block once it is
+ * full, waiting while the queue is.
+ *
+ * @return false (with errno set) if this or an earlier write failed
+ */
+bool jirafeau_writer_write(struct Writer *w, const char *data, size_t size);
+
+/**
+ * Preallocates `size` bytes after what has been written so far, without
+ * changing the size of the file.
+ */
+void jirafeau_writer_reserve(struct Writer *w, curl_off_t size);
+
+/**
+ * Queues the current block even if it is not full and waits until
+ * everything is written.
+ *
+ * @return false (with errno set) if a write failed
+ */
+bool jirafeau_writer_flush(struct Writer *w);
+
+/**
+ * Stops the thread after the queued blocks, the current block is dropped.
+ */
+void jirafeau_writer_free(struct Writer *w);
+
+/**
+ * Hashes memory with SHA-256.
+ *
+ * @param hex Receives the digest as lowercase hex
+ * @return false if OpenSSL failed
+ */
+bool jirafeau_sha256_buffer(const void *data, size_t size,
+                            char hex[JIRAFEAU_SHA256_HEX_SIZE]);
+
+/**
+ * Hashes text fields with SHA-256 as one NUL separated text, so that no two
+ * combinations of fields hash alike. Used to derive the keys of the dedup
+ * index, the download cache and the upload journal.
+ *
+ * @param fields The fields, NULL counts as empty
+ * @param hex Receives the digest as lowercase hex, empty on failure
+ * @return false if OpenSSL failed
+ */
+bool jirafeau_sha256_fields(const char *const *fields, int count,
+                            char hex[JIRAFEAU_SHA256_HEX_SIZE]);
+
+/**
+ * Hashes the content of a file with SHA-256.
+ *
+ * @param hex Receives the digest as lowercase hex
+ * @return false if the file can't be read
+ */
+bool jirafeau_sha256_file(const char *path,
+                          char        hex[JIRAFEAU_SHA256_HEX_SIZE]);
+
+struct Digest *jirafeau_digest_new(void);
+
+/**
+ * Hashes the part of `data` that follows what has been hashed so far. What
+ * was hashed already is skipped, data after a gap is left out.
+ *
+ * @param offset Position of `data` in the content
+ */
+void jirafeau_digest_update(struct Digest *d, const void *data, size_t size,
+                            curl_off_t offset);
+
+/**
+ * Hashes the content of `fd` from where the digest stands up to `end`, for
+ * data that went by out of order or before the digest was there.
+ *
+ * @return false if the file can't be read
+ */
+bool jirafeau_digest_read(struct Digest *d, int fd, curl_off_t end);
+
+/**
+ * @return How much of the content has been hashed
+ */
+curl_off_t jirafeau_digest_position(const struct Digest *d);
+
+/**
+ * Ends the digest, no more data can be added afterwards.
+ *
+ * @param hex Receives the digest as lowercase hex
+ * @return false if OpenSSL failed or the digest was ended before
+ */
+bool jirafeau_digest_finish(struct Digest *d,
+                            char           hex[JIRAFEAU_SHA256_HEX_SIZE]);
+
+void jirafeau_digest_free(struct Digest *d);
+
+/**
+ * Derives the key an upload is stored under in the dedup index. Uploads
+ * only match if they send the same content to the same host under the same
+ * name and with the same download password.
+ *
+ * @param entry Receives the key, empty on failure
+ */
+void jirafeau_dedup_entry_key(const char *content_hash, const char *host_url,
+                              const char *filename, const char *key,
+                              char        entry[JIRAFEAU_SHA256_HEX_SIZE]);
+
+/**
+ * When an upload with the given `time` option (e.g. "week") done at `now`
+ * expires.
+ *
+ * @return The time, 0 for never or -1 if `time_name` is unknown
+ */
+time_t jirafeau_dedup_expiry(const char *time_name, time_t now);
+
+/**
+ * Looks for an entry that is still alive in the index.
+ *
+ * @return true if `result` has been filled from the index
+ */
+bool jirafeau_dedup_lookup(const char *index_path, const char *entry,
+                           UploadResultT *result);
+
+/**
+ * Appends a successful upload to the index, creating it if needed.
+ *
+ * @param time_name The `time` option the upload was done with
+ */
+void jirafeau_dedup_store(const char *index_path, const char *entry,
+                          const UploadResultT *result,
+                          const char *         time_name);
+
+/**
+ * Removes all entries of a file (e.g. after it was deleted) and the expired
+ * ones from the index.
+ */
+void jirafeau_dedup_forget(const char *index_path, const char *file_id);
+
+/**
+ * Derives the name of a download in the cache, from everything that selects
+ * the content on the server and whether it gets decompressed.
+ *
+ * @param entry Receives the name, empty on failure
+ */
+void jirafeau_cache_entry_key(const char *host_url, const char *file_id,
+                              const char *file_key, const char *crypt_key,
+                              bool        decompress,
+                              char        entry[JIRAFEAU_SHA256_HEX_SIZE]);
+
+/**
+ * The filename the server sent for a cached download.
+ *
+ * @return The name (to be freed) or NULL if it is not known
+ */
+char *jirafeau_cache_name(const char *cache_dir, const char *entry);
+
+/**
+ * The SHA-256 of a cached download, as it was when it was stored.
+ *
+ * @param hex Receives the digest, empty if it is not known
+ */
+void jirafeau_cache_sha256(const char *cache_dir, const char *entry,
+                           char        hex[JIRAFEAU_SHA256_HEX_SIZE]);
+
+/**
+ * Puts a cached download at `destination`, as reflink, hardlink or copy,
+ * and marks it as recently used.
+ *
+ * @return false if the entry is not in the cache or can't be delivered
+ */
+bool jirafeau_cache_deliver(const char *cache_dir, const char *entry,
+                            const char *destination);
+
+/**
+ * Adds a finished download to the cache and evicts the least recently used
+ * entries beyond `max_size` bytes.
+ *
+ * @param name Filename the server sent, NULL if unknown
+ * @param sha256 Digest of the download, NULL or empty if unknown
+ */
+void jirafeau_cache_store(const char *cache_dir, const char *entry,
+                          const char *source_path, const char *name,
+                          const char *sha256, curl_off_t max_size);
+
+/**
+ * Derives the name of the journal of a chunked upload, from everything
+ * that would make the server end up with a different file.
+ *
+ * @param st Status of the file, its identity, size and modification time
+ * are part of the name
+ * @param entry Receives the name, empty on failure
+ */
+void jirafeau_journal_entry_key(const char *host_url, const char *file_path,
+                                const struct stat *st, size_t chunk_size,
+                                const char *filename, const char *time,
+                                const char *upload_password,
+                                int one_time_download, const char *key,
+                                char entry[JIRAFEAU_SHA256_HEX_SIZE]);
+
+/**
+ * Reads the progress of an interrupted chunked upload.
+ *
+ * @param ref Receives the reference of the upload (to be freed)
+ * @param code Receives the code the next push has to present (to be freed)
+ * @param offset Receives the number of bytes the server has
+ * @return false if there is no usable journal
+ */
+bool jirafeau_journal_load(const char *journal_dir, const char *entry,
+                           char **ref, char **code, curl_off_t *offset);
+
+/**
+ * Records that the server has the first `offset` bytes of the upload. The
+ * journal is replaced atomically, a crash leaves the previous one.
+ */
+void jirafeau_journal_save(const char *journal_dir, const char *entry,
+                           const char *ref, const char *code,
+                           curl_off_t offset);
+
+/**
+ * Removes the journal once the upload is complete or can't be resumed.
+ */
+void jirafeau_journal_remove(const char *journal_dir, const char *entry);
+
+#endif // JIRAFEAU_PRIVATE_H
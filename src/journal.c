@@ -0,0 +1,123 @@
+#include "jirafeau_private.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char *journal_path(const char *journal_dir, const char *entry,
+                          const char *suffix) {
+  size_t size = strlen(journal_dir) + strlen(entry) + strlen(suffix) + 2;
+  char * path = malloc(size);
+
+  if (path) {
+    snprintf(path, size, "%s/%s%s", journal_dir, entry, suffix);
+  }
+  return path;
+}
+
+void jirafeau_journal_entry_key(const char *host_url, const char *file_path,
+                                const struct stat *st, size_t chunk_size,
+                                const char *filename, const char *time,
+                                const char *upload_password,
+                                int one_time_download, const char *key,
+                                char entry[JIRAFEAU_SHA256_HEX_SIZE]) {
+  char        identity[128];
+  char        once[16];
+  const char *fields[] = { host_url, file_path,       identity, filename,
+                           time,     upload_password, once,     key };
+
+  /* the file has to be the very same, not just one with the same path */
+  snprintf(identity, sizeof(identity), "%ju %ju %jd %jd.%09ld %zu",
+           (uintmax_t)st->st_dev, (uintmax_t)st->st_ino,
+           (intmax_t)st->st_size, (intmax_t)st->st_mtim.tv_sec,
+           st->st_mtim.tv_nsec, chunk_size);
+  snprintf(once, sizeof(once), "%d", one_time_download);
+  jirafeau_sha256_fields(fields, 8, entry);
+}
+
+static char *read_line(FILE *file) {
+  char * line = NULL;
+  size_t size = 0;
+
+  if (getline(&line, &size, file) <= 0) {
+    free(line);
+    return NULL;
+  }
+  line[strcspn(line, "\n")] = '\0';
+  return line;
+}
+
+bool jirafeau_journal_load(const char *journal_dir, const char *entry,
+                           char **ref, char **code, curl_off_t *offset) {
+  char *path     = journal_path(journal_dir, entry, "");
+  FILE *file     = path ? fopen(path, "r") : NULL;
+  char *position = NULL;
+  char *end      = NULL;
+  bool  ok;
+
+  /* "REF\nCODE\nOFFSET\n" */
+  *ref  = file ? read_line(file) : NULL;
+  *code = file ? read_line(file) : NULL;
+  if (file) {
+    position = read_line(file);
+    fclose(file);
+  }
+
+  if (position) {
+    *offset = strtoll(position, &end, 10);
+  }
+  ok = *ref && (*ref)[0] && *code && (*code)[0] && position &&
+       end != position && *end == '\0' && *offset >= 0;
+
+  if (!ok) {
+    free(*ref);
+    free(*code);
+    *ref  = NULL;
+    *code = NULL;
+  }
+  free(position);
+  free(path);
+  return ok;
+}
+
+void jirafeau_journal_save(const char *journal_dir, const char *entry,
+                           const char *ref, const char *code,
+                           curl_off_t offset) {
+  char *path = journal_path(journal_dir, entry, "");
+  char *temp = journal_path(journal_dir, entry, ".XXXXXX");
+  int   fd   = -1;
+  bool  ok;
+
+  if (mkdir(journal_dir, 0700) == -1 && errno != EEXIST) {
+    perror("Error: Could not create the upload journal\n");
+    goto done;
+  }
+
+  /* mkstemp creates the file with mode 0600 */
+  if (!path || !temp || (fd = mkstemp(temp)) == -1) {
+    goto done;
+  }
+
+  ok = dprintf(fd, "%s\n%s\n%" CURL_FORMAT_CURL_OFF_T "\n", ref, code,
+               offset) > 0;
+  ok = close(fd) == 0 && ok && rename(temp, path) == 0;
+  if (!ok) {
+    unlink(temp);
+  }
+
+done:
+  free(temp);
+  free(path);
+}
+
+void jirafeau_journal_remove(const char *journal_dir, const char *entry) {
+  char *path = journal_path(journal_dir, entry, "");
+
+  if (path) {
+    unlink(path);
+  }
+  free(path);
+}
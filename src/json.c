@@ -0,0 +1,244 @@
+#include "json.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *skip_space(const char *p) {
+  while (isspace((unsigned char)*p)) {
+    p++;
+  }
+  return p;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+static char *put_utf8(char *out, unsigned long code) {
+  if (code < 0x80) {
+    *out++ = code;
+  } else if (code < 0x800) {
+    *out++ = 0xc0 | (code >> 6);
+    *out++ = 0x80 | (code & 0x3f);
+  } else if (code < 0x10000) {
+    *out++ = 0xe0 | (code >> 12);
+    *out++ = 0x80 | ((code >> 6) & 0x3f);
+    *out++ = 0x80 | (code & 0x3f);
+  } else {
+    *out++ = 0xf0 | (code >> 18);
+    *out++ = 0x80 | ((code >> 12) & 0x3f);
+    *out++ = 0x80 | ((code >> 6) & 0x3f);
+    *out++ = 0x80 | (code & 0x3f);
+  }
+  return out;
+}
+
+static const char *parse_hex4(const char *p, unsigned long *code) {
+  *code = 0;
+  for (int i = 0; i < 4; i++) {
+    int value = hex_value(p[i]);
+    if (value < 0) {
+      return NULL;
+    }
+    *code = *code * 16 + value;
+  }
+  return p + 4;
+}
+
+/**
+ * Parses the string starting at the opening quote `p`.
+ *
+ * @return Pointer behind the closing quote or NULL on a syntax error
+ */
+static const char *parse_string(const char *p, char **value) {
+  const char *end = p + 1;
+
+  /* the unescaped string is never longer than the escaped one */
+  while (*end && *end != '"') {
+    end += *end == '\\' && end[1] ? 2 : 1;
+  }
+  if (*end != '"') {
+    return NULL;
+  }
+
+  char *out = malloc(end - p);
+  char *w   = out;
+
+  if (!out) {
+    return NULL;
+  }
+  for (p++; p < end; p++) {
+    if (*p != '\\') {
+      *w++ = *p;
+      continue;
+    }
+
+    unsigned long code;
+    switch (*++p) {
+    case 'b':
+      *w++ = '\b';
+      break;
+    case 'f':
+      *w++ = '\f';
+      break;
+    case 'n':
+      *w++ = '\n';
+      break;
+    case 'r':
+      *w++ = '\r';
+      break;
+    case 't':
+      *w++ = '\t';
+      break;
+    case 'u':
+      if (!(p = parse_hex4(p + 1, &code))) {
+        free(out);
+        return NULL;
+      }
+      if (code >= 0xd800 && code < 0xdc00 && p[0] == '\\' && p[1] == 'u') {
+        unsigned long low;
+        if (parse_hex4(p + 2, &low) && low >= 0xdc00 && low < 0xe000) {
+          code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+          p   += 6;
+        }
+      }
+      w = put_utf8(w, code);
+      p--;
+      break;
+    default:
+      *w++ = *p;
+      break;
+    }
+  }
+  *w     = '\0';
+  *value = out;
+
+  return end + 1;
+}
+
+int json_parse_object(const char *text, JsonFieldT *fields, int max_fields) {
+  const char *p     = skip_space(text);
+  int         count = 0;
+
+  if (*p++ != '{') {
+    return -1;
+  }
+
+  p = skip_space(p);
+  if (*p == '}') {
+    return *skip_space(p + 1) ? -1 : 0;
+  }
+
+  while (count < max_fields) {
+    char *key   = NULL;
+    char *value = NULL;
+
+    p = skip_space(p);
+    if (*p != '"' || !(p = parse_string(p, &key))) {
+      break;
+    }
+
+    p = skip_space(p);
+    if (*p++ != ':') {
+      free(key);
+      break;
+    }
+
+    p = skip_space(p);
+    if (*p == '"') {
+      p = parse_string(p, &value);
+    } else if (*p && !strchr("{[,}", *p)) {
+      const char *start = p;
+      while (*p && !isspace((unsigned char)*p) && *p != ',' && *p != '}') {
+        p++;
+      }
+      if (p - start != 4 || strncmp(start, "null", 4) != 0) {
+        value = strndup(start, p - start);
+      }
+    } else {
+      p = NULL;
+    }
+    if (!p) {
+      free(key);
+      break;
+    }
+
+    fields[count].key   = key;
+    fields[count].value = value;
+    count++;
+
+    p = skip_space(p);
+    if (*p == ',') {
+      p++;
+      continue;
+    }
+    if (*p == '}' && !*skip_space(p + 1)) {
+      return count;
+    }
+    break;
+  }
+
+  json_free_fields(fields, count);
+  return -1;
+}
+
+void json_free_fields(JsonFieldT *fields, int count) {
+  for (int i = 0; i < count; i++) {
+    free(fields[i].key);
+    free(fields[i].value);
+  }
+}
+
+const char *json_get(const JsonFieldT *fields, int count, const char *key) {
+  for (int i = 0; i < count; i++) {
+    if (strcmp(fields[i].key, key) == 0) {
+      return fields[i].value;
+    }
+  }
+  return NULL;
+}
+
+void json_print_string(FILE *out, const char *value) {
+  if (!value) {
+    fputs("null", out);
+    return;
+  }
+
+  fputc('"', out);
+  for (const unsigned char *c = (const unsigned char *)value; *c; c++) {
+    switch (*c) {
+    case '"':
+      fputs("\\\"", out);
+      break;
+    case '\\':
+      fputs("\\\\", out);
+      break;
+    case '\n':
+      fputs("\\n", out);
+      break;
+    case '\r':
+      fputs("\\r", out);
+      break;
+    case '\t':
+      fputs("\\t", out);
+      break;
+    default:
+      if (*c < 0x20) {
+        fprintf(out, "\\u%04x", *c);
+      } else {
+        fputc(*c, out);
+      }
+      break;
+    }
+  }
+  fputc('"', out);
+}
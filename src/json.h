@@ -0,0 +1,44 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdio.h>
+
+/**
+ * Key and value of a member of a flat JSON object. Strings are unescaped,
+ * numbers and booleans are kept as written and `null` is a NULL value.
+ */
+typedef struct JsonField {
+  char *key;
+  char *value;
+} JsonFieldT;
+
+/**
+ * Parses a JSON object whose values are all strings, numbers, booleans or
+ * null (no nested objects or arrays).
+ *
+ * @param text The JSON text
+ * @param fields Array the members are stored in
+ * @param max_fields Size of `fields`
+ * @return Number of members or -1 if the text is no such object, free the
+ * members with json_free_fields
+ */
+int json_parse_object(const char *text, JsonFieldT *fields, int max_fields);
+
+/**
+ * Frees the members returned by json_parse_object.
+ */
+void json_free_fields(JsonFieldT *fields, int count);
+
+/**
+ * Looks up the value of a member.
+ *
+ * @return The value or NULL if there is no such member
+ */
+const char *json_get(const JsonFieldT *fields, int count, const char *key);
+
+/**
+ * Writes `value` as a quoted and escaped JSON string, `null` for NULL.
+ */
+void json_print_string(FILE *out, const char *value);
+
+#endif // JSON_H
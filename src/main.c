@@ -1,8 +1,14 @@
+#include "agent.h"
+#include "batch.h"
+#include "bundle.h"
 #include "jirafeau.h"
+#include "recursive.h"
+#include "watch.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 void show_help() {
@@ -11,20 +17,166 @@ void show_help() {
   printf("  jirafeau <host> <command> [options]:\n");
   printf("\n");
   printf("Commands:\n");
-  printf("  upload <file> [options]\n");
+  printf("  upload <file|-|-R dir> [options]\n");
   printf("    -t, --time [minute|hour|day|week|fornight|(month)]\n");
   printf("    -o, --one-time-download\n");
   printf("    -k, --key [key]\n");
   printf("    -u, --upload-password [password]\n");
   printf("    -r, --randomised-name\n");
+  printf("    -m, --mmap (send the file from a memory mapping)\n");
+  printf("    -R, --recursive [dir] (upload every file below dir, prints an "
+         "NDJSON manifest)\n");
+  printf("    -j, --jobs [n] (concurrent uploads with -R, default 8)\n");
+  printf("    --multiplex (share one HTTP/2 connection with -R)\n");
+  printf("    --bundle [index] (send -R as one tar archive, writes the "
+         "member index)\n");
+  printf("    --limit-rate [KiB/s] (cap the bandwidth)\n");
+  printf("    --retry [n] (repeat failed requests up to n times)\n");
+  printf("    --journal [dir] (resume interrupted chunked uploads)\n");
+  printf("    -C, --chunk-size [MiB] (upload in chunks, for files larger than "
+         "the server's upload limit)\n");
+  printf("    -d, --dedup-index [path] (don't upload content that is "
+         "already on the server again)\n");
+  printf("    -z, --zstd [level] (compress with zstd while uploading, "
+         "default level 3)\n");
+  printf("    --zstd-workers [n] (compress with n threads)\n");
+  printf("    -e, --encrypt [passphrase-file] (encrypt with AES-256-GCM "
+         "before uploading)\n");
+  printf("    --encrypt-workers [n] (encrypt with n threads, default 2)\n");
+  printf("    --sha256 [hex] (fail if the content has another SHA-256)\n");
+  printf("    --stats (print timings and throughput as JSON to stderr)\n");
   printf("\n");
   printf("  download <file_id> [options]\n");
   printf("    -k, --key [key]\n");
   printf("    -c, --crypt-key [crypt-key]\n");
-  printf("    -o, --output-file [output-file]\n");
+  printf("    -o, --output-file [output-file|-]\n");
+  printf("    -s, --segments [n] (download n ranges in parallel)\n");
+  printf("    --member [path] (fetch one member of an archive sent with "
+         "--bundle)\n");
+  printf("    --index [path] (the index written by --bundle)\n");
+  printf("    --cache-dir [dir] (serve repeated downloads from a local "
+         "cache)\n");
+  printf("    --cache-size [MiB] (default 1024)\n");
+  printf("    -z, --zstd (decompress files uploaded with --zstd)\n");
+  printf("    -e, --decrypt [passphrase-file] (decrypt files uploaded with "
+         "--encrypt)\n");
+  printf("    --limit-rate [KiB/s]\n");
+  printf("    --sha256 [hex] (fail if the file has another SHA-256)\n");
+  printf("    --retry [n] (repeat failed requests, continuing after what "
+         "arrived)\n");
+  printf("    --buffer-size [KiB] (read this much from the socket at once)\n");
+  printf("    --write-queue [n] (MiB the disk may lag behind, default 4, 0 "
+         "writes inline)\n");
+  printf("    --direct (write with O_DIRECT, past the page cache)\n");
+  printf("    --stats\n");
   printf("\n");
-  printf("  delete <file_id> <delete_key>\n");
+  printf("  delete <file_id> <delete_key> [options]\n");
+  printf("    -d, --dedup-index [path] (forget the file in the index)\n");
+  printf("    --retry [n]\n");
+  printf("    --stats\n");
   printf("\n");
+  printf("  batch [manifest|-] [options]\n");
+  printf("    -j, --jobs [n] (concurrent transfers, default 8)\n");
+  printf("    --limit-rate [KiB/s] (cap the bandwidth of all transfers "
+         "together)\n");
+  printf("    --retry [n]\n");
+  printf("    --multiplex (share one HTTP/2 connection)\n");
+  printf("    --buffer-size [KiB]\n");
+  printf("    --write-queue [n]\n");
+  printf("    --direct\n");
+  printf("\n");
+  printf("  watch <dir> [options] (upload files as they are written, prints "
+         "an NDJSON line per upload)\n");
+  printf("    --state [path] (what was uploaded, default "
+         "<dir>/.jirafeau-watch)\n");
+  printf("    --debounce [ms] (wait until a file is left alone, default "
+         "500)\n");
+  printf("    -j, --jobs [n] (concurrent uploads, default 8)\n");
+  printf("    -t, -o, -k, -u, --limit-rate, --retry, --multiplex (as for "
+         "upload)\n");
+  printf("\n");
+  printf("  agent [options] (serve the commands above with warm connections, "
+         "see README)\n");
+  printf("    --socket [path] (default "
+         "$XDG_RUNTIME_DIR/jirafeau-agent.sock)\n");
+  printf("\n");
+}
+
+static size_t read_stdin(char *buffer, size_t size, void *userdata) {
+  size_t n = fread(buffer, 1, size, stdin);
+
+  if (n == 0 && ferror(stdin)) {
+    return JIRAFEAU_READ_ABORT;
+  }
+  return n;
+}
+
+static int write_stdout(const char *data, size_t size, void *userdata) {
+  return fwrite(data, 1, size, stdout) == size ? 0 : 1;
+}
+
+/**
+ * Reads the passphrase from the first line of a file, so that it does not
+ * show up in the process list.
+ */
+static char *read_passphrase(const char *path) {
+  FILE * file       = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  char * passphrase = NULL;
+  size_t size       = 0;
+
+  if (!file || getline(&passphrase, &size, file) <= 0) {
+    perror("Error: Could not read the passphrase\n");
+    exit(EXIT_FAILURE);
+  }
+  if (file != stdin) {
+    fclose(file);
+  }
+
+  passphrase[strcspn(passphrase, "\r\n")] = '\0';
+  if (!passphrase[0]) {
+    fprintf(stderr, "Error: The passphrase is empty\n");
+    exit(EXIT_FAILURE);
+  }
+  return passphrase;
+}
+
+static void print_stats(const char *operation, const TransferMetricsT *m) {
+  fprintf(stderr,
+          "{\"operation\":\"%s\",\"requests\":%ld,"
+          "\"new_connections\":%ld,"
+          "\"namelookup_us\":%" CURL_FORMAT_CURL_OFF_T ","
+          "\"connect_us\":%" CURL_FORMAT_CURL_OFF_T ","
+          "\"appconnect_us\":%" CURL_FORMAT_CURL_OFF_T ","
+          "\"pretransfer_us\":%" CURL_FORMAT_CURL_OFF_T ","
+          "\"starttransfer_us\":%" CURL_FORMAT_CURL_OFF_T ","
+          "\"total_us\":%" CURL_FORMAT_CURL_OFF_T ","
+          "\"bytes_uploaded\":%" CURL_FORMAT_CURL_OFF_T ","
+          "\"bytes_downloaded\":%" CURL_FORMAT_CURL_OFF_T ","
+          "\"upload_bytes_per_sec\":%" CURL_FORMAT_CURL_OFF_T ","
+          "\"download_bytes_per_sec\":%" CURL_FORMAT_CURL_OFF_T "}\n",
+          operation, m->requests, m->new_connections, m->namelookup,
+          m->connect, m->appconnect, m->pretransfer, m->starttransfer,
+          m->total, m->bytes_uploaded, m->bytes_downloaded, m->upload_speed,
+          m->download_speed);
+}
+
+/**
+ * Exits with an error if the SHA-256 of the transfer is not the expected
+ * one, does nothing if none is expected.
+ */
+static void verify_sha256(const char *expected, const char *sha256) {
+  if (!expected) {
+    return;
+  }
+  if (!sha256[0]) {
+    fprintf(stderr, "Error: The SHA-256 could not be determined\n");
+    exit(EXIT_FAILURE);
+  }
+  if (strcasecmp(expected, sha256) != 0) {
+    fprintf(stderr, "Error: SHA-256 mismatch, expected %s, got %s\n",
+            expected, sha256);
+    exit(EXIT_FAILURE);
+  }
 }
 
 static void random_string(char *str, size_t len) {
@@ -37,6 +189,55 @@ static void random_string(char *str, size_t len) {
   str[len] = '\0';
 }
 
+/**
+ * Prints the links and keys of an upload, or exits if it failed.
+ */
+static void report_upload(const UploadResultT *result, const char *sha256) {
+  if (result->state == SUCCESS) {
+    char *host_url = jirafeau_get_host();
+
+    int   len      = strlen(host_url) + strlen(result->file_id) + 10;
+    char *file_url = (char *)malloc(len);
+    snprintf(file_url, len, "%s/f.php?h=%s", host_url, result->file_id);
+
+    if (isatty(STDOUT_FILENO)) {
+      printf("\033[1;32mURL\033[0m          %s\n", file_url);
+      printf("\033[1;34mPreview URL\033[0m  %s&p=1\n", file_url);
+      printf("\033[1;35mDownload URL\033[0m %s&d=1\n", file_url);
+      printf("\033[1;31mDelete URL\033[0m   %s&d=%s\n", file_url,
+             result->delete_key);
+      printf("\n");
+      printf("\033[1;36mFile ID\033[0m      %s\n", result->file_id);
+      printf("\033[1;33mDelete Key\033[0m   %s\n", result->delete_key);
+      if (result->crypt_key) {
+        printf("\033[1;37mCrypt Key\033[0m    %s\n", result->crypt_key);
+      }
+      if (result->sha256[0]) {
+        printf("\033[1;37mSHA-256\033[0m      %s\n", result->sha256);
+      }
+    } else {
+      printf("{\"host\": \"%s\", "
+             "\"file_url\": \"%s\", "
+             "\"file_preview_url\": \"%s&p=1\", "
+             "\"file_download_url\": \"%s&d=1\", "
+             "\"file_delete_url\": \"%s&d=%s\", "
+             "\"file_id\":\"%s\",\"delete_key\":\"%s\",\"crypt_key\":\"%s\","
+             "\"sha256\":\"%s\"}\n",
+             host_url, file_url, file_url, file_url, file_url,
+             result->delete_key, result->file_id, result->delete_key,
+             result->crypt_key ? result->crypt_key : "", result->sha256);
+    }
+
+    free(file_url);
+    free(host_url);
+    /* the file is on the server, but not with the expected content */
+    verify_sha256(sha256, result->sha256);
+  } else {
+    printf("Upload failed.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
 void subcommand_upload(int argc, char *argv[]) {
   char *        file_path         = argv[3];
   char *        time              = "month";
@@ -44,6 +245,23 @@ void subcommand_upload(int argc, char *argv[]) {
   char *        key               = NULL;
   int           one_time_download = 0;
   char *        filename          = NULL;
+  size_t        chunk_size        = 0;
+  int           use_mmap          = 0;
+  int           stats             = 0;
+  char *        dedup_index       = NULL;
+  int           zstd_level        = 0;
+  int           zstd_workers      = 0;
+  char *        passphrase        = NULL;
+  int           encrypt_workers   = JIRAFEAU_DEFAULT_ENCRYPTION_WORKERS;
+  char *        recursive_dir     = NULL;
+  char *        bundle_index      = NULL;
+  int           jobs              = 8;
+  curl_off_t    rate              = 0;
+  int           retries           = 0;
+  int           multiplex         = 0;
+  char *        journal_dir       = NULL;
+  char *        sha256            = NULL;
+  int           failures          = 0;
   UploadResultT result;
 
   for (int i = 3; i < argc; i++) {
@@ -68,6 +286,9 @@ void subcommand_upload(int argc, char *argv[]) {
         char random_stem[10];
         random_string(random_stem, 9);
         char *extension = strrchr(file_path, '.');
+        if (!extension) {
+          extension = "";
+        }
         filename = (char *)malloc(strlen(extension) + 10 + 1);
         snprintf(filename, strlen(extension) + 10 + 1, "%s%s", random_stem,
                  extension);
@@ -102,52 +323,227 @@ void subcommand_upload(int argc, char *argv[]) {
         perror("Missing value for -u/--upload-password\n");
         exit(EXIT_FAILURE);
       }
+    } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mmap") == 0) {
+      use_mmap = 1;
+    } else if (strcmp(argv[i], "-R") == 0 ||
+               strcmp(argv[i], "--recursive") == 0) {
+      if (i + 1 < argc) {
+        recursive_dir = argv[++i];
+      } else {
+        perror("Missing value for -R/--recursive\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--bundle") == 0) {
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        bundle_index = argv[++i];
+      } else {
+        perror("Missing value for --bundle\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        jobs = atoi(argv[++i]);
+      } else {
+        perror("Missing value for -j/--jobs\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--limit-rate") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        rate = (curl_off_t)atoi(argv[++i]) * 1024;
+      } else {
+        perror("Missing value for --limit-rate\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--retry") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+        retries = atoi(argv[++i]);
+      } else {
+        perror("Missing value for --retry\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--journal") == 0) {
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        journal_dir = argv[++i];
+      } else {
+        perror("Missing value for --journal\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--multiplex") == 0) {
+      multiplex = 1;
+    } else if (strcmp(argv[i], "--sha256") == 0) {
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        sha256 = argv[++i];
+      } else {
+        perror("Missing value for --sha256\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "-C") == 0 ||
+               strcmp(argv[i], "--chunk-size") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        chunk_size = (size_t)atoi(argv[++i]) * 1024 * 1024;
+      } else {
+        perror("Missing value for -C/--chunk-size\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "-d") == 0 ||
+               strcmp(argv[i], "--dedup-index") == 0) {
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        dedup_index = argv[++i];
+      } else {
+        perror("Missing value for -d/--dedup-index\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "-z") == 0 ||
+               strcmp(argv[i], "--zstd") == 0) {
+      zstd_level = JIRAFEAU_DEFAULT_COMPRESSION_LEVEL;
+      /* the level is optional */
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        zstd_level = atoi(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "--zstd-workers") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        zstd_workers = atoi(argv[++i]);
+      } else {
+        perror("Missing value for --zstd-workers\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "-e") == 0 ||
+               strcmp(argv[i], "--encrypt") == 0) {
+      if (i + 1 < argc) {
+        passphrase = read_passphrase(argv[++i]);
+      } else {
+        perror("Missing value for -e/--encrypt\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--encrypt-workers") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+        encrypt_workers = atoi(argv[++i]);
+      } else {
+        perror("Missing value for --encrypt-workers\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = 1;
     }
   }
 
-  if (filename) {
-    result = jirafeau_upload(file_path, time, upload_password,
-                             one_time_download, key, filename);
+  if (bundle_index && !recursive_dir) {
+    fprintf(stderr, "Error: --bundle needs -R\n");
+    exit(EXIT_FAILURE);
+  }
+  if (bundle_index) {
+    /* the index points into the archive as it is stored */
+    if (dedup_index || zstd_level || passphrase || chunk_size || use_mmap) {
+      fprintf(stderr, "Error: bundles are sent as they are, -d, -z, -e, -C "
+                      "and -m don't apply\n");
+      exit(EXIT_FAILURE);
+    }
+  } else if (recursive_dir) {
+    if (dedup_index || zstd_level || passphrase || chunk_size || use_mmap) {
+      fprintf(stderr, "WARNING: -R uploads every file as it is, -d, -z, -e, "
+                      "-C and -m are ignored\n");
+    }
+    if (upload_recursive(recursive_dir, jobs, rate, retries, multiplex, time,
+                         upload_password, one_time_download, key)) {
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
+  /* a running agent does plain uploads without starting from scratch */
+  if (!chunk_size && !use_mmap && !dedup_index && !zstd_level &&
+      !passphrase && !rate && !retries && !journal_dir && !stats &&
+      !bundle_index &&
+      agent_upload(file_path, time, upload_password, one_time_download, key,
+                   filename, &result)) {
+    report_upload(&result, sha256);
+    return;
+  }
+
+  char *           host   = jirafeau_get_host();
+  JirafeauClientT *client = jirafeau_client_new(host);
+  free(host);
+  if (!client) {
+    perror("Could not set up the connection\n");
+    exit(EXIT_FAILURE);
+  }
+  if (dedup_index) {
+    jirafeau_client_set_dedup_index(client, dedup_index);
+  }
+  jirafeau_client_set_max_speed(client, rate);
+  jirafeau_client_set_retry(client, retries, 0);
+  if (journal_dir) {
+    jirafeau_client_set_upload_journal(client, journal_dir);
+  }
+  if (zstd_level &&
+      jirafeau_client_set_compression(client, zstd_level, zstd_workers) != 0) {
+    fprintf(stderr, "Error: jirafeau was built without zstd\n");
+    exit(EXIT_FAILURE);
+  }
+  if (zstd_level && chunk_size) {
+    fprintf(stderr, "WARNING: chunked uploads are sent uncompressed\n");
+  }
+  if (passphrase && chunk_size) {
+    fprintf(stderr, "Error: chunked uploads can't be encrypted\n");
+    exit(EXIT_FAILURE);
+  }
+  if (passphrase) {
+    jirafeau_client_set_encryption(client, passphrase, encrypt_workers);
+  }
+
+  if (bundle_index) {
+    result = upload_bundle(client, recursive_dir, bundle_index, time,
+                           upload_password, one_time_download, key, &failures);
+  } else if (strcmp(file_path, "-") == 0) {
+    result = jirafeau_client_upload_callback(client, read_stdin, NULL, time,
+                                             upload_password,
+                                             one_time_download, key, filename);
+  } else if (chunk_size) {
+    result = jirafeau_client_upload_chunked(client, file_path, time,
+                                            upload_password, one_time_download,
+                                            key, filename, chunk_size);
+  } else if (use_mmap) {
+    result = jirafeau_client_upload_mmap(client, file_path, time,
+                                         upload_password, one_time_download,
+                                         key, filename);
   } else {
-    jirafeau_upload(file_path, time, upload_password, one_time_download, key,
-                    filename);
+    result = jirafeau_client_upload(client, file_path, time, upload_password,
+                                    one_time_download, key, filename);
   }
+  jirafeau_client_free(client);
 
-  if (result.state == SUCCESS) {
-    char *host_url = jirafeau_get_host();
+  if (stats) {
+    print_stats("upload", &result.metrics);
+  }
 
-    int   len      = strlen(host_url) + strlen(result.file_id) + 10;
-    char *file_url = (char *)malloc(len);
-    snprintf(file_url, len, "%s/f.php?h=%s", host_url, result.file_id);
+  report_upload(&result, sha256);
+  if (failures) {
+    exit(EXIT_FAILURE);
+  }
+}
 
-    if (isatty(STDOUT_FILENO)) {
-      printf("\033[1;32mURL\033[0m          %s\n", file_url);
-      printf("\033[1;34mPreview URL\033[0m  %s&p=1\n", file_url);
-      printf("\033[1;35mDownload URL\033[0m %s&d=1\n", file_url);
-      printf("\033[1;31mDelete URL\033[0m   %s&d=%s\n", file_url,
-             result.delete_key);
-      printf("\n");
-      printf("\033[1;36mFile ID\033[0m      %s\n", result.file_id);
-      printf("\033[1;33mDelete Key\033[0m   %s\n", result.delete_key);
-      if (result.crypt_key) {
-        printf("\033[1;37mCrypt Key\033[0m    %s\n", result.crypt_key);
-      }
-    } else {
-      printf("{\"host\": \"%s\", "
-             "\"file_url\": \"%s\", "
-             "\"file_preview_url\": \"%s&p=1\", "
-             "\"file_download_url\": \"%s&d=1\", "
-             "\"file_delete_url\": \"%s&d=%s\", "
-             "\"file_id\":\"%s\",\"delete_key\":\"%s\",\"crypt_key\":\"%s\"}\n",
-             host_url, file_url, file_url, file_url, file_url,
-             result.delete_key, result.file_id, result.delete_key,
-             result.crypt_key ? result.crypt_key : "");
-    }
+/**
+ * Prints where a download went, or exits if it failed.
+ */
+static void report_download(const DownloadResultT *result,
+                            const char *           sha256) {
+  switch (result->state) {
+  case ERROR:
+    perror("An error occurred\n");
+    exit(EXIT_FAILURE);
+    break;
 
-    free(file_url);
-  } else {
-    printf("Upload failed.\n");
+  case FILE_NOT_FOUND:
+    perror("File could not be found\n");
     exit(EXIT_FAILURE);
+    break;
+
+  case SUCCESS:
+    verify_sha256(sha256, result->sha256);
+    if (result->download_path) {
+      printf("%s\n", result->download_path);
+    }
+    break;
   }
 }
 
@@ -156,6 +552,20 @@ void subcommand_download(int argc, char *argv[]) {
   char *          output_file = NULL;
   char *          key         = NULL;
   char *          crypt_key   = NULL;
+  int             segments    = 0;
+  int             stats       = 0;
+  char *          cache_dir   = NULL;
+  curl_off_t      cache_size  = 0;
+  int             zstd        = 0;
+  char *          passphrase  = NULL;
+  curl_off_t      rate        = 0;
+  int             retries     = 0;
+  char *          sha256      = NULL;
+  long            buffer_size = 0;
+  int             write_queue = JIRAFEAU_DEFAULT_WRITE_QUEUE;
+  int             direct      = 0;
+  char *          member      = NULL;
+  char *          index       = NULL;
   DownloadResultT result;
 
   for (int i = 3; i < argc; i++) {
@@ -171,30 +581,179 @@ void subcommand_download(int argc, char *argv[]) {
       }
     } else if (strcmp(argv[i], "-o") == 0 ||
                strcmp(argv[i], "--output-file") == 0) {
-      if (i + 1 < argc && argv[i + 1][0] != '-') {
+      if (i + 1 < argc &&
+          (argv[i + 1][0] != '-' || strcmp(argv[i + 1], "-") == 0)) {
         output_file = argv[++i];
       } else {
         perror("Missing value for -o/--output-file\n");
         exit(EXIT_FAILURE);
       }
+    } else if (strcmp(argv[i], "-s") == 0 ||
+               strcmp(argv[i], "--segments") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        segments = atoi(argv[++i]);
+      } else {
+        perror("Missing value for -s/--segments\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--member") == 0) {
+      if (i + 1 < argc) {
+        member = argv[++i];
+      } else {
+        perror("Missing value for --member\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--index") == 0) {
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        index = argv[++i];
+      } else {
+        perror("Missing value for --index\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--cache-dir") == 0) {
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        cache_dir = argv[++i];
+      } else {
+        perror("Missing value for --cache-dir\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--cache-size") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        cache_size = (curl_off_t)atoi(argv[++i]) * 1024 * 1024;
+      } else {
+        perror("Missing value for --cache-size\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "-z") == 0 ||
+               strcmp(argv[i], "--zstd") == 0) {
+      zstd = 1;
+    } else if (strcmp(argv[i], "--limit-rate") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        rate = (curl_off_t)atoi(argv[++i]) * 1024;
+      } else {
+        perror("Missing value for --limit-rate\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--retry") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+        retries = atoi(argv[++i]);
+      } else {
+        perror("Missing value for --retry\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "-e") == 0 ||
+               strcmp(argv[i], "--decrypt") == 0) {
+      if (i + 1 < argc) {
+        passphrase = read_passphrase(argv[++i]);
+      } else {
+        perror("Missing value for -e/--decrypt\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--sha256") == 0) {
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        sha256 = argv[++i];
+      } else {
+        perror("Missing value for --sha256\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--buffer-size") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        buffer_size = (long)atoi(argv[++i]) * 1024;
+      } else {
+        perror("Missing value for --buffer-size\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--write-queue") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+        write_queue = atoi(argv[++i]);
+      } else {
+        perror("Missing value for --write-queue\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--direct") == 0) {
+      direct = 1;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = 1;
     }
   }
 
-  result = jirafeau_download(file_id, output_file, key, crypt_key);
+  if (member && !index) {
+    fprintf(stderr, "Error: --member needs --index\n");
+    exit(EXIT_FAILURE);
+  }
+  if (member && (zstd || passphrase || segments || cache_dir)) {
+    fprintf(stderr, "Error: members are fetched as they are stored, -z, -e, "
+                    "-s and --cache-dir don't apply\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (!segments && !cache_dir && !zstd && !passphrase && !rate && !retries &&
+      !stats && !buffer_size && !direct && !member &&
+      write_queue == JIRAFEAU_DEFAULT_WRITE_QUEUE &&
+      agent_download(file_id, output_file, key, crypt_key, &result)) {
+    report_download(&result, sha256);
+    return;
+  }
+
+  char *           host   = jirafeau_get_host();
+  JirafeauClientT *client = jirafeau_client_new(host);
+  free(host);
+  if (!client) {
+    perror("Could not set up the connection\n");
+    exit(EXIT_FAILURE);
+  }
+  if (cache_dir) {
+    jirafeau_client_set_download_cache(client, cache_dir, cache_size);
+  }
+  if (zstd && jirafeau_client_set_decompression(client, 1) != 0) {
+    fprintf(stderr, "Error: jirafeau was built without zstd\n");
+    exit(EXIT_FAILURE);
+  }
+  if (passphrase) {
+    jirafeau_client_set_encryption(client, passphrase, 0);
+  }
+  jirafeau_client_set_max_speed(client, rate);
+  jirafeau_client_set_retry(client, retries, 0);
+  jirafeau_client_set_download_io(client, buffer_size, write_queue, direct);
+
+  if (member) {
+    result = download_member(client, file_id, index, member, output_file, key,
+                             crypt_key);
+  } else if (output_file && strcmp(output_file, "-") == 0) {
+    result = jirafeau_client_download_callback(client, file_id, key,
+                                               crypt_key, write_stdout, NULL);
+  } else if (segments) {
+    result = jirafeau_client_download_segmented(client, file_id, output_file,
+                                                key, crypt_key, segments);
+  } else {
+    result = jirafeau_client_download(client, file_id, output_file, key,
+                                      crypt_key);
+  }
+  jirafeau_client_free(client);
+
+  if (stats) {
+    print_stats("download", &result.metrics);
+  }
+  report_download(&result, sha256);
+}
 
-  switch (result.state) {
+/**
+ * Prints the outcome of a delete, or exits if it failed.
+ */
+static void report_delete(const DeleteResultT *result) {
+  switch (result->state) {
   case ERROR:
     perror("An error occurred\n");
     exit(EXIT_FAILURE);
     break;
 
   case FILE_NOT_FOUND:
-    perror("File could not be found\n");
+    perror("File could not be found, already deleted?\n");
     exit(EXIT_FAILURE);
     break;
 
   case SUCCESS:
-    printf("%s\n", result.download_path);
+    printf("File deleted\n");
     break;
   }
 }
@@ -204,27 +763,55 @@ void subcommand_delete(int argc, char *argv[]) {
     perror("You have to define both the 'file_id' and the 'delete_key'");
     exit(EXIT_FAILURE);
   }
-  char *        file_id    = argv[3];
-  char *        delete_key = argv[4];
+  char *        file_id     = argv[3];
+  char *        delete_key  = argv[4];
+  int           stats       = 0;
+  char *        dedup_index = NULL;
+  int           retries     = 0;
   DeleteResultT result;
 
-  result = jirafeau_delete(file_id, delete_key);
+  for (int i = 5; i < argc; i++) {
+    if ((strcmp(argv[i], "-d") == 0 ||
+         strcmp(argv[i], "--dedup-index") == 0) &&
+        i + 1 < argc) {
+      dedup_index = argv[++i];
+    } else if (strcmp(argv[i], "--retry") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+        retries = atoi(argv[++i]);
+      } else {
+        perror("Missing value for --retry\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = 1;
+    }
+  }
 
-  switch (result.state) {
-  case ERROR:
-    perror("An error occurred\n");
-    exit(EXIT_FAILURE);
-    break;
+  if (!dedup_index && !retries && !stats &&
+      agent_delete(file_id, delete_key, &result)) {
+    report_delete(&result);
+    return;
+  }
 
-  case FILE_NOT_FOUND:
-    perror("File could not be found, already deleted?\n");
+  char *           host   = jirafeau_get_host();
+  JirafeauClientT *client = jirafeau_client_new(host);
+  free(host);
+  if (!client) {
+    perror("Could not set up the connection\n");
     exit(EXIT_FAILURE);
-    break;
+  }
+  if (dedup_index) {
+    jirafeau_client_set_dedup_index(client, dedup_index);
+  }
+  jirafeau_client_set_retry(client, retries, 0);
+  result = jirafeau_client_delete(client, file_id, delete_key);
+  jirafeau_client_free(client);
 
-  case SUCCESS:
-    printf("File deleted\n");
-    break;
+  if (stats) {
+    print_stats("delete", &result.metrics);
   }
+
+  report_delete(&result);
 }
 
 int main(int argc, char *argv[]) {
@@ -248,6 +835,12 @@ int main(int argc, char *argv[]) {
     subcommand_download(argc, argv);
   } else if (strcmp(command, "delete") == 0) {
     subcommand_delete(argc, argv);
+  } else if (strcmp(command, "batch") == 0) {
+    subcommand_batch(argc, argv);
+  } else if (strcmp(command, "watch") == 0) {
+    subcommand_watch(argc, argv);
+  } else if (strcmp(command, "agent") == 0) {
+    subcommand_agent(argc, argv);
   } else {
     printf("Invalid command. Use --help for usage information.\n");
     return 1;
@@ -0,0 +1,501 @@
+#include "jirafeau.h"
+#include "jirafeau_private.h"
+#include <curl/curl.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* share of a capped bandwidth per priority, see Priority */
+static const int priority_weights[] = { 1, 4, 16 };
+
+struct JirafeauMulti {
+  char *             host_url;
+  CURLM *            multi;
+  int                max_transfers;
+  JirafeauTransferT *running;
+  int                running_count;
+  JirafeauTransferT *queue_head;
+  JirafeauTransferT *queue_tail;
+  int                queue_count;
+  curl_off_t         max_speed;
+  int                retries;
+  long               retry_delay;
+  bool               multiplex;
+  long               receive_buffer;
+  int                write_queue;
+  bool               direct_io;
+
+  /* set when an external event loop drives the multi */
+  JirafeauSocketCallback socket_callback;
+  void *                 socket_userdata;
+  JirafeauTimerCallback  timer_callback;
+  void *                 timer_userdata;
+  curl_off_t             curl_timer_at; /* monotonic ms, -1 for none */
+};
+
+JirafeauMultiT *jirafeau_multi_new(const char *host_url, int max_transfers) {
+  if (!host_url || max_transfers <= 0) {
+    return NULL;
+  }
+
+  JirafeauMultiT *multi = calloc(1, sizeof(JirafeauMultiT));
+  if (!multi) {
+    return NULL;
+  }
+
+  jirafeau_global_init();
+
+  multi->host_url      = strdup(host_url);
+  multi->multi         = curl_multi_init();
+  multi->max_transfers = max_transfers;
+  multi->curl_timer_at = -1;
+  multi->write_queue   = JIRAFEAU_DEFAULT_WRITE_QUEUE;
+  if (!multi->host_url || !multi->multi) {
+    jirafeau_multi_free(multi);
+    return NULL;
+  }
+
+  return multi;
+}
+
+static void free_transfer(JirafeauTransferT *transfer) {
+  jirafeau_transfer_release(transfer);
+  if (transfer->curl) {
+    curl_easy_cleanup(transfer->curl);
+  }
+  free(transfer);
+}
+
+void jirafeau_multi_free(JirafeauMultiT *multi) {
+  if (!multi) {
+    return;
+  }
+
+  while (multi->running) {
+    JirafeauTransferT *transfer = multi->running;
+    multi->running = transfer->next;
+    curl_multi_remove_handle(multi->multi, transfer->curl);
+    free_transfer(transfer);
+  }
+
+  while (multi->queue_head) {
+    JirafeauTransferT *transfer = multi->queue_head;
+    multi->queue_head = transfer->next;
+    free_transfer(transfer);
+  }
+
+  if (multi->multi) {
+    curl_multi_cleanup(multi->multi);
+  }
+  free(multi->host_url);
+  free(multi);
+}
+
+static JirafeauTransferT *new_transfer(JirafeauCallback callback,
+                                       void *           userdata) {
+  JirafeauTransferT *transfer = calloc(1, sizeof(JirafeauTransferT));
+
+  if (transfer) {
+    transfer->callback = callback;
+    transfer->userdata = userdata;
+    transfer->priority = PRIORITY_NORMAL;
+  }
+  return transfer;
+}
+
+static void enqueue(JirafeauMultiT *multi, JirafeauTransferT *transfer) {
+  if (multi->queue_tail) {
+    multi->queue_tail->next = transfer;
+  } else {
+    multi->queue_head = transfer;
+  }
+  multi->queue_tail = transfer;
+  multi->queue_count++;
+
+  /* have the event loop call back right away to start it */
+  if (multi->timer_callback) {
+    multi->timer_callback(0, multi->timer_userdata);
+  }
+}
+
+JirafeauTransferT *jirafeau_multi_upload(JirafeauMultiT *multi,
+                                         const char *file_path,
+                                         const char *time,
+                                         const char *upload_password,
+                                         int one_time_download,
+                                         const char *key,
+                                         const char *filename,
+                                         JirafeauCallback callback,
+                                         void *userdata) {
+  JirafeauTransferT *transfer = new_transfer(callback, userdata);
+
+  if (transfer) {
+    jirafeau_transfer_init_upload(transfer, file_path, time, upload_password,
+                                  one_time_download, key, filename);
+    enqueue(multi, transfer);
+  }
+  return transfer;
+}
+
+JirafeauTransferT *jirafeau_multi_download(JirafeauMultiT *multi,
+                                           const char *file_id,
+                                           const char *output_path,
+                                           const char *file_key,
+                                           const char *crypt_key,
+                                           JirafeauCallback callback,
+                                           void *userdata) {
+  JirafeauTransferT *transfer = new_transfer(callback, userdata);
+
+  if (transfer) {
+    jirafeau_transfer_init_download(transfer, file_id, output_path, file_key,
+                                    crypt_key);
+    enqueue(multi, transfer);
+  }
+  return transfer;
+}
+
+JirafeauTransferT *jirafeau_multi_delete(JirafeauMultiT *multi,
+                                         const char *file_id,
+                                         const char *delete_key,
+                                         JirafeauCallback callback,
+                                         void *userdata) {
+  JirafeauTransferT *transfer = new_transfer(callback, userdata);
+
+  if (transfer) {
+    jirafeau_transfer_init_delete(transfer, file_id, delete_key);
+    enqueue(multi, transfer);
+  }
+  return transfer;
+}
+
+static void complete(JirafeauTransferT *transfer, CURLcode res) {
+  OperationResultT result = { 0 };
+
+  jirafeau_transfer_finish(transfer, res, &result);
+  if (transfer->callback) {
+    transfer->callback(transfer, &result, transfer->userdata);
+  }
+  free_transfer(transfer);
+}
+
+/**
+ * Splits the bandwidth limit of the multi among the running transfers by
+ * the weight of their priority. Transfers whose own limit is below their
+ * share keep it and the rest is split among the others again.
+ */
+static void rebalance(JirafeauMultiT *multi) {
+  curl_off_t remaining = multi->max_speed;
+  int        weights   = 0;
+  bool       settled;
+
+  for (JirafeauTransferT *it = multi->running; it; it = it->next) {
+    it->speed = -1;
+    weights  += priority_weights[it->priority];
+  }
+
+  do {
+    settled = false;
+    for (JirafeauTransferT *it = multi->running; it; it = it->next) {
+      curl_off_t share = weights ? remaining / weights *
+                                     priority_weights[it->priority]
+                                 : 0;
+      if (it->speed == -1 && it->max_speed &&
+          (!multi->max_speed || it->max_speed <= share)) {
+        it->speed  = it->max_speed;
+        remaining -= it->max_speed;
+        weights   -= priority_weights[it->priority];
+        settled    = true;
+      }
+    }
+  } while (settled && multi->max_speed);
+
+  for (JirafeauTransferT *it = multi->running; it; it = it->next) {
+    if (it->speed == -1) {
+      it->speed = multi->max_speed ? remaining / weights *
+                                       priority_weights[it->priority]
+                                   : 0;
+      /* 0 would lift the limit */
+      if (multi->max_speed && it->speed < 1) {
+        it->speed = 1;
+      }
+    }
+    curl_easy_setopt(it->curl, CURLOPT_MAX_SEND_SPEED_LARGE, it->speed);
+    curl_easy_setopt(it->curl, CURLOPT_MAX_RECV_SPEED_LARGE, it->speed);
+  }
+}
+
+/**
+ * Takes the first of the queued transfers with the highest priority off
+ * the queue, if there is a slot for it. Transfers waiting for a retry are
+ * left until it is due.
+ */
+static JirafeauTransferT *dequeue(JirafeauMultiT *multi) {
+  JirafeauTransferT **best = NULL;
+  curl_off_t          now  = jirafeau_now_ms();
+
+  for (JirafeauTransferT **it = &multi->queue_head; *it; it = &(*it)->next) {
+    if ((*it)->retry_at > now) {
+      continue;
+    }
+    if (!best || (*it)->priority > (*best)->priority) {
+      best = it;
+    }
+  }
+
+  if (!best || (multi->running_count >= multi->max_transfers &&
+                ((*best)->priority != PRIORITY_INTERACTIVE ||
+                 multi->running_count >= 2 * multi->max_transfers))) {
+    return NULL;
+  }
+
+  JirafeauTransferT *transfer = *best;
+  *best                       = transfer->next;
+  if (multi->queue_tail == transfer) {
+    multi->queue_tail = NULL;
+    for (JirafeauTransferT *it = multi->queue_head; it; it = it->next) {
+      multi->queue_tail = it;
+    }
+  }
+  multi->queue_count--;
+  transfer->next = NULL;
+  return transfer;
+}
+
+/**
+ * Moves transfers from the queue onto the multi handle as long as there are
+ * free slots.
+ */
+static void start_queued(JirafeauMultiT *multi) {
+  JirafeauTransferT *transfer;
+  bool               started = false;
+
+  while ((transfer = dequeue(multi))) {
+    CURL *curl = curl_easy_init();
+
+    transfer->download.receive_buffer = multi->receive_buffer;
+    transfer->download.write_queue    = multi->write_queue;
+    transfer->download.direct_io      = multi->direct_io;
+    if (!curl || !jirafeau_transfer_prepare(transfer, curl, multi->host_url)) {
+      transfer->curl = curl;
+      complete(transfer, CURLE_FAILED_INIT);
+      continue;
+    }
+
+    jirafeau_set_common_options(curl);
+    if (multi->multiplex) {
+      /* wait for the connection of a running transfer rather than opening
+       * one of its own, once it speaks HTTP/2 they share it */
+      curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+      curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    }
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)transfer);
+    curl_multi_add_handle(multi->multi, curl);
+
+    transfer->next = multi->running;
+    multi->running = transfer;
+    multi->running_count++;
+    started = true;
+  }
+
+  if (started) {
+    rebalance(multi);
+  }
+}
+
+static void remove_running(JirafeauMultiT *multi, JirafeauTransferT *transfer) {
+  for (JirafeauTransferT **it = &multi->running; *it; it = &(*it)->next) {
+    if (*it == transfer) {
+      *it = transfer->next;
+      multi->running_count--;
+      break;
+    }
+  }
+  transfer->next = NULL;
+}
+
+static void complete_finished(JirafeauMultiT *multi) {
+  CURLMsg *msg;
+  int      queued;
+
+  while ((msg = curl_multi_info_read(multi->multi, &queued))) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+
+    JirafeauTransferT *transfer;
+    CURL *             curl = msg->easy_handle;
+    CURLcode           res  = msg->data.result;
+
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&transfer);
+    curl_multi_remove_handle(multi->multi, curl);
+    remove_running(multi, transfer);
+
+    long delay = jirafeau_transfer_retry(transfer, res, multi->retries,
+                                         multi->retry_delay);
+    if (delay >= 0) {
+      /* back into the queue, it gets a new handle when it starts again */
+      curl_easy_cleanup(curl);
+      transfer->curl     = NULL;
+      transfer->retry_at = jirafeau_now_ms() + delay;
+      enqueue(multi, transfer);
+    } else {
+      complete(transfer, res);
+    }
+    if (multi->max_speed) {
+      rebalance(multi);
+    }
+  }
+}
+
+void jirafeau_multi_set_max_speed(JirafeauMultiT *multi,
+                                  curl_off_t      bytes_per_second) {
+  multi->max_speed = bytes_per_second > 0 ? bytes_per_second : 0;
+  rebalance(multi);
+}
+
+void jirafeau_transfer_set_max_speed(JirafeauTransferT *transfer,
+                                     curl_off_t         bytes_per_second) {
+  transfer->max_speed = bytes_per_second > 0 ? bytes_per_second : 0;
+}
+
+void jirafeau_transfer_set_priority(JirafeauTransferT *transfer,
+                                    Priority           priority) {
+  transfer->priority = priority;
+}
+
+void jirafeau_multi_set_retry(JirafeauMultiT *multi, int retries,
+                              long delay_ms) {
+  multi->retries     = retries > 0 ? retries : 0;
+  multi->retry_delay = delay_ms > 0 ? delay_ms : 0;
+}
+
+void jirafeau_multi_set_multiplex(JirafeauMultiT *multi, int enabled) {
+  multi->multiplex = enabled;
+  curl_multi_setopt(multi->multi, CURLMOPT_PIPELINING,
+                    enabled ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+}
+
+void jirafeau_multi_set_download_io(JirafeauMultiT *multi,
+                                    long receive_buffer, int write_queue,
+                                    int direct) {
+  multi->receive_buffer = receive_buffer > 0 ? receive_buffer : 0;
+  multi->write_queue    = write_queue > 0 ? write_queue : 0;
+  multi->direct_io      = direct;
+}
+
+/**
+ * @return Milliseconds until the next queued retry is due, -1 if none is
+ * waiting
+ */
+static long next_retry(JirafeauMultiT *multi) {
+  curl_off_t now  = jirafeau_now_ms();
+  long       wait = -1;
+
+  for (JirafeauTransferT *it = multi->queue_head; it; it = it->next) {
+    if (it->retry_at > now && (wait == -1 || it->retry_at - now < wait)) {
+      wait = (long)(it->retry_at - now);
+    }
+  }
+  return wait;
+}
+
+int jirafeau_multi_perform(JirafeauMultiT *multi, int timeout_ms) {
+  int  still_running;
+  long wait;
+
+  start_queued(multi);
+  curl_multi_perform(multi->multi, &still_running);
+  complete_finished(multi);
+  start_queued(multi);
+
+  wait = next_retry(multi);
+  if (multi->running_count || wait >= 0) {
+    /* waits out the timeout even without any transfer running */
+    curl_multi_poll(multi->multi, NULL, 0,
+                    wait >= 0 && wait < timeout_ms ? (int)wait : timeout_ms,
+                    NULL);
+    curl_multi_perform(multi->multi, &still_running);
+    complete_finished(multi);
+    start_queued(multi);
+  }
+
+  return multi->running_count + multi->queue_count;
+}
+
+static int handle_socket(CURL *curl, curl_socket_t fd, int what, void *userp,
+                         void *socketp) {
+  JirafeauMultiT *multi = (JirafeauMultiT *)userp;
+
+  multi->socket_callback(fd, what, multi->socket_userdata);
+  return 0;
+}
+
+static int handle_timer(CURLM *curl_multi, long timeout_ms, void *userp) {
+  JirafeauMultiT *multi = (JirafeauMultiT *)userp;
+
+  multi->curl_timer_at = timeout_ms < 0 ? -1 : jirafeau_now_ms() + timeout_ms;
+  multi->timer_callback(timeout_ms, multi->timer_userdata);
+  return 0;
+}
+
+/**
+ * Has the event loop call back when the next retry is due. There is only
+ * one timer, so it is not set later than curl's own. Without a retry it is
+ * set back to curl's, which the kick of enqueue may have replaced: curl
+ * only reports its timer again once it changes.
+ */
+static void schedule_retry(JirafeauMultiT *multi) {
+  long       wait = next_retry(multi);
+  curl_off_t now  = jirafeau_now_ms();
+  long       curl_wait;
+
+  if (!multi->timer_callback ||
+      (wait < 0 && multi->curl_timer_at < 0)) {
+    return;
+  }
+  if (multi->curl_timer_at >= 0) {
+    curl_wait = multi->curl_timer_at > now
+                  ? (long)(multi->curl_timer_at - now)
+                  : 0;
+    if (wait < 0 || curl_wait < wait) {
+      wait = curl_wait;
+    }
+  }
+  multi->timer_callback(wait, multi->timer_userdata);
+}
+
+void jirafeau_multi_set_socket_callback(JirafeauMultiT *       multi,
+                                        JirafeauSocketCallback callback,
+                                        void *                 userdata) {
+  multi->socket_callback = callback;
+  multi->socket_userdata = userdata;
+
+  curl_multi_setopt(multi->multi, CURLMOPT_SOCKETFUNCTION,
+                    callback ? handle_socket : NULL);
+  curl_multi_setopt(multi->multi, CURLMOPT_SOCKETDATA, (void *)multi);
+}
+
+void jirafeau_multi_set_timer_callback(JirafeauMultiT *      multi,
+                                       JirafeauTimerCallback callback,
+                                       void *                userdata) {
+  multi->timer_callback = callback;
+  multi->timer_userdata = userdata;
+
+  curl_multi_setopt(multi->multi, CURLMOPT_TIMERFUNCTION,
+                    callback ? handle_timer : NULL);
+  curl_multi_setopt(multi->multi, CURLMOPT_TIMERDATA, (void *)multi);
+}
+
+int jirafeau_multi_socket_action(JirafeauMultiT *multi, int fd, int events) {
+  int still_running;
+
+  start_queued(multi);
+  curl_multi_socket_action(multi->multi,
+                           fd == JIRAFEAU_SOCKET_TIMEOUT ? CURL_SOCKET_TIMEOUT
+                                                         : fd,
+                           events, &still_running);
+  complete_finished(multi);
+  start_queued(multi);
+  schedule_retry(multi);
+
+  return multi->running_count + multi->queue_count;
+}
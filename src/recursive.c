@@ -0,0 +1,188 @@
+#include "recursive.h"
+#include "jirafeau.h"
+#include "json.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static int failures = 0;
+
+char *walk_join(const char *dir, const char *name) {
+  size_t size = strlen(dir) + strlen(name) + 2;
+  char * path = malloc(size);
+
+  if (path) {
+    snprintf(path, size, "%s%s%s", dir, dir[0] && name[0] ? "/" : "", name);
+  }
+  return path;
+}
+
+int walk_enter(struct Walk *walk, char *path) {
+  char *full = walk_join(walk->root, path);
+  DIR * dir  = full ? opendir(full) : NULL;
+
+  if (!dir) {
+    fprintf(stderr, "Error: Could not open directory '%s'\n",
+            full ? full : path);
+    walk->errors++;
+    free(full);
+    free(path);
+    return 0;
+  }
+  free(full);
+
+  if (walk->depth == walk->capacity) {
+    int               capacity = walk->capacity ? walk->capacity * 2 : 16;
+    struct WalkLevel *grown    = realloc(walk->levels,
+                                         capacity * sizeof(struct WalkLevel));
+    if (!grown) {
+      closedir(dir);
+      free(path);
+      return 0;
+    }
+    walk->levels   = grown;
+    walk->capacity = capacity;
+  }
+
+  walk->levels[walk->depth].dir  = dir;
+  walk->levels[walk->depth].path = path;
+  walk->depth++;
+  return 1;
+}
+
+char *walk_next(struct Walk *walk) {
+  while (walk->depth > 0) {
+    struct WalkLevel *level = &walk->levels[walk->depth - 1];
+    struct dirent *   entry = readdir(level->dir);
+    struct stat       st;
+
+    if (!entry) {
+      closedir(level->dir);
+      free(level->path);
+      walk->depth--;
+      continue;
+    }
+
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+        fstatat(dirfd(level->dir), entry->d_name, &st,
+                AT_SYMLINK_NOFOLLOW) != 0) {
+      continue;
+    }
+
+    char *path = walk_join(level->path, entry->d_name);
+    if (!path) {
+      continue;
+    }
+    if (S_ISREG(st.st_mode)) {
+      return path;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      walk_enter(walk, path);
+    } else {
+      free(path);
+    }
+  }
+  return NULL;
+}
+
+void walk_free(struct Walk *walk) {
+  while (walk->depth > 0) {
+    walk->depth--;
+    closedir(walk->levels[walk->depth].dir);
+    free(walk->levels[walk->depth].path);
+  }
+  free(walk->levels);
+}
+
+void print_manifest_line(const char *path, const UploadResultT *upload) {
+  printf("{\"path\":");
+  json_print_string(stdout, path);
+  printf(",\"status\":\"%s\"", upload->state == SUCCESS ? "success" : "error");
+  printf(",\"file_id\":");
+  json_print_string(stdout, upload->file_id);
+  printf(",\"delete_key\":");
+  json_print_string(stdout, upload->delete_key);
+  printf(",\"crypt_key\":");
+  json_print_string(stdout, upload->crypt_key);
+  printf(",\"sha256\":");
+  json_print_string(stdout, upload->sha256[0] ? upload->sha256 : NULL);
+  printf("}\n");
+  fflush(stdout);
+}
+
+static void handle_result(JirafeauTransferT *     transfer,
+                          const OperationResultT *result, void *userdata) {
+  char *               path   = (char *)userdata;
+  const UploadResultT *upload = &result->upload;
+
+  if (upload->state != SUCCESS) {
+    failures++;
+  }
+  print_manifest_line(path, upload);
+
+  free(upload->file_id);
+  free(upload->delete_key);
+  free(upload->crypt_key);
+  free(path);
+}
+
+int upload_recursive(const char *dir, int jobs, curl_off_t max_speed,
+                     int retries, int multiplex, const char *time,
+                     const char *upload_password,
+                     int one_time_download, const char *key) {
+  struct Walk     walk    = { dir, NULL, 0, 0, 0 };
+  int             pending = 0;
+  int             done    = 0;
+  char *          host    = jirafeau_get_host();
+  JirafeauMultiT *multi   = jirafeau_multi_new(host, jobs);
+
+  free(host);
+  if (!multi) {
+    perror("Could not set up the connection\n");
+    return 1;
+  }
+  jirafeau_multi_set_max_speed(multi, max_speed);
+  jirafeau_multi_set_retry(multi, retries, 0);
+  if (multiplex) {
+    jirafeau_multi_set_multiplex(multi, 1);
+  }
+
+  failures = 0;
+  walk_enter(&walk, strdup(""));
+
+  while (!done || pending) {
+    /* walk only far enough ahead to keep all slots busy */
+    while (!done && pending < jobs * 2) {
+      char *path = walk_next(&walk);
+      if (!path) {
+        done = 1;
+        break;
+      }
+
+      char *file_path = walk_join(dir, path);
+      if (file_path &&
+          jirafeau_multi_upload(multi, file_path, time, upload_password,
+                                one_time_download, key, path, handle_result,
+                                path)) {
+        pending++;
+      } else {
+        fprintf(stderr, "Error: Could not queue '%s'\n", path);
+        failures++;
+        free(path);
+      }
+      free(file_path);
+    }
+
+    if (pending) {
+      pending = jirafeau_multi_perform(multi, 1000);
+    }
+  }
+
+  failures += walk.errors;
+  walk_free(&walk);
+  jirafeau_multi_free(multi);
+  return failures;
+}
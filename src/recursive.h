@@ -0,0 +1,80 @@
+#ifndef RECURSIVE_H
+#define RECURSIVE_H
+
+#include "jirafeau.h"
+#include <curl/curl.h>
+#include <dirent.h>
+
+/**
+ * An open directory of a walk and its path relative to the root.
+ */
+struct WalkLevel {
+  DIR * dir;
+  char *path;
+};
+
+/**
+ * Depth-first walk that hands out one regular file at a time, so that
+ * uploads can start before the whole tree has been read. Symbolic links are
+ * not followed. Start it with walk_enter(&walk, strdup("")).
+ */
+struct Walk {
+  const char *      root;
+  struct WalkLevel *levels;
+  int               depth;
+  int               capacity;
+  int               errors; /* directories that could not be read */
+};
+
+/**
+ * Descends into a directory of the walk.
+ *
+ * @param path Directory relative to the root, taken over by the walk
+ * @return 0 if it could not be opened
+ */
+int walk_enter(struct Walk *walk, char *path);
+
+/**
+ * @return Path of the next regular file relative to the root (to be
+ * freed), NULL once the walk is done
+ */
+char *walk_next(struct Walk *walk);
+
+/**
+ * Frees a walk, finished or not.
+ */
+void walk_free(struct Walk *walk);
+
+/**
+ * @return "dir/name", or just one of them if the other is empty (to be
+ * freed), NULL if out of memory
+ */
+char *walk_join(const char *dir, const char *name);
+
+/**
+ * Uploads every regular file below a directory concurrently, each under its
+ * path relative to the directory, and prints one NDJSON manifest line per
+ * file as it finishes. The tree is walked while the first files are already
+ * being uploaded. Symbolic links are not followed.
+ *
+ * Usage: jirafeau <host> upload -R <dir> [-j N] [upload options]
+ *
+ * @param dir Directory to upload
+ * @param jobs Maximum number of concurrent uploads
+ * @param max_speed Bandwidth of all uploads together, 0 for no limit
+ * @param retries How often a failed upload may be repeated
+ * @param multiplex Whether the uploads share one HTTP/2 connection
+ * @return Number of files that could not be uploaded
+ */
+int upload_recursive(const char *dir, int jobs, curl_off_t max_speed,
+                     int retries, int multiplex, const char *time,
+                     const char *upload_password,
+                     int one_time_download, const char *key);
+
+/**
+ * Prints the NDJSON manifest line of an upload: the path it was uploaded
+ * under, the status, the keys and the SHA-256.
+ */
+void print_manifest_line(const char *path, const UploadResultT *upload);
+
+#endif // RECURSIVE_H
@@ -0,0 +1,707 @@
+#include "watch.h"
+#include "jirafeau.h"
+#include "jirafeau_private.h"
+#include "json.h"
+#include "recursive.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WATCH_DEFAULT_JOBS     8
+#define WATCH_DEFAULT_DEBOUNCE 500
+#define WATCH_STATE_NAME       ".jirafeau-watch"
+#define WATCH_MAX_FIELDS       8
+#define WATCH_MAX_EVENTS       64
+
+/* new directories are watched as well, new files only once they're closed */
+#define WATCH_EVENTS                                                           \
+  (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+struct Upload;
+
+/**
+ * A file of the tree, known from the state file or an event.
+ */
+struct Entry {
+  char *        path; /* relative to the root */
+  struct Entry *next; /* in its bucket */
+
+  /* the file as it was uploaded, all 0 if it wasn't yet */
+  ino_t     inode;
+  long long mtime_ns;
+  off_t     size;
+
+  curl_off_t     due;     /* when to upload it, -1 if not pending */
+  struct Upload *upload;  /* running, NULL if there is none */
+  bool           changed; /* written again while uploading */
+  bool           seen;    /* found on disk, the state keeps only those */
+};
+
+struct Watch {
+  const char *root;
+  curl_off_t  debounce;
+  int         inotify;
+  int         epoll;
+  int         signals;
+
+  /* relative paths of the watched directories by watch descriptor */
+  char **dirs;
+  int    dir_count;
+
+  /* entries by path */
+  struct Entry **buckets;
+  size_t         bucket_count;
+  size_t         entry_count;
+
+  /* entries with a due time */
+  struct Entry **pending;
+  int            pending_count;
+  int            pending_capacity;
+
+  JirafeauMultiT *multi;
+  curl_off_t      curl_due; /* -1 without a timer */
+  int             uploading;
+  int             failures;
+
+  FILE *state;
+  bool  state_known;
+  dev_t state_dev;
+  ino_t state_inode;
+
+  const char *time;
+  const char *upload_password;
+  int         one_time_download;
+  const char *key;
+};
+
+/**
+ * What a running upload has to remember.
+ */
+struct Upload {
+  struct Watch *watch;
+  struct Entry *entry;
+  struct stat   st;
+};
+
+static long long mtime_ns(const struct stat *st) {
+  return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static size_t hash_path(const char *path) {
+  uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+
+  for (; *path; path++) {
+    hash = (hash ^ (unsigned char)*path) * 1099511628211ULL;
+  }
+  return (size_t)hash;
+}
+
+static void grow_buckets(struct Watch *w) {
+  size_t         count   = w->bucket_count ? w->bucket_count * 2 : 1024;
+  struct Entry **buckets = calloc(count, sizeof(struct Entry *));
+
+  if (!buckets) {
+    return;
+  }
+  for (size_t i = 0; i < w->bucket_count; i++) {
+    while (w->buckets[i]) {
+      struct Entry *e = w->buckets[i];
+      w->buckets[i]   = e->next;
+
+      size_t bucket    = hash_path(e->path) % count;
+      e->next          = buckets[bucket];
+      buckets[bucket]  = e;
+    }
+  }
+  free(w->buckets);
+  w->buckets      = buckets;
+  w->bucket_count = count;
+}
+
+/**
+ * @param add Whether to add an entry for `path` if there is none
+ * @return The entry of `path`, NULL if there is none
+ */
+static struct Entry *find_entry(struct Watch *w, const char *path, bool add) {
+  if (w->entry_count >= w->bucket_count) {
+    grow_buckets(w);
+  }
+  if (!w->buckets) {
+    return NULL;
+  }
+
+  size_t bucket = hash_path(path) % w->bucket_count;
+  for (struct Entry *e = w->buckets[bucket]; e; e = e->next) {
+    if (strcmp(e->path, path) == 0) {
+      return e;
+    }
+  }
+  if (!add) {
+    return NULL;
+  }
+
+  struct Entry *e = calloc(1, sizeof(struct Entry));
+  if (!e || !(e->path = strdup(path))) {
+    free(e);
+    return NULL;
+  }
+  e->due             = -1;
+  e->next            = w->buckets[bucket];
+  w->buckets[bucket] = e;
+  w->entry_count++;
+  return e;
+}
+
+static bool unchanged(const struct Entry *e, const struct stat *st) {
+  return e->inode == st->st_ino && e->size == st->st_size &&
+         e->mtime_ns == mtime_ns(st);
+}
+
+static bool is_state(const struct Watch *w, const struct stat *st) {
+  return w->state_known && st->st_dev == w->state_dev &&
+         st->st_ino == w->state_inode;
+}
+
+/**
+ * Has the file uploaded at `due`, or once the running upload of it is done.
+ */
+static void schedule(struct Watch *w, struct Entry *e, curl_off_t due) {
+  if (e->upload) {
+    e->changed = true;
+    return;
+  }
+  if (e->due < 0) {
+    if (w->pending_count == w->pending_capacity) {
+      int            capacity = w->pending_capacity ? w->pending_capacity * 2
+                                                    : 64;
+      struct Entry **grown    = realloc(w->pending,
+                                        capacity * sizeof(struct Entry *));
+      if (!grown) {
+        return;
+      }
+      w->pending          = grown;
+      w->pending_capacity = capacity;
+    }
+    w->pending[w->pending_count++] = e;
+  }
+  e->due = due;
+}
+
+static void set_dir(struct Watch *w, int wd, const char *path) {
+  if (wd >= w->dir_count) {
+    int    count = wd * 2 + 16;
+    char **grown = realloc(w->dirs, count * sizeof(char *));
+    if (!grown) {
+      return;
+    }
+    memset(grown + w->dir_count, 0, (count - w->dir_count) * sizeof(char *));
+    w->dirs      = grown;
+    w->dir_count = count;
+  }
+  free(w->dirs[wd]);
+  w->dirs[wd] = path ? strdup(path) : NULL;
+}
+
+/**
+ * Watches a directory and the ones below it, and schedules the files that
+ * changed since they were uploaded. The watch is added before the
+ * directory is read, so a file written in between is seen either way.
+ */
+static void add_dir(struct Watch *w, const char *path) {
+  char *full = walk_join(w->root, path);
+  int   wd   = full ? inotify_add_watch(w->inotify, full, WATCH_EVENTS) : -1;
+  DIR * dir  = wd >= 0 ? opendir(full) : NULL;
+
+  if (!dir) {
+    fprintf(stderr, "Error: Could not watch directory '%s'\n",
+            full ? full : path);
+    free(full);
+    return;
+  }
+  free(full);
+  set_dir(w, wd, path);
+
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    struct stat st;
+
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+        fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      continue;
+    }
+
+    char *child = walk_join(path, entry->d_name);
+    if (!child) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      add_dir(w, child);
+    } else if (S_ISREG(st.st_mode) && !is_state(w, &st)) {
+      struct Entry *e = find_entry(w, child, true);
+      if (e) {
+        e->seen = true;
+        if (!unchanged(e, &st)) {
+          schedule(w, e, jirafeau_now_ms() + w->debounce);
+        }
+      }
+    }
+    free(child);
+  }
+  closedir(dir);
+}
+
+static void handle_event(struct Watch *w, const struct inotify_event *event) {
+  if (event->mask & IN_Q_OVERFLOW) {
+    /* the files that changed are found by their stat again */
+    fprintf(stderr, "WARNING: inotify dropped events, rescanning\n");
+    add_dir(w, "");
+    return;
+  }
+  if (event->wd < 0 || event->wd >= w->dir_count || !w->dirs[event->wd]) {
+    return;
+  }
+  if (event->mask & IN_IGNORED) {
+    set_dir(w, event->wd, NULL);
+    return;
+  }
+  if (!event->len) {
+    return;
+  }
+
+  char *path = walk_join(w->dirs[event->wd], event->name);
+  if (!path) {
+    return;
+  }
+  if (event->mask & IN_ISDIR) {
+    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+      add_dir(w, path);
+    }
+  } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+    struct Entry *e = find_entry(w, path, true);
+    if (e) {
+      schedule(w, e, jirafeau_now_ms() + w->debounce);
+    }
+  }
+  free(path);
+}
+
+static void read_events(struct Watch *w) {
+  char buffer[64 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+
+  while ((n = read(w->inotify, buffer, sizeof(buffer))) > 0) {
+    for (char *p = buffer; p < buffer + n;) {
+      const struct inotify_event *event = (const struct inotify_event *)p;
+
+      handle_event(w, event);
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+static void write_state(FILE *out, const struct Entry *e) {
+  fprintf(out, "{\"path\":");
+  json_print_string(out, e->path);
+  fprintf(out, ",\"inode\":%llu,\"mtime_ns\":%lld,\"size\":%lld}\n",
+          (unsigned long long)e->inode, e->mtime_ns, (long long)e->size);
+}
+
+static void handle_result(JirafeauTransferT *     transfer,
+                          const OperationResultT *result, void *userdata) {
+  struct Upload *      u      = (struct Upload *)userdata;
+  struct Watch *       w      = u->watch;
+  struct Entry *       e      = u->entry;
+  const UploadResultT *upload = &result->upload;
+
+  print_manifest_line(e->path, upload);
+  if (upload->state == SUCCESS) {
+    e->inode    = u->st.st_ino;
+    e->mtime_ns = mtime_ns(&u->st);
+    e->size     = u->st.st_size;
+
+    /* later lines win, the state is compacted on the next start */
+    write_state(w->state, e);
+    fflush(w->state);
+  } else {
+    w->failures++;
+  }
+  free(upload->file_id);
+  free(upload->delete_key);
+  free(upload->crypt_key);
+
+  e->upload = NULL;
+  w->uploading--;
+  if (e->changed) {
+    e->changed = false;
+    schedule(w, e, jirafeau_now_ms() + w->debounce);
+  }
+  free(u);
+}
+
+static void upload(struct Watch *w, struct Entry *e) {
+  char *         full = walk_join(w->root, e->path);
+  struct Upload *u    = malloc(sizeof(struct Upload));
+
+  /* gone, replaced by something else or written without a change */
+  if (!full || !u || lstat(full, &u->st) != 0 || !S_ISREG(u->st.st_mode) ||
+      is_state(w, &u->st) || unchanged(e, &u->st)) {
+    free(full);
+    free(u);
+    return;
+  }
+
+  u->watch = w;
+  u->entry = e;
+  if (jirafeau_multi_upload(w->multi, full, w->time, w->upload_password,
+                            w->one_time_download, w->key, e->path,
+                            handle_result, u)) {
+    e->upload = u;
+    w->uploading++;
+  } else {
+    fprintf(stderr, "Error: Could not queue '%s'\n", e->path);
+    w->failures++;
+    free(u);
+  }
+  free(full);
+}
+
+/**
+ * Starts the uploads that are due.
+ *
+ * @return Milliseconds until the next one is, -1 if none is pending
+ */
+static long start_due(struct Watch *w) {
+  curl_off_t now  = jirafeau_now_ms();
+  curl_off_t next = -1;
+
+  for (int i = 0; i < w->pending_count;) {
+    struct Entry *e = w->pending[i];
+
+    if (e->due > now) {
+      next = next < 0 || e->due < next ? e->due : next;
+      i++;
+      continue;
+    }
+    w->pending[i] = w->pending[--w->pending_count];
+    e->due        = -1;
+    upload(w, e);
+  }
+  return next < 0 ? -1 : (long)(next - now);
+}
+
+static void load_state(struct Watch *w, const char *path) {
+  FILE *     in       = fopen(path, "r");
+  char *     text     = NULL;
+  size_t     capacity = 0;
+  JsonFieldT fields[WATCH_MAX_FIELDS];
+
+  if (!in) {
+    return;
+  }
+  while (getline(&text, &capacity, in) != -1) {
+    int count = json_parse_object(text, fields, WATCH_MAX_FIELDS);
+    if (count < 0) {
+      continue;
+    }
+
+    const char *file     = json_get(fields, count, "path");
+    const char *inode    = json_get(fields, count, "inode");
+    const char *modified = json_get(fields, count, "mtime_ns");
+    const char *size     = json_get(fields, count, "size");
+    struct Entry *e      = file && inode && modified && size
+                               ? find_entry(w, file, true)
+                               : NULL;
+    if (e) {
+      e->inode    = (ino_t)strtoull(inode, NULL, 10);
+      e->mtime_ns = strtoll(modified, NULL, 10);
+      e->size     = (off_t)strtoll(size, NULL, 10);
+    }
+    json_free_fields(fields, count);
+  }
+  free(text);
+  fclose(in);
+}
+
+/**
+ * Rewrites the state with one line per file that is still there and opens
+ * it to append the coming uploads.
+ */
+static bool open_state(struct Watch *w, const char *path) {
+  size_t size = strlen(path) + 5;
+  char * temp = malloc(size);
+  FILE * out;
+
+  if (!temp) {
+    return false;
+  }
+  snprintf(temp, size, "%s.tmp", path);
+
+  out = fopen(temp, "w");
+  if (out) {
+    for (size_t i = 0; i < w->bucket_count; i++) {
+      for (struct Entry *e = w->buckets[i]; e; e = e->next) {
+        if (e->seen && e->inode) {
+          write_state(out, e);
+        }
+      }
+    }
+  }
+  if (!out || fclose(out) != 0 || rename(temp, path) != 0) {
+    free(temp);
+    return false;
+  }
+  free(temp);
+
+  struct stat st;
+  w->state = fopen(path, "a");
+  if (!w->state || fstat(fileno(w->state), &st) != 0) {
+    return false;
+  }
+  w->state_known = true;
+  w->state_dev   = st.st_dev;
+  w->state_inode = st.st_ino;
+  return true;
+}
+
+static void watch_socket(int fd, int what, void *userdata) {
+  struct Watch *     w  = (struct Watch *)userdata;
+  struct epoll_event ev = { 0 };
+
+  if (what == JIRAFEAU_POLL_REMOVE) {
+    epoll_ctl(w->epoll, EPOLL_CTL_DEL, fd, NULL);
+    return;
+  }
+  ev.data.fd = fd;
+  ev.events  = (what & JIRAFEAU_POLL_IN ? EPOLLIN : 0) |
+               (what & JIRAFEAU_POLL_OUT ? EPOLLOUT : 0);
+  if (epoll_ctl(w->epoll, EPOLL_CTL_MOD, fd, &ev) != 0 && errno == ENOENT) {
+    epoll_ctl(w->epoll, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+static void watch_timer(long timeout_ms, void *userdata) {
+  struct Watch *w = (struct Watch *)userdata;
+
+  w->curl_due = timeout_ms < 0 ? -1 : jirafeau_now_ms() + timeout_ms;
+}
+
+static void free_watch(struct Watch *w) {
+  jirafeau_multi_free(w->multi);
+  for (size_t i = 0; i < w->bucket_count; i++) {
+    while (w->buckets[i]) {
+      struct Entry *e = w->buckets[i];
+      w->buckets[i]   = e->next;
+      /* of an aborted upload, its callback never ran */
+      free(e->upload);
+      free(e->path);
+      free(e);
+    }
+  }
+  for (int i = 0; i < w->dir_count; i++) {
+    free(w->dirs[i]);
+  }
+  free(w->buckets);
+  free(w->dirs);
+  free(w->pending);
+  if (w->state) {
+    fclose(w->state);
+  }
+  close(w->inotify);
+  close(w->epoll);
+  close(w->signals);
+}
+
+void subcommand_watch(int argc, char *argv[]) {
+  struct Watch w          = { 0 };
+  char *       state_path = NULL;
+  int          jobs       = WATCH_DEFAULT_JOBS;
+  curl_off_t   rate       = 0;
+  int          retries    = 0;
+  int          mux        = 0;
+  char *       host;
+  struct stat  st;
+
+  w.debounce = WATCH_DEFAULT_DEBOUNCE;
+  w.time     = "month";
+  w.curl_due = -1;
+
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--state") == 0) {
+      if (i + 1 < argc) {
+        state_path = strdup(argv[++i]);
+      } else {
+        perror("Missing value for --state\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--debounce") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+        w.debounce = atoi(argv[++i]);
+      } else {
+        perror("Missing value for --debounce\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        jobs = atoi(argv[++i]);
+      } else {
+        perror("Missing value for -j/--jobs\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--limit-rate") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+        rate = (curl_off_t)atoi(argv[++i]) * 1024;
+      } else {
+        perror("Missing value for --limit-rate\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--retry") == 0) {
+      if (i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+        retries = atoi(argv[++i]);
+      } else {
+        perror("Missing value for --retry\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--multiplex") == 0) {
+      mux = 1;
+    } else if ((strcmp(argv[i], "-t") == 0 ||
+                strcmp(argv[i], "--time") == 0) &&
+               i + 1 < argc) {
+      w.time = argv[++i];
+    } else if (strcmp(argv[i], "-o") == 0 ||
+               strcmp(argv[i], "--one-time-download") == 0) {
+      w.one_time_download = 1;
+    } else if ((strcmp(argv[i], "-k") == 0 ||
+                strcmp(argv[i], "--key") == 0) &&
+               i + 1 < argc) {
+      w.key = argv[++i];
+    } else if ((strcmp(argv[i], "-u") == 0 ||
+                strcmp(argv[i], "--upload-password") == 0) &&
+               i + 1 < argc) {
+      w.upload_password = argv[++i];
+    } else if (!w.root) {
+      w.root = argv[i];
+    }
+  }
+
+  if (!w.root || stat(w.root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "Error: '%s' is no directory\n", w.root ? w.root : "");
+    exit(EXIT_FAILURE);
+  }
+  if (!state_path) {
+    state_path = walk_join(w.root, WATCH_STATE_NAME);
+  }
+
+  /* the signals are read from a descriptor like the other events */
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  w.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  w.epoll   = epoll_create1(EPOLL_CLOEXEC);
+  w.signals = signalfd(-1, &signals, SFD_CLOEXEC);
+  host      = jirafeau_get_host();
+  w.multi   = jirafeau_multi_new(host, jobs);
+  free(host);
+  if (w.inotify == -1 || w.epoll == -1 || w.signals == -1 || !w.multi ||
+      !state_path) {
+    perror("Error: Could not set up the watch\n");
+    exit(EXIT_FAILURE);
+  }
+  jirafeau_multi_set_max_speed(w.multi, rate);
+  jirafeau_multi_set_retry(w.multi, retries, 0);
+  if (mux) {
+    jirafeau_multi_set_multiplex(w.multi, 1);
+  }
+  jirafeau_multi_set_socket_callback(w.multi, watch_socket, &w);
+  jirafeau_multi_set_timer_callback(w.multi, watch_timer, &w);
+
+  load_state(&w, state_path);
+  if (stat(state_path, &st) == 0) {
+    w.state_known = true;
+    w.state_dev   = st.st_dev;
+    w.state_inode = st.st_ino;
+  }
+  add_dir(&w, "");
+  if (!open_state(&w, state_path)) {
+    perror("Error: Could not write the state file\n");
+    exit(EXIT_FAILURE);
+  }
+  free(state_path);
+
+  struct epoll_event ev = { 0 };
+  ev.events             = EPOLLIN;
+  ev.data.fd            = w.inotify;
+  epoll_ctl(w.epoll, EPOLL_CTL_ADD, w.inotify, &ev);
+  ev.data.fd = w.signals;
+  epoll_ctl(w.epoll, EPOLL_CTL_ADD, w.signals, &ev);
+
+  fprintf(stderr, "Watching %s\n", w.root);
+
+  int stopping = 0;
+  while (stopping < 2 && (!stopping || w.uploading)) {
+    long wait = stopping ? -1 : start_due(&w);
+
+    if (w.curl_due >= 0) {
+      curl_off_t now   = jirafeau_now_ms();
+      long       timer = w.curl_due > now ? (long)(w.curl_due - now) : 0;
+      wait             = wait < 0 || timer < wait ? timer : wait;
+    }
+
+    struct epoll_event events[WATCH_MAX_EVENTS];
+    int n = epoll_wait(w.epoll, events, WATCH_MAX_EVENTS, (int)wait);
+    if (n < 0 && errno != EINTR) {
+      perror("Error: Could not wait for events\n");
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+
+      if (fd == w.inotify) {
+        read_events(&w);
+      } else if (fd == w.signals) {
+        struct signalfd_siginfo info;
+        if (read(w.signals, &info, sizeof(info)) == sizeof(info)) {
+          stopping++;
+        }
+        if (stopping == 1 && w.uploading) {
+          fprintf(stderr, "Finishing %d uploads, signal again to abort\n",
+                  w.uploading);
+        }
+      } else {
+        jirafeau_multi_socket_action(
+            w.multi, fd,
+            (events[i].events & EPOLLIN ? JIRAFEAU_EVENT_IN : 0) |
+                (events[i].events & EPOLLOUT ? JIRAFEAU_EVENT_OUT : 0) |
+                (events[i].events & (EPOLLERR | EPOLLHUP) ? JIRAFEAU_EVENT_ERR
+                                                          : 0));
+      }
+    }
+
+    if (w.curl_due >= 0 && jirafeau_now_ms() >= w.curl_due) {
+      w.curl_due = -1;
+      jirafeau_multi_socket_action(w.multi, JIRAFEAU_SOCKET_TIMEOUT, 0);
+    }
+  }
+
+  int failures = w.failures;
+  free_watch(&w);
+  if (failures) {
+    exit(EXIT_FAILURE);
+  }
+}
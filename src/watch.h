@@ -0,0 +1,23 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+/**
+ * Watches a directory tree with inotify and uploads each file that is
+ * written and closed in it, or moved into it, once it has been left alone
+ * for the debounce time. Uploads run concurrently and print one NDJSON line
+ * per file as with `upload -R`.
+ *
+ * Every upload is recorded in a state file with the inode, mtime and size
+ * of the file. On a restart the tree is only stat'ed against the state, so
+ * just the files that changed meanwhile are uploaded again and nothing is
+ * read or hashed. The state file itself is never uploaded.
+ *
+ * Runs until SIGINT or SIGTERM and lets running uploads finish, a second
+ * signal aborts them.
+ *
+ * Usage: jirafeau <host> watch <dir> [--state path] [--debounce ms] [-j N]
+ *        [upload options]
+ */
+void subcommand_watch(int argc, char *argv[]);
+
+#endif // WATCH_H
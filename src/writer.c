@@ -0,0 +1,240 @@
+#define _GNU_SOURCE /* fallocate, O_DIRECT */
+#include "jirafeau_private.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* O_DIRECT wants buffers, offsets and sizes in multiples of this */
+#define WRITER_ALIGNMENT 4096
+
+/**
+ * A buffer on its way to the disk, the oldest at the head of the ring.
+ */
+struct Block {
+  char *     data;
+  size_t     size;
+  curl_off_t offset;
+};
+
+struct Writer {
+  int  fd;
+  int  flags; /* of `fd` before the writer changed them */
+  bool direct;
+  bool direct_set;
+
+  /*
+   * Ring of the blocks, `queued` of them from `head` on wait for the
+   * thread. The transfer fills the one at `fill`, which takes the data
+   * after `offset`.
+   */
+  struct Block *blocks;
+  int           block_count;
+  int           head;
+  int           queued;
+  int           fill;
+  curl_off_t    offset;
+
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  changed;
+  bool            stop;
+  int             error; /* errno of the first write that failed */
+};
+
+static void set_direct(struct Writer *w, bool direct) {
+  if (direct != w->direct_set &&
+      fcntl(w->fd, F_SETFL, direct ? w->flags | O_DIRECT : w->flags) == 0) {
+    w->direct_set = direct;
+  }
+}
+
+static int write_block(struct Writer *w, const struct Block *block) {
+  size_t done = 0;
+
+  /* the first and the last block are usually cut, they use the page cache */
+  set_direct(w, w->direct && block->offset % WRITER_ALIGNMENT == 0 &&
+                  block->size % WRITER_ALIGNMENT == 0);
+
+  while (done < block->size) {
+    ssize_t n = pwrite(w->fd, block->data + done, block->size - done,
+                       block->offset + done);
+
+    if (n < 0 && errno == EINVAL && w->direct_set) {
+      /* the file system doesn't do O_DIRECT after all */
+      w->direct = false;
+      set_direct(w, false);
+      continue;
+    }
+    if (n < 0 && errno != EINTR) {
+      return errno;
+    }
+    if (n > 0) {
+      done += n;
+    }
+  }
+  return 0;
+}
+
+static void *write_worker(void *arg) {
+  struct Writer *w = (struct Writer *)arg;
+
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (!w->stop && !w->queued) {
+      pthread_cond_wait(&w->changed, &w->lock);
+    }
+    if (!w->queued) {
+      break;
+    }
+
+    struct Block *block = &w->blocks[w->head];
+    int           error = w->error;
+    pthread_mutex_unlock(&w->lock);
+    if (!error) {
+      error = write_block(w, block);
+    }
+    pthread_mutex_lock(&w->lock);
+
+    w->error  = error;
+    w->head   = (w->head + 1) % w->block_count;
+    w->queued--;
+    pthread_cond_broadcast(&w->changed);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+struct Writer *jirafeau_writer_new(int fd, curl_off_t offset, int queue,
+                                   bool direct) {
+  struct Writer *w = calloc(1, sizeof(struct Writer));
+
+  if (!w) {
+    return NULL;
+  }
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->changed, NULL);
+
+  w->fd          = fd;
+  w->flags       = fcntl(fd, F_GETFL);
+  w->direct      = direct && w->flags != -1;
+  w->offset      = offset;
+  w->block_count = queue + 1;
+  w->blocks      = queue > 0 ? calloc(w->block_count, sizeof(struct Block))
+                             : NULL;
+  if (w->blocks) {
+    w->blocks[0].offset = offset;
+  }
+  if (!w->blocks || pthread_create(&w->thread, NULL, write_worker, w) != 0) {
+    free(w->blocks);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->changed);
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+/**
+ * Hands the block being filled to the thread and waits for the next one to
+ * be free.
+ *
+ * @return false if a write failed
+ */
+static bool submit(struct Writer *w) {
+  struct Block *block = &w->blocks[w->fill];
+
+  pthread_mutex_lock(&w->lock);
+  w->offset += block->size;
+  w->queued++;
+  pthread_cond_broadcast(&w->changed);
+  /* after a failure the thread drops the blocks without writing them */
+  while (w->queued == w->block_count) {
+    pthread_cond_wait(&w->changed, &w->lock);
+  }
+  int error = w->error;
+  pthread_mutex_unlock(&w->lock);
+
+  w->fill       = (w->fill + 1) % w->block_count;
+  block         = &w->blocks[w->fill];
+  block->size   = 0;
+  block->offset = w->offset;
+
+  errno = error;
+  return !error;
+}
+
+bool jirafeau_writer_write(struct Writer *w, const char *data, size_t size) {
+  while (size) {
+    struct Block *block = &w->blocks[w->fill];
+
+    if (!block->data &&
+        posix_memalign((void **)&block->data, WRITER_ALIGNMENT,
+                       JIRAFEAU_WRITE_BUFFER_SIZE) != 0) {
+      block->data = NULL;
+      errno       = ENOMEM;
+      return false;
+    }
+
+    /* blocks end on a multiple of their size, so later ones are aligned */
+    size_t room = JIRAFEAU_WRITE_BUFFER_SIZE -
+                  (block->offset + block->size) % JIRAFEAU_WRITE_BUFFER_SIZE;
+    size_t n    = size < room ? size : room;
+
+    memcpy(block->data + block->size, data, n);
+    block->size += n;
+    data        += n;
+    size        -= n;
+
+    if (n == room && !submit(w)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void jirafeau_writer_reserve(struct Writer *w, curl_off_t size) {
+  const struct Block *block = &w->blocks[w->fill];
+
+  /* a file system that can't preallocate just gets fragmented */
+  if (size > 0) {
+    fallocate(w->fd, FALLOC_FL_KEEP_SIZE, block->offset + block->size, size);
+  }
+}
+
+bool jirafeau_writer_flush(struct Writer *w) {
+  bool ok = !w->blocks[w->fill].size || submit(w);
+
+  pthread_mutex_lock(&w->lock);
+  while (w->queued) {
+    pthread_cond_wait(&w->changed, &w->lock);
+  }
+  int error = w->error;
+  pthread_mutex_unlock(&w->lock);
+
+  errno = error;
+  return ok && !error;
+}
+
+void jirafeau_writer_free(struct Writer *w) {
+  if (!w) {
+    return;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  w->stop = true;
+  pthread_cond_broadcast(&w->changed);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+
+  set_direct(w, false);
+  for (int i = 0; i < w->block_count; i++) {
+    free(w->blocks[i].data);
+  }
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->changed);
+  free(w->blocks);
+  free(w);
+}